@@ -16,7 +16,7 @@
  * more details.
  */
 
-#include <linux/pci_regs.h>
+#include <inttypes.h>
 
 #include <vfn/nvme.h>
 
@@ -44,76 +44,11 @@ static const struct nvme_ctrl_opts ctrl_opts = {
 	.ncqr = 63,
 };
 
-static inline off_t bar_offset(int bar)
-{
-	return PCI_BASE_ADDRESS_0 + bar * 4;
-}
-
-static void *nvme_configure_cmb(struct nvme_ctrl *ctrl, uint64_t *hwaddr, uint64_t *cba)
-{
-	uint64_t cap, szu, ofst;
-	uint32_t cmbloc, cmbsz, v32;
-	size_t len;
-	int bir;
-	void *cmb;
-	struct iommu_iova_range *iova_ranges;
-	int num_iova_ranges;
-
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-
-	if (NVME_GET(cap, CAP_CMBS))
-		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(0x1));
-
-	cmbsz = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBSZ));
-	cmbloc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBLOC));
-
-	szu = 1 << (12 + 4 * NVME_GET(cmbsz, CMBSZ_SZU));
-	len = szu * NVME_GET(cmbsz, CMBSZ_SZ);
-
-	ofst = szu * NVME_GET(cmbloc, CMBLOC_OFST);
-	bir = NVME_GET(cmbloc, CMBLOC_BIR);
-
-	printf("cmb bar is %d\n", bir);
-
-	if (vfio_pci_read_config(&ctrl->pci, &v32, sizeof(v32), bar_offset(bir)) < 0)
-		err(1, "failed to read pci config");
-
-	*hwaddr = v32 & PCI_BASE_ADDRESS_MEM_MASK;
-
-	if (vfio_pci_read_config(&ctrl->pci, &v32, sizeof(v32), bar_offset(bir + 1)) < 0)
-		err(1, "failed to read pci config");
-
-	*hwaddr |= (uint64_t)v32 << 32;
-
-	printf("cmb bar is mapped at physical address 0x%lx\n", *hwaddr);
-
-	/* map the cmb */
-	cmb = vfio_pci_map_bar(&ctrl->pci, bir, len, ofst, PROT_READ | PROT_WRITE);
-	if (!cmb)
-		err(1, "failed to map cmb");
-
-	if (!NVME_GET(cap, CAP_CMBS)) {
-		*cba = *hwaddr;
-		return cmb;
-	}
-
-	/* choose a base address that is guaranteed not to be involved in dma */
-	num_iova_ranges = iommu_get_iova_ranges(__iommu_ctx(ctrl), &iova_ranges);
-	*cba = ALIGN_UP(iova_ranges[num_iova_ranges - 1].last + 1, 4096);
-	printf("assigned cmb base address is 0x%lx\n", *cba);
-
-	/* set the base address and enable the memory space */
-	mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(*cba | 0x3));
-
-	return cmb;
-}
-
 int main(int argc, char **argv)
 {
 	struct nvme_ctrl src = {}, dst = {};
 
-	uint64_t hwaddr, cba;
-	void *cmb;
+	uint64_t iova;
 
 	union nvme_cmd cmd = {};
 	struct nvme_id_ctrl *id_ctrl;
@@ -136,21 +71,29 @@ int main(int argc, char **argv)
 	if (nvme_init(&dst, bdfs[1], &ctrl_opts))
 		err(1, "failed to initialize destination nvme controller");
 
-	cmb = nvme_configure_cmb(&dst, &hwaddr, &cba);
+	/* map the cmb of the destination as a dma target of the source */
+	if (nvme_cmb_map(&dst, __iommu_ctx(&src), &iova))
+		err(1, "failed to map cmb");
+
+	printf("cmb is mapped at iova 0x%" PRIx64 " (controller base address 0x%" PRIx64 ")\n",
+	       iova, dst.cmb.cba);
 
 	cmd.identify = (struct nvme_cmd_identify) {
 		.opcode = nvme_admin_identify,
 		.cns = NVME_IDENTIFY_CNS_CTRL,
 
-		/* external reference; use the system address */
-		.dptr.prp1 = cpu_to_le64(hwaddr),
+		/* external reference; use the address in the source iommu context */
+		.dptr.prp1 = cpu_to_le64(iova),
 	};
 
 	if (nvme_admin(&src, &cmd, NULL, 0, NULL))
 		err(1, "nvme_admin");
 
-	id_ctrl = (struct nvme_id_ctrl __force *)cmb;
+	id_ctrl = (struct nvme_id_ctrl __force *)dst.cmb.vaddr;
 	printf("identity controller VER field value is %x\n", id_ctrl->ver);
 
+	nvme_close(&dst);
+	nvme_close(&src);
+
 	return 0;
 }
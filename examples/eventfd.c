@@ -46,7 +46,7 @@ int main(int argc, char **argv)
 {
 	void *vaddr;
 	uint64_t iova, v;
-	int ret, efd, efds[2] = {-1, -1};
+	int ret, efd, irq;
 
 	struct nvme_ctrl ctrl = {};
 	struct nvme_rq *rq;
@@ -66,16 +66,20 @@ int main(int argc, char **argv)
 	if (nvme_init(&ctrl, bdf, &ctrl_opts))
 		err(1, "failed to init nvme controller");
 
-	efds[1] = efd = eventfd(0, EFD_CLOEXEC);
+	efd = eventfd(0, EFD_CLOEXEC);
 	if (efd < 0)
 		err(1, "failed to create eventfd");
 
-	if (vfio_set_irq(&ctrl.pci.dev, efds, 2))
-		err(1, "failed to set irqs");
-
-	if (nvme_create_ioqpair(&ctrl, 1, 64, 1, 0x0))
+	if (nvme_create_ioqpair(&ctrl, 1, 64, NVME_CQ_VECTOR_ALLOC, 0x0))
 		err(1, "could not create io queue pair");
 
+	if (nvme_cq_set_eventfd(&ctrl, &ctrl.cq[1], efd))
+		err(1, "failed to set irq");
+
+	irq = vfio_pci_get_host_irq(&ctrl.pci, ctrl.cq[1].vector);
+	if (irq >= 0)
+		fprintf(stderr, "vector %d is host irq %d\n", ctrl.cq[1].vector, irq);
+
 	vaddr = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
 
 	if (iommu_map_vaddr(__iommu_ctx(&ctrl), vaddr, 0x1000, &iova, 0x0))
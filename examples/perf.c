@@ -170,12 +170,9 @@ static void run(void)
 
 	stats.tmin = UINT64_MAX;
 
-	mem = mmap(NULL, io_depth * 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	mem = iommu_dma_alloc(__iommu_ctx(&ctrl), io_depth * 0x1000, &iova);
 	if (!mem)
-		err(1, "mmap");
-
-	if (iommu_map_vaddr(__iommu_ctx(&ctrl), mem, io_depth * 0x1000, &iova, 0x0))
-		err(1, "failed to map");
+		err(1, "failed to allocate dma buffer");
 
 	do {
 		struct nvme_rq *rq;
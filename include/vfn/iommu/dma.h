@@ -19,16 +19,28 @@
  * @IOMMU_MAP_EPHEMERAL: If set, the mapping is considered temporary
  * @IOMMU_MAP_NOWRITE: DMA is not allowed to write to this mapping
  * @IOMMU_MAP_NOREAD: DMA is not allowed to read from this mapping
+ * @IOMMU_MAP_MERGE: Merge with adjacent mappings
  *
  * IOMMU_MAP_EPHEMERAL may change how the iova is allocated. I.e., currently,
- * the vfio-based backend will allocate an IOVA from a reserved range of 64k.
- * The iommufd-based backend has no such restrictions.
+ * the vfio-based backend will allocate an IOVA from a reserved window (2M by
+ * default; see the ``ephemeral_iova_size`` build option) that is handed out
+ * to threads in small chunks, such that allocation does not take any locks.
+ * Large mappings, or mappings made while the window is exhausted, fall back
+ * to regular IOVA allocation. The iommufd-based backend has no such
+ * restrictions.
+ *
+ * IOMMU_MAP_MERGE causes the mapping to be merged with mappings that are
+ * adjacent in both virtual and I/O virtual address space, provided that they
+ * were also created with IOMMU_MAP_MERGE and the same flags. Merged mappings
+ * are subsequently treated as one by iommu_unmap_vaddr(). Ephemeral mappings
+ * are never merged.
  */
 enum iommu_map_flags {
 	IOMMU_MAP_FIXED_IOVA	= 1 << 0,
 	IOMMU_MAP_EPHEMERAL	= 1 << 1,
 	IOMMU_MAP_NOWRITE	= 1 << 2,
 	IOMMU_MAP_NOREAD	= 1 << 3,
+	IOMMU_MAP_MERGE		= 1 << 4,
 };
 
 /**
@@ -46,14 +58,62 @@ enum iommu_map_flags {
  * If @vaddr falls within an already mapped area, calculate the corresponding
  * iova instead.
  *
- * Note that, for the vfio backend, the allocated IOVA is not recycled when the
- * mapping is removed; the IOVA will never be allocated again.
+ * Allocated IOVAs are returned for reuse when the mapping is removed.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
 		    unsigned long flags);
 
+/**
+ * iommu_map_vaddrs - Map a batch of virtual memory areas
+ * @ctx: &struct iommu_ctx
+ * @iov: array of virtual memory areas to map
+ * @n: number of elements in @iov
+ * @iovas: array of @n I/O virtual addresses
+ * @flags: combination of enum iommu_map_flags
+ *
+ * Map each element of @iov like iommu_map_vaddr() and store its I/O virtual
+ * address in the corresponding element of @iovas (which holds the requested
+ * addresses on input if @flags contains IOMMU_MAP_FIXED_IOVA).
+ *
+ * I/O virtual addresses for the batch are reserved in one go and consecutive
+ * elements that are contiguous in virtual (and I/O virtual) address space are
+ * mapped together as a single mapping. Such elements are unmapped together as
+ * well (see iommu_unmap_range() for unmapping part of a mapping).
+ *
+ * Either all elements are mapped or none are. Ephemeral mappings are not
+ * supported and each element must be page aligned in both address and length.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EINVAL`` if
+ * an element is empty or not page aligned).
+ */
+int iommu_map_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iovas,
+		     unsigned long flags);
+
+/**
+ * iommu_share_vaddr - Share a mapping with another context
+ * @src: &struct iommu_ctx holding the mapping
+ * @dst: &struct iommu_ctx to share the mapping with
+ * @vaddr: virtual memory address within the mapping
+ *
+ * Map the entire mapping in @src that contains @vaddr into @dst at the same
+ * I/O virtual address, such that a buffer used with devices in several
+ * contexts is addressed identically by all of them. The mapping in @dst is
+ * independent of the one in @src and is removed with iommu_unmap_vaddr() on
+ * @dst.
+ *
+ * With the iommufd-based backend, the mapping is copied with
+ * ``IOMMU_IOAS_COPY`` and the pages pinned for @src are reused. The vfio-based
+ * backend has no equivalent and maps the memory again (devices in groups that
+ * share a container share all mappings to begin with). Ephemeral mappings
+ * cannot be shared.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If the I/O
+ * virtual address is already in use in @dst, ``errno`` is set to ``EEXIST``.
+ */
+int iommu_share_vaddr(struct iommu_ctx *src, struct iommu_ctx *dst, void *vaddr);
+
 /**
  * iommu_unmap_vaddr - Unmap a virtual memory address in the IOMMU
  * @ctx: &struct iommu_ctx
@@ -64,15 +124,130 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
  * mappings created using iommu_map_vaddr(). If @len is not NULL, the length of
  * the mapping will be written to the pointee.
  *
+ * If lazy unmapping is enabled (see iommu_set_lazy_unmap()), the mapping is
+ * removed from the translation map immediately, but the IOMMU mapping is only
+ * removed when the deferred unmaps are flushed.
+ *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len);
 
+/**
+ * iommu_set_map_granule - Set the size of the kernel mappings backing mappings
+ * @ctx: &struct iommu_ctx
+ * @granule: size in bytes (a multiple of the host page size), or zero
+ *
+ * Subsequent mappings larger than @granule created with iommu_map_vaddr() are
+ * backed by several IOMMU mappings of @granule bytes at contiguous I/O virtual
+ * addresses, such that any part of them aligned to @granule can be unmapped
+ * with iommu_unmap_range() without disturbing the rest. Ephemeral mappings are
+ * always backed by a single IOMMU mapping, as are all mappings if @granule is
+ * zero (the default).
+ *
+ * Each IOMMU mapping counts against the limit of the backend (see
+ * &struct iommu_dma_stats).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_set_map_granule(struct iommu_ctx *ctx, size_t granule);
+
+/**
+ * iommu_set_lazy_unmap - Enable or disable lazy unmapping
+ * @ctx: &struct iommu_ctx
+ * @enable: whether to defer unmapping
+ *
+ * In lazy mode, iommu_unmap_vaddr() queues the mapping instead of unmapping
+ * it from the IOMMU right away. Queued mappings are unmapped in a batch, with
+ * mappings that are contiguous in I/O virtual address space coalesced into a
+ * single call to the IOMMU backend, amortizing the cost of IOTLB invalidation.
+ * The queue is flushed when it holds 256 mappings, on the first unmap after the
+ * oldest queued mapping is 10ms old, and by iommu_flush_unmaps(). There is no
+ * background timer. The I/O virtual addresses of queued mappings are not
+ * reused before they are flushed.
+ *
+ * Until flushed, the device may still access the memory of a queued mapping,
+ * and the memory stays pinned. Disabling lazy mode flushes the queue.
+ */
+void iommu_set_lazy_unmap(struct iommu_ctx *ctx, bool enable);
+
+/**
+ * iommu_flush_unmaps - Flush deferred unmaps
+ * @ctx: &struct iommu_ctx
+ *
+ * Unmap all mappings queued by iommu_unmap_vaddr() in lazy mode from the
+ * IOMMU (see iommu_set_lazy_unmap()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_flush_unmaps(struct iommu_ctx *ctx);
+
+/**
+ * iommu_unmap_vaddrs - Unmap a batch of virtual memory areas
+ * @ctx: &struct iommu_ctx
+ * @iov: array of virtual memory areas to unmap
+ * @n: number of elements in @iov
+ *
+ * Remove the mappings associated with the base address of each element of
+ * @iov, like iommu_unmap_vaddr() (the element lengths are ignored). Elements
+ * that fall within a mapping already removed by a previous element are
+ * skipped. Mappings that are consecutive in I/O virtual address space are
+ * unmapped with a single call to the IOMMU backend.
+ *
+ * On error, mappings associated with elements preceding the failing element
+ * may have been removed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_unmap_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n);
+
+/**
+ * iommu_unmap_range - Unmap a range of virtual memory in the IOMMU
+ * @ctx: &struct iommu_ctx
+ * @vaddr: start of the range
+ * @len: length of the range
+ *
+ * Remove all parts of mappings that overlap the range [@vaddr, @vaddr + @len).
+ * Mappings that are only partially covered by the range are split and the
+ * remaining parts keep their I/O virtual addresses; the remaining parts stay
+ * mapped throughout.
+ *
+ * Since the IOMMU backends cannot portably unmap part of a kernel mapping, a
+ * mapping can only be split along the boundaries of the kernel mappings
+ * backing it (see iommu_set_map_granule()); otherwise, the range is rejected
+ * with ``EINVAL``. Mappings preceding the one that cannot be split may have
+ * been removed.
+ *
+ * @vaddr and @len must be aligned to the host page size.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_unmap_range(struct iommu_ctx *ctx, void *vaddr, size_t len);
+
+/**
+ * iommu_for_each_mapping - Iterate over mappings in a range
+ * @ctx: &struct iommu_ctx
+ * @vaddr: start of the range
+ * @len: length of the range (or zero for no upper bound)
+ * @fn: callback
+ * @opaque: opaque argument to @fn
+ *
+ * Call @fn for each mapping that overlaps the range [@vaddr, @vaddr + @len), in
+ * order of increasing virtual address, until @fn returns non-zero. @fn must not
+ * modify mappings in @ctx.
+ *
+ * Return: the number of mappings visited.
+ */
+int iommu_for_each_mapping(struct iommu_ctx *ctx, void *vaddr, size_t len,
+			   int (*fn)(void *opaque, void *vaddr, size_t len, uint64_t iova),
+			   void *opaque);
+
 /**
  * iommu_unmap_all - Unmap all virtual memory address in the IOMMU
  * @ctx: &struct iommu_ctx
  *
- * Remove all mappings.
+ * Remove all mappings. This also resets the DMA heap (see iommu_dma_alloc())
+ * and drops the registration cache (see iommu_cache_get()); buffers allocated
+ * from the heap are no longer valid.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
@@ -85,6 +260,136 @@ struct iommu_iova_range {
 };
 #endif
 
+/**
+ * iommu_dma_alloc - Allocate a DMA buffer
+ * @ctx: &struct iommu_ctx
+ * @len: size of the buffer in bytes
+ * @iova: output parameter for the I/O virtual address of the buffer
+ *
+ * Allocate a buffer that is mapped in the IOMMU. Buffers of up to 128k are
+ * served from per-thread caches of power of two sized objects carved from
+ * large pre-mapped arenas, such that allocation does not touch the IOMMU in
+ * steady state. Such buffers are naturally aligned up to the host page size.
+ * Larger buffers are allocated and mapped individually.
+ *
+ * Memory backing small buffers is only unmapped by iommu_unmap_all(), but is
+ * reused by subsequent allocations once freed. The buffer must be released
+ * with iommu_dma_free().
+ *
+ * Return: The virtual address of the buffer, or ``NULL`` on error and sets
+ * ``errno``.
+ */
+void *iommu_dma_alloc(struct iommu_ctx *ctx, size_t len, uint64_t *iova);
+
+/**
+ * iommu_dma_free - Free a DMA buffer
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual address of the buffer
+ * @len: size of the buffer (as given to iommu_dma_alloc())
+ *
+ * Free a buffer allocated with iommu_dma_alloc(). The buffer must not be
+ * the target of any DMA in flight. If @vaddr is ``NULL`` or the buffer was
+ * invalidated by iommu_unmap_all(), do nothing.
+ */
+void iommu_dma_free(struct iommu_ctx *ctx, void *vaddr, size_t len);
+
+/**
+ * struct iommu_dma_region - DMA region shareable between processes
+ * @vaddr: virtual address of the region in this process
+ * @len: size of the region in bytes
+ * @iova: I/O virtual address of the region
+ * @fd: memfd backing the region
+ */
+struct iommu_dma_region {
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+	int fd;
+};
+
+/**
+ * enum iommu_dma_region_flags - flags for iommu_dma_region_create()
+ * @IOMMU_DMA_REGION_HUGETLB: Back the region with huge pages (hugetlbfs)
+ */
+enum iommu_dma_region_flags {
+	IOMMU_DMA_REGION_HUGETLB	= 1 << 0,
+};
+
+/**
+ * iommu_dma_region_create - Create a shareable DMA region
+ * @ctx: &struct iommu_ctx
+ * @region: &struct iommu_dma_region to initialize
+ * @len: size of the region in bytes
+ * @flags: combination of &enum iommu_dma_region_flags
+ *
+ * Allocate a region backed by a shared memory file descriptor (memfd) and map
+ * it in the IOMMU. The size is rounded up to the page size of the backing
+ * memory. The file is sealed against resizing, such that processes importing
+ * the region cannot release pages that may be the target of DMA; creation fails
+ * if the file cannot be sealed.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int iommu_dma_region_create(struct iommu_ctx *ctx, struct iommu_dma_region *region, size_t len,
+			    unsigned long flags);
+
+/**
+ * iommu_dma_region_destroy - Destroy a DMA region
+ * @ctx: &struct iommu_ctx the region was created with, or ``NULL`` for
+ *       imported regions
+ * @region: &struct iommu_dma_region
+ *
+ * Unmap the region (from the IOMMU, if @ctx is given) and close the backing
+ * file descriptor. The memory is released once all processes sharing the
+ * region have destroyed it.
+ */
+void iommu_dma_region_destroy(struct iommu_ctx *ctx, struct iommu_dma_region *region);
+
+/**
+ * iommu_dma_region_send - Export a DMA region to another process
+ * @sock: connected UNIX domain socket
+ * @region: &struct iommu_dma_region
+ *
+ * Send the file descriptor backing @region along with its size and I/O
+ * virtual address over @sock. The peer imports the region with
+ * iommu_dma_region_recv().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int iommu_dma_region_send(int sock, const struct iommu_dma_region *region);
+
+/**
+ * iommu_dma_region_recv - Import a DMA region from another process
+ * @sock: connected UNIX domain socket
+ * @region: &struct iommu_dma_region to initialize
+ *
+ * Receive a region exported with iommu_dma_region_send() and map it into the
+ * address space of the calling process. The region is not mapped in any IOMMU
+ * context of the calling process; @region->iova is the I/O virtual address
+ * of the region in the context of the exporting process (see
+ * iommu_dma_region_iova()), such that buffers in the region can be passed
+ * back to the exporter by address without copying. Release the region with
+ * iommu_dma_region_destroy() and a ``NULL`` context.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int iommu_dma_region_recv(int sock, struct iommu_dma_region *region);
+
+/**
+ * iommu_dma_region_iova - Get the I/O virtual address of an address in a region
+ * @region: &struct iommu_dma_region
+ * @vaddr: virtual address within @region
+ *
+ * Return: The I/O virtual address corresponding to @vaddr.
+ */
+static inline uint64_t iommu_dma_region_iova(const struct iommu_dma_region *region, void *vaddr)
+{
+	return region->iova + (uint64_t)((char *)vaddr - (char *)region->vaddr);
+}
+
 /**
  * iommu_translate_vaddr - Translate a virtual address into an iova
  * @ctx: &struct iommu_ctx
@@ -92,12 +397,103 @@ struct iommu_iova_range {
  * @iova: output parameter
  *
  * Use the iova map within the iommu context to lookup and translate the given
- * virtual address into an I/O virtual address.
+ * virtual address into an I/O virtual address. Recent translations are cached
+ * per thread, so repeated lookups within the same mappings are cheap.
  *
  * Return: ``true`` on success, ``false`` if no mapping was found.
  */
 bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, uint64_t *iova);
 
+/**
+ * struct iommu_dma_stats - DMA mapping accounting
+ * @pinned: number of bytes mapped in the IOMMU
+ * @nmappings: number of mappings
+ * @memlock: limit on locked memory in bytes (``RLIMIT_MEMLOCK``), or zero if
+ *           unlimited
+ * @dma_avail: maximum number of mappings allowed by the IOMMU backend, or zero
+ *             if unknown
+ *
+ * Mappings that have been merged (see IOMMU_MAP_MERGE) count as one, and
+ * mappings pending a deferred unmap (see iommu_set_lazy_unmap()) are counted
+ * as mapped.
+ */
+struct iommu_dma_stats {
+	size_t pinned;
+	unsigned int nmappings;
+
+	size_t memlock;
+	unsigned int dma_avail;
+};
+
+/**
+ * iommu_get_dma_stats - Get DMA mapping accounting
+ * @ctx: &struct iommu_ctx
+ * @stats: output parameter
+ *
+ * Store the amount of memory mapped in the IOMMU through @ctx, along with the
+ * applicable limits, in @stats.
+ */
+void iommu_get_dma_stats(struct iommu_ctx *ctx, struct iommu_dma_stats *stats);
+
+/**
+ * iommu_cache_get - Map a buffer through the registration cache
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual address of the buffer
+ * @len: length of the buffer
+ * @iova: output parameter for the I/O virtual address of @vaddr
+ *
+ * Translate @vaddr, mapping the pages spanned by the buffer on first use. The
+ * mapping is kept in the cache after the buffer is released with
+ * iommu_cache_put(), such that repeated use of the same buffer does not remap
+ * it. Idle mappings are evicted in least recently used order (approximated)
+ * when the cache exceeds its budget (see iommu_cache_set_budget()), when the
+ * number of mappings nears the limit of the IOMMU backend, or when mapping
+ * fails due to a kernel limit (e.g., ``RLIMIT_MEMLOCK``).
+ *
+ * Buffers within mappings made outside of the cache are only translated.
+ *
+ * The cache does not track changes to the address space; a buffer must be
+ * evicted with iommu_cache_evict() before its memory is unmapped.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If the buffer
+ * overlaps a cached mapping that is in use, ``errno`` is set to ``EBUSY``.
+ */
+int iommu_cache_get(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova);
+
+/**
+ * iommu_cache_put - Release a buffer mapped through the registration cache
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual address of the buffer (as given to iommu_cache_get())
+ *
+ * Release a reference to the cached mapping acquired with iommu_cache_get().
+ * The mapping may be evicted once all references are released.
+ */
+void iommu_cache_put(struct iommu_ctx *ctx, void *vaddr);
+
+/**
+ * iommu_cache_evict - Evict cached mappings
+ * @ctx: &struct iommu_ctx
+ * @vaddr: start of the range
+ * @len: length of the range
+ *
+ * Unmap all cached mappings overlapping [@vaddr, @vaddr + @len).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If a mapping is
+ * in use, ``errno`` is set to ``EBUSY``.
+ */
+int iommu_cache_evict(struct iommu_ctx *ctx, void *vaddr, size_t len);
+
+/**
+ * iommu_cache_set_budget - Limit the size of the registration cache
+ * @ctx: &struct iommu_ctx
+ * @budget: maximum number of bytes mapped by the cache, or zero for no limit
+ *
+ * Set the number of bytes that the cache may keep mapped, evicting idle
+ * mappings as needed. Mappings in use are never evicted, so the budget may be
+ * exceeded temporarily.
+ */
+void iommu_cache_set_budget(struct iommu_ctx *ctx, size_t budget);
+
 /**
  * iommu_get_iova_ranges - Get iova ranges
  * @ctx: &struct iommu_ctx
@@ -41,6 +41,7 @@ extern "C" {
 #include <vfn/nvme/queue.h>
 #include <vfn/nvme/ctrl.h>
 #include <vfn/nvme/util.h>
+#include <vfn/nvme/buf.h>
 #include <vfn/nvme/rq.h>
 
 #ifdef __cplusplus
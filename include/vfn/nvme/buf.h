@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_BUF_H
+#define LIBVFN_NVME_BUF_H
+
+/**
+ * struct nvme_buf - Registered buffer
+ * @vaddr: virtual address of the buffer
+ * @len: length of the buffer
+ * @iova: I/O virtual address of the buffer
+ *
+ * A buffer that is mapped in the IOMMU and has a prebuilt PRP list describing
+ * all of its memory pages. See nvme_buf_register().
+ */
+struct nvme_buf {
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+
+	/* private: */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+	} prplist;
+
+	int pageshift;
+
+	/* data entries per prp list page */
+	int nprps;
+
+	bool do_unmap;
+};
+
+/**
+ * nvme_buf_register - Register a buffer for use with nvme_rq_map_buf()
+ * @ctrl: &struct nvme_ctrl
+ * @buf: &struct nvme_buf to initialize
+ * @vaddr: virtual address of the buffer
+ * @len: length of the buffer
+ *
+ * Map the buffer at @vaddr in the IOMMU (unless already mapped) and build a PRP
+ * list covering all of its memory pages in DMA-visible memory. Commands
+ * transferring to or from the buffer can then use nvme_rq_map_buf() to point
+ * the data pointer at the prebuilt list instead of building one per request.
+ *
+ * @vaddr must be aligned to the host page size. If @vaddr is already mapped,
+ * the existing mapping must cover the entire buffer contiguously in I/O
+ * virtual address space; otherwise, ``EEXIST`` is returned.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_buf_register(struct nvme_ctrl *ctrl, struct nvme_buf *buf, void *vaddr, size_t len);
+
+/**
+ * nvme_buf_unregister - Unregister a buffer
+ * @ctrl: &struct nvme_ctrl
+ * @buf: &struct nvme_buf
+ *
+ * Release the prebuilt PRP list and remove the IOMMU mapping of the buffer (if
+ * created by nvme_buf_register()). The buffer must not be in use by any
+ * outstanding commands.
+ */
+void nvme_buf_unregister(struct nvme_ctrl *ctrl, struct nvme_buf *buf);
+
+#endif /* LIBVFN_NVME_BUF_H */
@@ -15,6 +15,9 @@
 
 #define NVME_CTRL_MPS 0
 
+/* see nvme_create_iocq() */
+#define NVME_CQ_VECTOR_ALLOC (-2)
+
 /**
  * struct nvme_ctrl_opts - NVMe controller options
  * @nsqr: number of submission queues to request
@@ -74,6 +77,62 @@ struct nvme_ctrl {
 		void *eventidxs;
 	} dbbuf;
 
+	/**
+	 * @prp_pool: pool of prp list pages shared by all queues
+	 */
+	struct nvme_prp_pool prp_pool;
+
+	/**
+	 * @cmb: controller memory buffer (see nvme_cmb_map())
+	 *
+	 * @cmb.vaddr is the virtual address of the mapped cmb and @cmb.cba is
+	 * the address by which the controller itself identifies it. @cmb.wc is
+	 * a write-combining view of the same memory for bulk cpu copies (see
+	 * mmio_memcpy_wc()), or ``NULL`` if it could not be mapped.
+	 */
+	struct {
+		void *vaddr, *wc;
+		size_t len;
+		uint64_t cba;
+
+		/* private: */
+		struct iommu_ctx *ctx;
+		int bar;
+		uint64_t offset;
+	} cmb;
+
+	/**
+	 * @pmr: persistent memory region (see nvme_pmr_map())
+	 *
+	 * @pmr.vaddr is the virtual address of the mapped pmr.
+	 */
+	struct {
+		void *vaddr;
+		size_t len;
+
+		/* private: */
+		int bar;
+		bool sts_barrier;
+	} pmr;
+
+	/**
+	 * @hmb: host memory buffer provided to the controller
+	 *
+	 * @hmb.size is the size of the buffer in bytes (zero if the controller
+	 * does not use one). The buffer is set up by nvme_init() (limited by
+	 * the ``hmb_max_size`` build option) and released by nvme_close().
+	 */
+	struct {
+		size_t size;
+
+		/* private: */
+		void **chunks;
+		size_t chunk_size;
+		int nchunks;
+		void *descs;
+		ssize_t descs_len;
+	} hmb;
+
 	/**
 	 * @opts: controller options
 	 */
@@ -81,15 +140,22 @@ struct nvme_ctrl {
 
 	/**
 	 * @config: cached run-time controller configuration
+	 *
+	 * @config.mdts is the maximum data transfer size in bytes (zero if the
+	 * controller does not report a limit).
 	 */
 	struct {
 		int nsqa, ncqa;
 		int mqes;
 		int mps;
+		size_t mdts;
 	} config;
 
 	/* private: internal */
 	unsigned long flags;
+
+	/* number of completion queues using each interrupt vector */
+	int *vectors;
 };
 
 /**
@@ -144,9 +210,12 @@ int nvme_enable(struct nvme_ctrl *ctrl);
  * @vector: interrupt vector
  *
  * Create an I/O Completion Queue on @ctrl with identifier @qid and size @qsize.
- * Set @vector to -1 to disable interrupts. If you associate an interrupt
- * vector, you need to use vfio_set_irq() to associate the vector with an
- * eventfd.
+ * Set @vector to -1 to disable interrupts or to %NVME_CQ_VECTOR_ALLOC to use the
+ * least used vector (vectors are only shared once all are in use). The vector
+ * is recorded in &nvme_cq.vector. If you associate an interrupt vector, you
+ * need to use nvme_cq_set_eventfd() (or vfio_set_irq()) to associate the
+ * vector with an eventfd. The vector is disabled when the last completion
+ * queue using it is deleted.
  *
  * **Note** that one slot in the queue is reserved for the full queue condition.
  * So, if a queue command depth of ``N`` is required, qsize should be ``N + 1``.
@@ -156,6 +225,21 @@ int nvme_enable(struct nvme_ctrl *ctrl);
  */
 int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector);
 
+/**
+ * nvme_cq_set_eventfd - Signal an eventfd on completion queue interrupts
+ * @ctrl: Controller reference
+ * @cq: Completion queue created with an interrupt vector
+ * @eventfd: eventfd to signal, or ``-1`` to disable the vector
+ *
+ * Enable the interrupt vector of @cq, leaving the vectors of other queues
+ * as-is. See vfio_set_irq_vector() and, for steering the interrupt to the
+ * cpu polling the eventfd, vfio_pci_set_irq_affinity().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_cq_set_eventfd(struct nvme_ctrl *ctrl, struct nvme_cq *cq, int eventfd);
+
 /**
  * nvme_delete_iocq - Delete an I/O Completion Queue
  * @ctrl: See &struct nvme_ctrl
@@ -234,4 +318,90 @@ int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
  */
 int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid);
 
+/**
+ * nvme_sq_alloc_meta - Allocate per-request metadata buffers
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: Submission queue
+ * @size: Size of the metadata buffer of each request tracker
+ *
+ * Allocate and map an arena holding a metadata buffer of @size bytes (rounded
+ * up to a dword) for each request tracker of @sq. See nvme_rq_meta(). The arena
+ * is released when the submission queue is deleted.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_sq_alloc_meta(struct nvme_ctrl *ctrl, struct nvme_sq *sq, size_t size);
+
+/**
+ * nvme_cmb_map - Map the controller memory buffer as a DMA target
+ * @ctrl: Controller owning the CMB
+ * @ctx: &struct iommu_ctx of the device initiating the DMA
+ * @iova: output parameter for the I/O virtual address of the CMB in @ctx
+ *
+ * Enable the Controller Memory Buffer of @ctrl (if the controller supports
+ * the CMB memory space control register), map it into virtual memory
+ * (``ctrl->cmb.vaddr``) and map it in @ctx with iommu_map_bar(). Devices
+ * attached to @ctx (e.g., another controller) can then transfer data directly
+ * to and from the CMB using @iova, without going through host memory. The CMB
+ * is also mapped write-combining, if possible, for cpu copies
+ * (``ctrl->cmb.wc``; see vfio_pci_map_bar_wc()).
+ *
+ * Commands submitted to @ctrl itself must refer to the CMB by
+ * ``ctrl->cmb.cba``. If @ctx is the context of @ctrl, that is @iova.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENODEV`` if
+ * the controller has no CMB).
+ */
+int nvme_cmb_map(struct nvme_ctrl *ctrl, struct iommu_ctx *ctx, uint64_t *iova);
+
+/**
+ * nvme_cmb_unmap - Unmap the controller memory buffer
+ * @ctrl: Controller owning the CMB
+ *
+ * Disable and unmap a CMB mapped with nvme_cmb_map(). Called by nvme_close().
+ */
+void nvme_cmb_unmap(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_pmr_map - Enable and map the persistent memory region
+ * @ctrl: Controller owning the PMR
+ *
+ * Enable the Persistent Memory Region of @ctrl, wait for it to become ready
+ * and map it (write-combining, if possible; see vfio_pci_map_bar_wc()) at
+ * ``ctrl->pmr.vaddr``.
+ *
+ * Writes to the PMR are not persistent until nvme_pmr_persist() returns. For
+ * small durable updates (e.g., journal commits), mmio_memcpy_wc() followed by
+ * nvme_pmr_persist() avoids the round-trips of a write and a flush command.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENODEV`` if
+ * the controller has no PMR, ``EOPNOTSUPP`` if the PMR does not support writes
+ * or a usable write barrier mechanism).
+ */
+int nvme_pmr_map(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_pmr_unmap - Unmap the persistent memory region
+ * @ctrl: Controller owning the PMR
+ *
+ * Persist outstanding writes, disable and unmap a PMR mapped with
+ * nvme_pmr_map(). Called by nvme_close().
+ */
+void nvme_pmr_unmap(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_pmr_persist - Make prior writes to the persistent memory region durable
+ * @ctrl: Controller owning the PMR
+ *
+ * Fence all prior stores to the PMR and issue the read that the controller
+ * defines as its write barrier (a read of the PMRSTS register or of the PMR
+ * itself; see PMRCAP.PMRWBM). When this returns successfully, the writes are
+ * persistent.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EINVAL`` if
+ * the PMR is not mapped, ``EIO`` if the PMR reports that it is not healthy).
+ */
+int nvme_pmr_persist(struct nvme_ctrl *ctrl);
+
 #endif /* LIBVFN_NVME_CTRL_H */
@@ -44,6 +44,92 @@ struct nvme_cq {
 	int vector;
 };
 
+/**
+ * struct nvme_prp_page - PRP list page
+ */
+struct nvme_prp_page {
+	/* private: */
+	void *vaddr;
+	uint64_t iova;
+
+	/* index (plus one) of the next page; zero terminates */
+	uint32_t next;
+};
+
+/**
+ * struct nvme_prp_pool - Pool of pre-mapped PRP list pages
+ *
+ * Pages are used for PRP lists, that is, for requests that require more than
+ * two PRP entries. The free stack is lock-free; the top of the stack is an
+ * index (plus one) into @pages in the lower 32 bits and a generation tag in
+ * the upper 32 bits, guarding against ABA.
+ */
+struct nvme_prp_pool {
+	/* private: */
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+
+	int npages;
+	struct nvme_prp_page *pages;
+
+	uint64_t top;
+};
+
+/**
+ * nvme_prp_pool_get - Get a page from the PRP list page pool
+ * @pool: &struct nvme_prp_pool
+ *
+ * Pop a page from the free stack of @pool.
+ *
+ * Return: A &struct nvme_prp_page or ``NULL`` if none are available (and sets
+ * ``errno``).
+ */
+static inline struct nvme_prp_page *nvme_prp_pool_get(struct nvme_prp_pool *pool)
+{
+	struct nvme_prp_page *page;
+	uint64_t top, next;
+
+	top = atomic_load_acquire(&pool->top);
+
+	do {
+		if (!(uint32_t)top) {
+			errno = EBUSY;
+			return NULL;
+		}
+
+		page = &pool->pages[(uint32_t)top - 1];
+		next = (((top >> 32) + 1) << 32) | atomic_load_acquire(&page->next);
+	} while (!atomic_cmpxchg(&pool->top, top, next));
+
+	page->next = 0;
+
+	return page;
+}
+
+/**
+ * nvme_prp_pool_put - Return a list of pages to the PRP list page pool
+ * @pool: &struct nvme_prp_pool
+ * @head: first page
+ * @tail: last page
+ *
+ * Push the pages from @head to @tail (linked through &nvme_prp_page.next) on
+ * the free stack of @pool.
+ */
+static inline void nvme_prp_pool_put(struct nvme_prp_pool *pool, struct nvme_prp_page *head,
+				     struct nvme_prp_page *tail)
+{
+	uint64_t top, next;
+	uint32_t idx = (uint32_t)(head - pool->pages) + 1;
+
+	top = atomic_load_acquire(&pool->top);
+
+	do {
+		tail->next = (uint32_t)top;
+		next = (((top >> 32) + 1) << 32) | idx;
+	} while (!atomic_cmpxchg(&pool->top, top, next));
+}
+
 /**
  * struct nvme_sq - Submission Queue
  */
@@ -54,10 +140,15 @@ struct nvme_sq {
 	void *vaddr;
 	uint64_t iova;
 
+	/* prp list pages (shared by all queues) */
+	struct nvme_prp_pool *prp_pool;
+
+	/* metadata arena carved into per-request metadata buffers */
 	struct {
 		void *vaddr;
 		uint64_t iova;
-	} pages;
+		size_t len;
+	} meta;
 
 	uint16_t tail, ptail;
 	int qsize;
@@ -13,6 +13,27 @@
 #ifndef LIBVFN_NVME_RQ_H
 #define LIBVFN_NVME_RQ_H
 
+/**
+ * struct nvme_io - Split I/O tracker
+ * @opaque: Opaque data pointer
+ *
+ * Tracks an I/O that has been split into one or more child commands by
+ * nvme_io_rw(). The I/O is complete when all children have completed.
+ */
+struct nvme_io {
+	void *opaque;
+
+	/* private: */
+	struct nvme_sq *sq;
+
+	/* outstanding child commands */
+	int nchildren;
+
+	/* completion of the first failed (or else, the last) child */
+	struct nvme_cqe cqe;
+	bool failed;
+};
+
 /**
  * struct nvme_rq - Request tracker
  * @opaque: Opaque data pointer
@@ -25,14 +46,39 @@ struct nvme_rq {
 
 	uint16_t cid;
 
+	/* metadata buffer (see nvme_sq_alloc_meta()) */
 	struct {
 		void *vaddr;
 		uint64_t iova;
-	} page;
+	} meta;
+
+	/* prp list pages */
+	struct {
+		struct nvme_prp_page *head, *tail;
+	} chain;
+
+	/* parent if this is a child command of a split i/o */
+	struct nvme_io *io;
 
 	struct nvme_rq *rq_next;
 };
 
+/**
+ * __nvme_rq_put_chain - Return PRP list pages to the pool
+ * @rq: &struct nvme_rq
+ *
+ * Release any PRP list pages used by the request.
+ */
+static inline void __nvme_rq_put_chain(struct nvme_rq *rq)
+{
+	if (!rq->chain.head)
+		return;
+
+	nvme_prp_pool_put(rq->sq->prp_pool, rq->chain.head, rq->chain.tail);
+
+	rq->chain.head = rq->chain.tail = NULL;
+}
+
 /**
  * nvme_rq_reset - Reset a request tracker for reuse
  * @rq: &struct nvme_rq
@@ -42,6 +88,9 @@ struct nvme_rq {
 static inline void nvme_rq_reset(struct nvme_rq *rq)
 {
 	rq->opaque = NULL;
+	rq->io = NULL;
+
+	__nvme_rq_put_chain(rq);
 }
 
 /**
@@ -210,9 +259,13 @@ static inline void nvme_rq_exec(struct nvme_rq *rq, union nvme_cmd *cmd)
  * @iova: I/O Virtual Address
  * @len: Length of buffer
  *
- * Map a buffer of size @len into the command payload.
+ * Map a buffer of size @len into the command payload. If more than two PRP
+ * entries are required, PRP list pages are taken from the controller PRP list
+ * page pool (and chained as required); these are returned to the pool when the
+ * request tracker is released.
  *
- * Return: ``0`` on success, ``-1`` on error and sets errno.
+ * Return: ``0`` on success, ``-1`` on error and sets errno. If the PRP list
+ * page pool is exhausted, errno is set to ``EBUSY``.
  */
 int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
 		    size_t len);
@@ -228,13 +281,166 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
  *
  * Map the IOVAs contained in @iov into the request PRPs. The first entry is
  * allowed to be unaligned, but the entry MUST end on a page boundary. All
- * subsequent entries MUST be page aligned.
+ * subsequent entries MUST be page aligned. PRP lists are chained as required
+ * (see nvme_rq_map_prp()).
  *
  * Return: ``0`` on success, ``-1`` on error and sets errno.
  */
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov);
 
+/**
+ * nvme_cmd_map_meta - Set up the metadata pointer of the command
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @iova: I/O Virtual Address of the metadata buffer
+ *
+ * Point the metadata pointer (MPTR) of @cmd at a contiguous metadata buffer
+ * for namespaces formatted with separate metadata. @iova must be dword
+ * aligned.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+static inline int nvme_cmd_map_meta(union nvme_cmd *cmd, uint64_t iova)
+{
+	if (iova & 0x3) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmd->mptr = cpu_to_le64(iova);
+
+	return 0;
+}
+
+/**
+ * nvme_rq_meta - Use the metadata buffer of the request tracker
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ *
+ * Point the metadata pointer (MPTR) of @cmd at the metadata buffer of @rq,
+ * carved from the metadata arena of the submission queue (see
+ * nvme_sq_alloc_meta()). The buffer is reused when the request tracker is, so
+ * no per-command allocation or mapping is required.
+ *
+ * Return: The virtual address of the metadata buffer, or ``NULL`` if the
+ * submission queue has no metadata arena (and sets ``errno``).
+ */
+static inline void *nvme_rq_meta(struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	if (!rq->meta.vaddr) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cmd->mptr = cpu_to_le64(rq->meta.iova);
+
+	return rq->meta.vaddr;
+}
+
+/**
+ * nvme_rq_map_buf - Set up the data pointer of the command from a registered
+ *                   buffer
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @buf: &struct nvme_buf registered with nvme_buf_register()
+ * @offset: offset into @buf
+ * @len: length of the transfer
+ *
+ * Point the data pointer of @cmd at the prebuilt PRP list of @buf. No PRP
+ * entries are written, except in the (rare) case where the transfer ends on
+ * the first entry of a chained list page; the PRP list is then built as with
+ * nvme_rq_map_prp().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_buf(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		    struct nvme_buf *buf, size_t offset, size_t len);
+
+/**
+ * nvme_io_rw - Submit a read or write, splitting it as required
+ * @ctrl: &struct nvme_ctrl
+ * @sq: Submission queue (&struct nvme_sq)
+ * @io: &struct nvme_io to track the I/O
+ * @cmd: NVMe read or write command prototype (&union nvme_cmd)
+ * @iova: I/O Virtual Address
+ * @len: Length of buffer
+ * @lbads: LBA data size (as a power of two)
+ * @mptr: I/O Virtual Address of the separate metadata buffer (if @ms is not
+ *        zero)
+ * @ms: Metadata size per logical block (zero if none or if interleaved)
+ *
+ * Split the transfer of @len bytes, starting at the logical block given by the
+ * @cmd slba field, into child commands no larger than the maximum data transfer
+ * size of the controller (or, if the controller does not report a limit, what
+ * can be described by a single PRP list page). The number of logical blocks of
+ * @cmd is ignored. If @cmd requests reference tag checking
+ * (``NVME_RW_PRCHK_REF``), the initial reference tag of each child is advanced
+ * accordingly. If @ms is not zero, the metadata pointer of each child is set
+ * to the metadata of its first logical block in the contiguous buffer at @mptr
+ * (see nvme_cmd_map_meta()); it must be dword aligned for each child. The
+ * metadata pointer of @cmd must be zero.
+ *
+ * Request trackers for all children are acquired from @sq up front and the
+ * children are submitted as a batch with a single doorbell write. Completions
+ * must be passed to nvme_io_complete() (or use nvme_io_wait()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno. If @sq does not
+ * have enough free request trackers, errno is set to ``EBUSY`` and nothing is
+ * submitted.
+ */
+int nvme_io_rw(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_io *io,
+	       union nvme_cmd *cmd, uint64_t iova, size_t len, int lbads, uint64_t mptr,
+	       size_t ms);
+
+/**
+ * nvme_io_complete - Complete a child command of a split I/O
+ * @rq: Request tracker (&struct nvme_rq) of the child command
+ * @cqe: Completion queue entry (&struct nvme_cqe)
+ *
+ * Record the completion of the child command associated with @rq and release
+ * the request tracker. Use &nvme_rq.io (non-NULL for child commands) to tell
+ * child commands apart from other commands when reaping completions.
+ *
+ * Return: The parent &struct nvme_io if this was the last outstanding child,
+ * ``NULL`` otherwise.
+ */
+static inline struct nvme_io *nvme_io_complete(struct nvme_rq *rq, struct nvme_cqe *cqe)
+{
+	struct nvme_io *io = rq->io;
+
+	if (!io->failed && !nvme_cqe_ok(cqe)) {
+		memcpy(&io->cqe, cqe, sizeof(io->cqe));
+		io->failed = true;
+	}
+
+	nvme_rq_release_atomic(rq);
+
+	if (--io->nchildren)
+		return NULL;
+
+	if (!io->failed)
+		memcpy(&io->cqe, cqe, sizeof(io->cqe));
+
+	return io;
+}
+
+/**
+ * nvme_io_wait - Wait for completion of a split I/O
+ * @io: &struct nvme_io
+ * @cqe_copy: Output parameter to copy the completion queue entry into
+ * @ts: Maximum time to wait for each completion
+ *
+ * Reap completions from the completion queue associated with @io until all
+ * child commands have completed. If a completion for another command is
+ * reaped, set ``errno`` to ``EAGAIN`` and return ``-1``. The completion queue
+ * entry of the first failed child (or, if none failed, the last child) is
+ * copied into @cqe_copy (if not NULL).
+ *
+ * Return: ``0`` on success, ``-1`` on error and set ``errno``.
+ */
+int nvme_io_wait(struct nvme_io *io, struct nvme_cqe *cqe_copy, struct timespec *ts);
+
 /**
  * nvme_rq_spin - Spin for completion of the command associated with the request
  *                tracker
@@ -179,6 +179,24 @@ struct nvme_cmd_rw {
 };
 __static_assert(sizeof(struct nvme_cmd_rw) == 64);
 
+/**
+ * enum nvme_cmd_rw_control - Read/Write command control flags
+ * @NVME_RW_PRCHK_REF: Check the Reference Tag field
+ * @NVME_RW_PRCHK_APP: Check the Application Tag field
+ * @NVME_RW_PRCHK_GUARD: Check the Guard field
+ * @NVME_RW_PRACT: Protection Information Action
+ * @NVME_RW_FUA: Force Unit Access
+ * @NVME_RW_LR: Limited Retry
+ */
+enum nvme_cmd_rw_control {
+	NVME_RW_PRCHK_REF	= 1 << 10,
+	NVME_RW_PRCHK_APP	= 1 << 11,
+	NVME_RW_PRCHK_GUARD	= 1 << 12,
+	NVME_RW_PRACT		= 1 << 13,
+	NVME_RW_FUA		= 1 << 14,
+	NVME_RW_LR		= 1 << 15,
+};
+
 /**
  * union nvme_cmd - Generic NVMe command
  * @opcode: Opcode of the command to be executed
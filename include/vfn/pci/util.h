@@ -91,7 +91,9 @@ char *pci_get_driver(const char *bdf);
  * pci_get_iommu_group - Get iommu group path
  * @bdf: pci device identifier ("bus:device:function")
  *
- * Get the iommu group path (/dev/vfio/N) of the device identified by @bdf.
+ * Get the iommu group path (/dev/vfio/N) of the device identified by @bdf. The
+ * result is cached until the device is bound or unbound with pci_bind() or
+ * pci_unbind().
  *
  * Return: The path to the iommu group
  */
@@ -102,10 +104,84 @@ char *pci_get_iommu_group(const char *bdf);
  * @bdf: pci device identifier ("bus:device:function")
  *
  * Get the vfio device id (/sys/bus/pci/devices/%s/vfio-dev/vfio%d) of the
- * device identified by @bdf.
+ * device identified by @bdf. The result is cached like that of
+ * pci_get_iommu_group().
  *
  * Return: The vfio device id name
  */
 char *pci_get_device_vfio_id(const char *bdf);
 
+/**
+ * struct pci_device_info - Snapshot of a pci device
+ * @bdf: pci device identifier ("bus:device:function")
+ * @class: class code
+ * @vendor: vendor id
+ * @device: device id
+ * @subsystem_vendor: subsystem vendor id
+ * @subsystem_device: subsystem device id
+ * @numa_node: numa node of the device (or ``-1``)
+ * @link_width: current link width (or zero if unknown)
+ * @link_speed: current link speed (e.g., "16.0 GT/s PCIe"; empty if unknown)
+ * @driver: name of the bound driver (empty if unbound)
+ * @iommu_group: iommu group path (/dev/vfio/N; empty if none)
+ * @vfio_id: vfio device id (vfioN; empty if not bound to vfio-pci)
+ */
+struct pci_device_info {
+	char bdf[16];
+	uint32_t class;
+	uint16_t vendor, device;
+	uint16_t subsystem_vendor, subsystem_device;
+	int numa_node;
+	int link_width;
+	char link_speed[32];
+	char driver[32];
+	char iommu_group[32];
+	char vfio_id[32];
+};
+
+/**
+ * struct pci_topology - Snapshot of pci devices
+ * @ndevs: number of devices
+ * @devs: devices, sorted by bdf
+ */
+struct pci_topology {
+	int ndevs;
+	struct pci_device_info *devs;
+};
+
+/**
+ * pci_topology_scan - Take a snapshot of pci devices
+ * @topo: &struct pci_topology to initialize
+ * @class: class code to match
+ * @class_mask: bits of @class to match
+ *
+ * Scan /sys/bus/pci/devices in one pass, recording the devices whose class
+ * code matches @class in the bits set in @class_mask (e.g., ``0x010800`` and
+ * ``0xffff00`` for all NVMe controllers; a zero mask matches all devices).
+ * The iommu groups and vfio device ids found are also used to seed the cache
+ * used by pci_get_iommu_group() and pci_get_device_vfio_id(), such that
+ * opening the devices afterwards does not walk sysfs again.
+ *
+ * The snapshot is not updated. Release it with pci_topology_free().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int pci_topology_scan(struct pci_topology *topo, uint32_t class, uint32_t class_mask);
+
+/**
+ * pci_topology_find - Look up a device in a snapshot
+ * @topo: &struct pci_topology
+ * @bdf: pci device identifier ("bus:device:function")
+ *
+ * Return: The &struct pci_device_info of @bdf, or ``NULL`` if not found.
+ */
+const struct pci_device_info *pci_topology_find(const struct pci_topology *topo, const char *bdf);
+
+/**
+ * pci_topology_free - Release a snapshot
+ * @topo: &struct pci_topology
+ */
+void pci_topology_free(struct pci_topology *topo);
+
 #endif /* LIBVFN_PCI_UTIL_H */
@@ -86,4 +86,18 @@ static inline void mmio_hl_write64(void *addr, leint64_t v)
 	mmio_write32(addr, (leint32_t __force)v);
 }
 
+/**
+ * mmio_memcpy_wc - copy into write-combining device memory
+ * @dst: memory-mapped destination (e.g., mapped with vfio_pci_map_bar_wc())
+ * @src: source buffer
+ * @len: number of bytes to copy
+ *
+ * Copy @len bytes into device memory using full cache line, non-temporal
+ * stores where the architecture supports them (AVX or SSE2 streaming stores on
+ * x86_64) and naturally aligned stores otherwise. The stores are fenced before
+ * returning, such that the data is posted to the device before any subsequent
+ * store (e.g., a doorbell write).
+ */
+void mmio_memcpy_wc(void *dst, const void *src, size_t len);
+
 #endif /* LIBVFN_SUPPORT_MMIO_H */
@@ -20,6 +20,15 @@ struct vfio_device {
 
 	struct vfio_device_info device_info;
 	struct vfio_irq_info irq_info;
+
+	/* private: */
+	struct {
+		pthread_mutex_t lock;
+
+		/* eventfd of each vector (or -1) and number of vectors enabled */
+		int *eventfds;
+		int nvec;
+	} irq;
 };
 
 #define __iommu_ctx(x) (((struct vfio_device *)(x))->ctx)
@@ -37,11 +46,26 @@ struct vfio_device {
  */
 int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count);
 
+/**
+ * vfio_set_irq_vector - Enable or disable a single IRQ vector
+ * @dev: &struct vfio_device
+ * @vector: vector index
+ * @eventfd: eventfd to signal, or ``-1`` to disable the vector
+ *
+ * Associate @vector with @eventfd, leaving all other vectors as-is, such that
+ * interrupt-driven queues may be added and removed one at a time. If the
+ * kernel cannot grow the set of enabled vectors in place, all enabled vectors
+ * are briefly disabled and enabled again.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int vfio_set_irq_vector(struct vfio_device *dev, int vector, int eventfd);
+
 /**
  * vfio_disable_irq - Disable all IRQs
  * @dev: &struct vfio_device
  *
- * Disable all IRQs.
+ * Disable all IRQs and release the eventfd bookkeeping of the device.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
@@ -61,6 +61,35 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf);
 void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
 		       int prot);
 
+/**
+ * vfio_pci_map_bar_wc - map a vfio device region write-combining
+ * @pci: &struct vfio_pci_device
+ * @idx: the vfio region index to map
+ * @len: number of bytes to map
+ * @offset: offset at which to start mapping (page aligned)
+ * @prot: what accesses to permit to the mapped area (see ``man mmap``).
+ *
+ * Like vfio_pci_map_bar(), but request a write-combining mapping, such that
+ * consecutive stores are merged into full bus transactions. This is only
+ * possible for prefetchable memory BARs (such as a controller memory buffer)
+ * and requires access to the ``resourceN_wc`` file of the device in sysfs (and
+ * a kernel that allows mapping it while the device is bound to vfio-pci; see
+ * ``CONFIG_IO_STRICT_DEVMEM``); if that is not the case, the region is mapped
+ * uncached through the vfio device.
+ *
+ * The mapping is meant for cpu copies (such as filling a controller memory
+ * buffer) only; use iommu_map_bar() to make the region a DMA target.
+ *
+ * Stores to a write-combining mapping are weakly ordered; issue a wmb() before
+ * signalling the device (see also mmio_memcpy_wc()). The mapping is released
+ * with vfio_pci_unmap_bar().
+ *
+ * Return: On success, returns the virtual memory address mapped. On error,
+ * returns ``NULL`` and sets ``errno``.
+ */
+void *vfio_pci_map_bar_wc(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
+			  int prot);
+
 /**
  * vfio_pci_unmap_bar - unmap a vfio device region in virtual memory
  * @pci: &struct vfio_pci_device
@@ -75,6 +104,74 @@ void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_
 void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t len,
 			uint64_t offset);
 
+/**
+ * iommu_map_bar - Map a pci BAR for peer-to-peer DMA
+ * @ctx: &struct iommu_ctx of the device initiating the DMA
+ * @pci: &struct vfio_pci_device owning the BAR
+ * @bar: BAR index
+ * @offset: offset into the BAR (page aligned)
+ * @len: number of bytes to map (page aligned)
+ * @iova: output parameter for the I/O virtual address of the mapping
+ *
+ * Map the given range of a BAR of @pci into virtual memory and map that in
+ * @ctx, such that devices attached to @ctx may access the BAR directly (e.g.,
+ * to use a controller memory buffer as a DMA target). The IOMMU context of
+ * @pci need not be @ctx. The mapping is made through the vfio device and is
+ * uncached; map a separate write-combining view with vfio_pci_map_bar_wc() for
+ * bulk cpu copies.
+ *
+ * This relies on the kernel resolving device memory through a user space
+ * mapping, which is supported by the vfio type1 backend, but not by iommufd.
+ *
+ * Return: On success, returns the virtual address of the mapping. On error,
+ * returns ``NULL`` and sets ``errno`` (``EOPNOTSUPP`` if the backend does not
+ * support mapping device memory).
+ */
+void *iommu_map_bar(struct iommu_ctx *ctx, struct vfio_pci_device *pci, int bar, uint64_t offset,
+		    size_t len, uint64_t *iova);
+
+/**
+ * iommu_unmap_bar - Unmap a pci BAR mapped for peer-to-peer DMA
+ * @ctx: &struct iommu_ctx given to iommu_map_bar()
+ * @pci: &struct vfio_pci_device owning the BAR
+ * @bar: BAR index
+ * @mem: virtual address returned by iommu_map_bar()
+ * @offset: offset into the BAR
+ * @len: number of bytes mapped
+ *
+ * Unmap a BAR mapping created with iommu_map_bar().
+ */
+void iommu_unmap_bar(struct iommu_ctx *ctx, struct vfio_pci_device *pci, int bar, void *mem,
+		     uint64_t offset, size_t len);
+
+/**
+ * vfio_pci_get_host_irq - Get the host interrupt of an IRQ vector
+ * @pci: &struct vfio_pci_device
+ * @vector: vector index
+ *
+ * Look up the host interrupt number backing @vector of @pci, such that the
+ * interrupt may be steered (see ``/proc/irq/N/smp_affinity_list``) to the cpu
+ * of the thread waiting on it. The vector must be enabled.
+ *
+ * Return: The host interrupt number on success, ``-1`` on error and sets
+ * ``errno``.
+ */
+int vfio_pci_get_host_irq(struct vfio_pci_device *pci, int vector);
+
+/**
+ * vfio_pci_set_irq_affinity - Steer an IRQ vector to a cpu
+ * @pci: &struct vfio_pci_device
+ * @vector: vector index
+ * @cpu: cpu to deliver the interrupt to
+ *
+ * Set the affinity of the host interrupt backing @vector (see
+ * vfio_pci_get_host_irq()). This requires privileges to write
+ * ``/proc/irq/N/smp_affinity_list``.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int vfio_pci_set_irq_affinity(struct vfio_pci_device *pci, int vector, int cpu);
+
 /**
  * vfio_pci_read_config - Read from the PCI configuration space
  * @pci: &struct vfio_pci_device
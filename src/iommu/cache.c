@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/cache: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "util/epoch.h"
+
+#include "context.h"
+
+struct iommu_cache_entry {
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+
+	/* users of the entry; -1 once evicted */
+	int refs;
+
+	/* used since last visited by the clock hand */
+	bool referenced;
+
+	struct list_node clock;
+
+	/* evicted; waiting to be freed */
+	struct iommu_cache_entry *next_retired;
+
+	/* variable height; must be last */
+	struct skiplist_node list;
+};
+
+static inline struct iommu_cache_entry *__entry(struct skiplist_node *n)
+{
+	return container_of_or_null(n, struct iommu_cache_entry, list);
+}
+
+static int __entry_cmp(const void *vaddr, const struct skiplist_node *n)
+{
+	struct iommu_cache_entry *e = container_of_var(n, e, list);
+
+	if (vaddr < e->vaddr)
+		return -1;
+	else if (vaddr >= e->vaddr + e->len)
+		return 1;
+
+	return 0;
+}
+
+static bool __entry_tryget(struct iommu_cache_entry *e)
+{
+	int refs = atomic_load_acquire(&e->refs);
+
+	do {
+		if (refs < 0)
+			return false;
+	} while (!atomic_cmpxchg(&e->refs, refs, refs + 1));
+
+	return true;
+}
+
+/* mark an idle entry as evicted such that it can no longer be acquired */
+static bool __entry_trykill(struct iommu_cache_entry *e)
+{
+	int refs = 0;
+
+	return atomic_cmpxchg(&e->refs, refs, -1);
+}
+
+/* acquire the entry covering [vaddr, vaddr + len), if any */
+static bool __cache_lookup(struct iommu_cache *cache, void *vaddr, size_t len, uint64_t *iova)
+{
+	struct iommu_cache_entry *e;
+	bool found = false;
+
+	/* lock-free; see skiplist_find() */
+	epoch_enter();
+
+	e = __entry(skiplist_find(&cache->entries, vaddr, __entry_cmp, NULL));
+	if (e && vaddr + len <= e->vaddr + e->len && __entry_tryget(e)) {
+		if (!atomic_load_acquire(&e->referenced))
+			atomic_store_release(&e->referenced, true);
+
+		*iova = e->iova + (uint64_t)(vaddr - e->vaddr);
+		found = true;
+	}
+
+	epoch_exit();
+
+	return found;
+}
+
+/* remove an evicted entry and unmap it; cache must be locked */
+static void __cache_remove(struct iommu_ctx *ctx, struct iommu_cache_entry *e,
+			   struct iommu_cache_entry **retired)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	skiplist_path_t update = {};
+
+	skiplist_find(&cache->entries, e->vaddr, __entry_cmp, update);
+	skiplist_erase(&cache->entries, &e->list, update);
+
+	list_del(&e->clock);
+
+	cache->len -= e->len;
+	cache->n--;
+
+	if (iommu_unmap_vaddr(ctx, e->vaddr, NULL))
+		log_debug("failed to unmap vaddr %p\n", e->vaddr);
+
+	e->next_retired = *retired;
+	*retired = e;
+}
+
+static void __cache_free_retired(struct iommu_cache_entry *retired)
+{
+	struct iommu_cache_entry *e, *next;
+
+	if (!retired)
+		return;
+
+	epoch_synchronize();
+
+	for (e = retired; e; e = next) {
+		next = e->next_retired;
+
+		free(e);
+	}
+}
+
+/* evict the coldest idle entry; cache must be locked */
+static bool __cache_evict_one(struct iommu_ctx *ctx, struct iommu_cache_entry **retired)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	struct iommu_cache_entry *e;
+
+	/* each entry is visited at most twice */
+	for (unsigned int i = 0; i < 2 * cache->n; i++) {
+		e = list_top(&cache->clock, struct iommu_cache_entry, clock);
+
+		if (atomic_load_acquire(&e->referenced) || !__entry_trykill(e)) {
+			atomic_store_release(&e->referenced, false);
+
+			list_del(&e->clock);
+			list_add_tail(&cache->clock, &e->clock);
+
+			continue;
+		}
+
+		__cache_remove(ctx, e, retired);
+
+		return true;
+	}
+
+	return false;
+}
+
+/* evict entries overlapping [start, end); cache must be locked */
+static int __cache_evict_range(struct iommu_ctx *ctx, void *start, void *end,
+			       struct iommu_cache_entry **retired)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	struct iommu_cache_entry *e, *next;
+	skiplist_path_t update = {};
+
+	skiplist_find(&cache->entries, start, __entry_cmp, update);
+
+	for (e = __entry(skiplist_path_next(update)); e && e->vaddr < end; e = next) {
+		next = __entry(e->list.next[0]);
+
+		if (!__entry_trykill(e)) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		__cache_remove(ctx, e, retired);
+	}
+
+	return 0;
+}
+
+static bool __cache_over_budget(struct iommu_ctx *ctx, size_t len)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	struct iommu_dma_stats stats;
+
+	if (cache->budget && cache->len + len > cache->budget)
+		return true;
+
+	iommu_get_dma_stats(ctx, &stats);
+
+	/* leave some headroom for mappings made outside the cache */
+	if (stats.dma_avail && stats.nmappings >= stats.dma_avail - stats.dma_avail / 8)
+		return true;
+
+	return false;
+}
+
+static int __cache_miss(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	struct iommu_cache_entry *e, *retired = NULL;
+	void *start, *end;
+	skiplist_path_t update = {};
+	uint64_t _iova, last;
+	int ret = -1;
+
+	start = (void *)ALIGN_DOWN((uintptr_t)vaddr, __VFN_PAGESIZE);
+	end = (void *)ALIGN_UP((uintptr_t)vaddr + len, __VFN_PAGESIZE);
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* lost the race with another miss */
+	if (__cache_lookup(cache, vaddr, len, iova)) {
+		ret = 0;
+		goto out;
+	}
+
+	if (__cache_evict_range(ctx, start, end, &retired))
+		goto out;
+
+	/* covered by mappings made outside of the cache */
+	if (iommu_translate_vaddr(ctx, vaddr, iova)) {
+		if (iommu_translate_vaddr(ctx, vaddr + len - 1, &last) && last == *iova + len - 1)
+			ret = 0;
+		else
+			errno = EEXIST;
+
+		goto out;
+	}
+
+	while (__cache_over_budget(ctx, (size_t)(end - start)) &&
+	       __cache_evict_one(ctx, &retired))
+		;
+
+	/* if the kernel limits are hit regardless, evict until the mapping fits */
+	while (iommu_map_vaddr(ctx, start, (size_t)(end - start), &_iova, 0x0)) {
+		if (errno != ENOMEM && errno != ENOSPC)
+			goto out;
+
+		if (!__cache_evict_one(ctx, &retired)) {
+			errno = ENOMEM;
+			goto out;
+		}
+
+		/* in lazy mode, the eviction only queued the unmap */
+		if (iommu_flush_unmaps(ctx))
+			log_debug("failed to flush deferred unmaps\n");
+	}
+
+	e = skiplist_new(&cache->entries, struct iommu_cache_entry, list);
+
+	e->vaddr = start;
+	e->len = (size_t)(end - start);
+	e->iova = _iova;
+	e->refs = 1;
+
+	skiplist_find(&cache->entries, start, __entry_cmp, update);
+	skiplist_link(&cache->entries, &e->list, update);
+
+	list_add_tail(&cache->clock, &e->clock);
+
+	cache->len += e->len;
+	cache->n++;
+
+	*iova = _iova + (uint64_t)(vaddr - start);
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+
+	__cache_free_retired(retired);
+
+	return ret;
+}
+
+int iommu_cache_get(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova)
+{
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__cache_lookup(&ctx->cache, vaddr, len, iova))
+		return 0;
+
+	return __cache_miss(ctx, vaddr, len, iova);
+}
+
+void iommu_cache_put(struct iommu_ctx *ctx, void *vaddr)
+{
+	struct iommu_cache_entry *e;
+
+	epoch_enter();
+
+	/* buffers covered by other mappings have no entry */
+	e = __entry(skiplist_find(&ctx->cache.entries, vaddr, __entry_cmp, NULL));
+	if (e)
+		log_fatal_if(atomic_dec_fetch(&e->refs) < 0, "unbalanced iommu_cache_put()\n");
+
+	epoch_exit();
+}
+
+int iommu_cache_evict(struct iommu_ctx *ctx, void *vaddr, size_t len)
+{
+	struct iommu_cache_entry *retired = NULL;
+	int ret;
+
+	pthread_mutex_lock(&ctx->cache.lock);
+	ret = __cache_evict_range(ctx, vaddr, vaddr + len, &retired);
+	pthread_mutex_unlock(&ctx->cache.lock);
+
+	__cache_free_retired(retired);
+
+	return ret;
+}
+
+void iommu_cache_set_budget(struct iommu_ctx *ctx, size_t budget)
+{
+	struct iommu_cache_entry *retired = NULL;
+
+	pthread_mutex_lock(&ctx->cache.lock);
+
+	ctx->cache.budget = budget;
+
+	while (__cache_over_budget(ctx, 0) && __cache_evict_one(ctx, &retired))
+		;
+
+	pthread_mutex_unlock(&ctx->cache.lock);
+
+	__cache_free_retired(retired);
+}
+
+static void __cache_retire(void *opaque, struct skiplist_node *n)
+{
+	struct iommu_cache_entry **retired = opaque, *e = __entry(n);
+
+	e->next_retired = *retired;
+	*retired = e;
+}
+
+void iommu_cache_reset(struct iommu_ctx *ctx)
+{
+	struct iommu_cache *cache = &ctx->cache;
+	struct iommu_cache_entry *retired = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* the mappings are already gone */
+	skiplist_clear_with(&cache->entries, __cache_retire, &retired);
+	list_head_init(&cache->clock);
+
+	cache->len = 0;
+	cache->n = 0;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	__cache_free_retired(retired);
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "cache.c"
+
+#define SZ 0x10000
+
+#include "test_ctx.h"
+
+static struct iommu_ctx ctx;
+
+static void *at(uintptr_t n)
+{
+	return (void *)(n * SZ);
+}
+
+static bool mapped(uintptr_t n)
+{
+	uint64_t iova;
+
+	return iommu_translate_vaddr(&ctx, at(n), &iova);
+}
+
+int main(void)
+{
+	struct iommu_dma_stats stats;
+	uint64_t iova, iova2;
+
+	plan_tests(14);
+
+	test_ctx_init(&ctx);
+
+	/* mapped on first use, translated afterwards */
+	ok1(iommu_cache_get(&ctx, at(1) + 0x10, 0x100, &iova) == 0 && nmaps == 1);
+	ok1(iommu_cache_get(&ctx, at(1), 0x100, &iova2) == 0 && nmaps == 1 && iova2 + 0x10 == iova);
+
+	iommu_get_dma_stats(&ctx, &stats);
+	ok1(stats.pinned == __VFN_PAGESIZE && stats.nmappings == 1);
+
+	iommu_cache_put(&ctx, at(1));
+	iommu_cache_put(&ctx, at(1));
+
+	ok1(iommu_cache_get(&ctx, at(2), 0x100, &iova) == 0);
+	iommu_cache_put(&ctx, at(2));
+
+	/* over budget; the entry at 1 was used more recently and is spared */
+	iommu_cache_set_budget(&ctx, 2 * __VFN_PAGESIZE);
+
+	ok1(iommu_cache_get(&ctx, at(3), 0x100, &iova) == 0 && nunmaps == 1);
+	ok1(mapped(1) && !mapped(2) && mapped(3));
+
+	/* entries in use are not evicted */
+	ok1(iommu_cache_evict(&ctx, at(3), SZ) == -1 && errno == EBUSY && mapped(3));
+	ok1(iommu_cache_get(&ctx, at(3) + __VFN_PAGESIZE - 0x10, 0x20, &iova) == -1 &&
+	    errno == EBUSY);
+
+	iommu_cache_put(&ctx, at(3));
+
+	ok1(iommu_cache_evict(&ctx, at(3), SZ) == 0 && !mapped(3));
+
+	/* kernel limits; idle entries are evicted until the mapping succeeds */
+	iommu_cache_set_budget(&ctx, 0);
+
+	nfail = 1;
+	nunmaps = 0;
+	ok1(iommu_cache_get(&ctx, at(4), 0x100, &iova) == 0 && nunmaps == 1 && !mapped(1));
+
+	/* buffers within other mappings are only translated */
+	ok1(iommu_map_vaddr(&ctx, at(8), SZ, &iova, 0x0) == 0);
+	ok1(iommu_cache_get(&ctx, at(8) + 0x100, 0x100, &iova2) == 0 && iova2 == iova + 0x100 &&
+	    ctx.cache.n == 1);
+
+	/* the entries are dropped along with the mappings */
+	ok1(iommu_unmap_all(&ctx) == 0 && ctx.cache.n == 0 && ctx.cache.len == 0);
+
+	nmaps = 0;
+	ok1(iommu_cache_get(&ctx, at(4), 0x100, &iova) == 0 && nmaps == 1 && mapped(4));
+
+	return exit_status();
+}
@@ -83,4 +83,11 @@ void iommu_ctx_init(struct iommu_ctx *ctx)
 
 	skiplist_init(&ctx->map.list);
 	pthread_mutex_init(&ctx->map.lock, NULL);
+
+	pthread_mutex_init(&ctx->deferred.lock, NULL);
+	iommu_dma_heap_init(ctx);
+
+	skiplist_init(&ctx->cache.entries);
+	list_head_init(&ctx->cache.clock);
+	pthread_mutex_init(&ctx->cache.lock, NULL);
 }
@@ -10,6 +10,8 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include "ccan/list/list.h"
+
 #include "util/skiplist.h"
 
 struct iommu_ctx;
@@ -18,9 +20,13 @@ struct iommu_ctx_ops {
 	/* container/ioas ops */
 	int (*iova_reserve)(struct iommu_ctx *ctx, size_t len, uint64_t *iova,
 			    unsigned long flags);
-	void (*iova_put_ephemeral)(struct iommu_ctx *ctx);
+	void (*iova_put_ephemeral)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
+	void (*iova_release)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
+	int (*iova_reserve_fixed)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
 	int (*dma_map)(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
 		       unsigned long flags);
+	int (*dma_copy)(struct iommu_ctx *ctx, struct iommu_ctx *src, uint64_t iova, size_t len,
+			unsigned long flags);
 	int (*dma_unmap)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
 	int (*dma_unmap_all)(struct iommu_ctx *ctx);
 
@@ -35,21 +41,150 @@ struct iova_mapping {
 
 	unsigned long flags;
 
+	/*
+	 * Size of the kernel mappings backing the mapping (the last may be
+	 * shorter); zero if they are not uniform.
+	 */
+	size_t granule;
+
+	/* unlinked; waiting to be freed */
+	struct iova_mapping *next_retired;
+
+	/* variable height; must be last */
 	struct skiplist_node list;
 };
 
+/*
+ * Modifications are serialized by @lock; lookups are lock-free (see
+ * iommu_translate_vaddr()).
+ */
 struct iova_map {
 	pthread_mutex_t lock;
 	struct skiplist list;
+
+	/* number of mappings */
+	unsigned int n;
+
+	/* back larger mappings by kernel mappings of this size (zero if not) */
+	size_t granule;
+};
+
+#define IOMMU_DMA_MIN_SHIFT 6
+#define IOMMU_DMA_MAX_SHIFT 17
+#define IOMMU_DMA_NR_CLASSES (IOMMU_DMA_MAX_SHIFT - IOMMU_DMA_MIN_SHIFT + 1)
+
+#define IOMMU_DMA_MAGAZINE_SIZE 32
+
+struct iommu_dma_magazine {
+	struct iommu_dma_magazine *next;
+
+	int n;
+	struct {
+		void *vaddr;
+		uint64_t iova;
+	} objs[IOMMU_DMA_MAGAZINE_SIZE];
+};
+
+struct iommu_dma_arena {
+	struct iommu_dma_arena *next;
+
+	void *vaddr;
+	size_t len;
+};
+
+/*
+ * DMA heap (see iommu_dma_alloc())
+ *
+ * Objects are carved from slabs of pre-mapped arenas and cached by threads in
+ * per size class magazines. Magazines exchanged with the depot and all carving
+ * are serialized by @lock.
+ *
+ * Resetting the heap (when the arenas are unmapped) bumps @gen; thread caches
+ * loaded in an earlier generation are dropped instead of being used.
+ */
+struct iommu_dma_heap {
+	pthread_mutex_t lock;
+	unsigned int gen;
+
+	/* per-thread cache */
+	pthread_key_t key;
+
+	/* all arenas mapped */
+	struct iommu_dma_arena *arenas;
+
+	/* remainder of the current arena */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+	} arena;
+
+	struct {
+		/* remainder of the current slab */
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+
+		/* depot */
+		struct iommu_dma_magazine *full, *empty;
+	} classes[IOMMU_DMA_NR_CLASSES];
+};
+
+/* lazy unmap; flush after this many mappings or this many microseconds */
+#define IOMMU_LAZY_UNMAP_BATCH 256
+#define IOMMU_LAZY_UNMAP_TIMEOUT_US 10000
+
+/*
+ * Mappings removed from the map, but not yet unmapped from the IOMMU (see
+ * iommu_set_lazy_unmap()). Linked through &iova_mapping.next_retired.
+ */
+struct iova_deferred {
+	pthread_mutex_t lock;
+	bool enabled;
+
+	int n;
+	struct iova_mapping *head;
+
+	/* flush once passed (in ticks) */
+	uint64_t deadline;
+};
+
+/*
+ * Registration cache (see iommu_cache_get())
+ *
+ * Entries are indexed by address for lock-free lookups; insertion and
+ * eviction are serialized by @lock. Idle entries are evicted in CLOCK order.
+ */
+struct iommu_cache {
+	pthread_mutex_t lock;
+
+	/* bytes; zero if unlimited */
+	size_t budget;
+
+	size_t len;
+	unsigned int n;
+
+	struct skiplist entries;
+	struct list_head clock;
 };
 
 struct iommu_ctx {
 	struct iova_map map;
 	struct iommu_ctx_ops ops;
 
+	struct iova_deferred deferred;
+	struct iommu_dma_heap heap;
+	struct iommu_cache cache;
+
 	pthread_mutex_t lock;
 	int nranges;
 	struct iommu_iova_range *iova_ranges;
+
+	/* bytes mapped in the iommu */
+	size_t pinned;
+
+	/* maximum number of mappings (zero if unknown) */
+	unsigned int dma_avail;
 };
 
 struct iommu_ctx *iommu_get_default_context(void);
@@ -63,4 +198,7 @@ struct iommu_ctx *iommufd_get_iommu_context(const char *name);
 #endif
 
 void iommu_ctx_init(struct iommu_ctx *ctx);
+void iommu_dma_heap_init(struct iommu_ctx *ctx);
+void iommu_dma_heap_reset(struct iommu_ctx *ctx);
+void iommu_cache_reset(struct iommu_ctx *ctx);
 int iommu_iova_range_to_string(struct iommu_iova_range *range, char **str);
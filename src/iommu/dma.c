@@ -16,16 +16,85 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
+#include <sys/resource.h>
+
 #include "ccan/compiler/compiler.h"
 #include "ccan/minmax/minmax.h"
 
 #include "vfn/iommu.h"
 #include "vfn/support.h"
 
+#include "util/epoch.h"
+
 #include "context.h"
 
+#define IOVA_CACHE_SIZE 64
+
+/*
+ * Per-thread, direct-mapped cache of recent translations, indexed by page
+ * number. Entries are only valid while their generation matches
+ * iova_map_gen, which is bumped whenever a mapping is removed from any map.
+ */
+struct iova_cache_entry {
+	struct iommu_ctx *ctx;
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+	uint64_t gen;
+};
+
+static uint64_t iova_map_gen = 1;
+
+static __thread struct iova_cache_entry iova_cache[IOVA_CACHE_SIZE];
+
+static inline struct iova_cache_entry *iova_cache_slot(void *vaddr)
+{
+	return &iova_cache[((uintptr_t)vaddr >> __VFN_PAGESHIFT) & (IOVA_CACHE_SIZE - 1)];
+}
+
+/* must be called after unlinking and before freeing any mappings */
+static inline void iova_cache_invalidate(void)
+{
+	atomic_inc_fetch(&iova_map_gen);
+}
+
+/* program the iommu, accounting for the pinned memory */
+static inline int __dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
+			    unsigned long flags)
+{
+	if (ctx->ops.dma_map(ctx, vaddr, len, iova, flags))
+		return -1;
+
+	__atomic_add_fetch(&ctx->pinned, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static inline int __dma_copy(struct iommu_ctx *ctx, struct iommu_ctx *src, uint64_t iova,
+			     size_t len, unsigned long flags)
+{
+	if (ctx->ops.dma_copy(ctx, src, iova, len, flags))
+		return -1;
+
+	__atomic_add_fetch(&ctx->pinned, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static inline int __dma_unmap(struct iommu_ctx *ctx, uint64_t iova, size_t len)
+{
+	if (ctx->ops.dma_unmap(ctx, iova, len))
+		return -1;
+
+	__atomic_sub_fetch(&ctx->pinned, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
 static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
 {
 	struct iova_mapping *m = container_of_var(n, m, list);
@@ -38,85 +107,404 @@ static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
 	return 0;
 }
 
-static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t iova,
-			unsigned long flags)
+/* order by start address; unlike iova_cmp(), this can locate a specific mapping */
+static int iova_cmp_start(const void *vaddr, const struct skiplist_node *n)
 {
-	__autolock(&map->lock);
-
-	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
-	struct iova_mapping *m;
+	struct iova_mapping *m = container_of_var(n, m, list);
 
-	if (!len) {
-		errno = EINVAL;
+	if (vaddr < m->vaddr)
 		return -1;
+	else if (vaddr > m->vaddr)
+		return 1;
+
+	return 0;
+}
+
+static inline struct iova_mapping *__mapping(struct skiplist_node *n)
+{
+	return container_of_or_null(n, struct iova_mapping, list);
+}
+
+/*
+ * The map holds non-overlapping ranges ordered by address, so finding the
+ * first mapping that ends after an address is sufficient to answer overlap
+ * queries and to iterate over the mappings within a range.
+ */
+static struct iova_mapping *__iova_map_first(struct iova_map *map, void *vaddr,
+					     skiplist_path_t update)
+{
+	skiplist_find(&map->list, vaddr, iova_cmp, update);
+
+	return __mapping(skiplist_path_next(update));
+}
+
+static inline struct iova_mapping *__iova_map_next(struct iova_mapping *m)
+{
+	return __mapping(m->list.next[0]);
+}
+
+/*
+ * Link a mapping that may temporarily overlap the mapping preceding it (while
+ * that mapping is being shrunk); lookups will find either one.
+ */
+static void __iova_map_link(struct iova_map *map, struct iova_mapping *m)
+{
+	skiplist_path_t update = {};
+
+	skiplist_find(&map->list, m->vaddr, iova_cmp_start, update);
+	skiplist_link(&map->list, &m->list, update);
+
+	map->n++;
+}
+
+static void __iova_map_unlink(struct iova_map *map, struct iova_mapping *m,
+			      struct iova_mapping **retired)
+{
+	skiplist_path_t update = {};
+
+	skiplist_find(&map->list, m->vaddr, iova_cmp_start, update);
+	skiplist_erase(&map->list, &m->list, update);
+
+	map->n--;
+
+	iova_cache_invalidate();
+
+	m->next_retired = *retired;
+	*retired = m;
+}
+
+/* give back iova space allocated by the backend */
+static void __iova_release(struct iommu_ctx *ctx, uint64_t iova, size_t len, unsigned long flags)
+{
+	if (flags & IOMMU_MAP_FIXED_IOVA)
+		return;
+
+	if (flags & IOMMU_MAP_EPHEMERAL) {
+		if (ctx->ops.iova_put_ephemeral)
+			ctx->ops.iova_put_ephemeral(ctx, iova, len);
+
+		return;
 	}
 
-	if (skiplist_find(&map->list, vaddr, iova_cmp, update)) {
+	if (ctx->ops.iova_release)
+		ctx->ops.iova_release(ctx, iova, len);
+}
+
+/*
+ * Free unlinked mappings once concurrent lookups are done with them. If
+ * release is false, the mappings were merged into others that now own their
+ * iova space.
+ */
+static void __iova_map_free_retired(struct iommu_ctx *ctx, struct iova_mapping *retired,
+				    bool release)
+{
+	struct iova_mapping *m, *next;
+
+	if (!retired)
+		return;
+
+	epoch_synchronize();
+
+	for (m = retired; m; m = next) {
+		next = m->next_retired;
+
+		if (release)
+			__iova_release(ctx, m->iova, m->len, m->flags);
+
+		free(m);
+	}
+}
+
+/* keep track of the kernel mappings backing m when growing it by len */
+static void __iova_grow(struct iova_mapping *m, size_t len, size_t granule)
+{
+	if (!granule || m->granule != granule || m->len % granule)
+		m->granule = 0;
+
+	/* growing is safe; concurrent lookups see either length */
+	atomic_store_release(&m->len, m->len + len);
+}
+
+/* can the range at (vaddr, iova) be merged into the mapping preceding it? */
+static bool __iova_mergeable(struct iova_mapping *m, void *vaddr, uint64_t iova,
+			     unsigned long flags)
+{
+	if (!(flags & IOMMU_MAP_MERGE) || flags & IOMMU_MAP_EPHEMERAL)
+		return false;
+
+	return m->flags == flags && m->vaddr + m->len == vaddr && m->iova + m->len == iova;
+}
+
+/*
+ * Add a mapping (backed by kernel mappings of granule bytes) to the map,
+ * merging it with its neighbours if allowed by the flags. Must be called with
+ * the map lock held.
+ */
+static struct iova_mapping *__iova_map_add(struct iova_map *map, void *vaddr, size_t len,
+					   uint64_t iova, unsigned long flags, size_t granule,
+					   struct iova_mapping **retired)
+{
+	struct iova_mapping *m, *prev, *next;
+	skiplist_path_t update = {};
+
+	next = __iova_map_first(map, vaddr, update);
+	prev = __mapping(skiplist_path_prev(&map->list, update));
+
+	if (next && next->vaddr < vaddr + len) {
 		errno = EEXIST;
-		return -1;
+		return NULL;
 	}
 
-	m = znew_t(struct iova_mapping, 1);
+	if (prev && __iova_mergeable(prev, vaddr, iova, flags)) {
+		m = prev;
 
-	m->vaddr = vaddr;
-	m->len = len;
-	m->iova = iova;
-	m->flags = flags;
+		__iova_grow(m, len, granule);
+	} else {
+		m = skiplist_new(&map->list, struct iova_mapping, list);
 
-	skiplist_link(&map->list, &m->list, update);
+		m->vaddr = vaddr;
+		m->len = len;
+		m->iova = iova;
+		m->flags = flags;
+		m->granule = granule;
 
-	return 0;
+		skiplist_link(&map->list, &m->list, update);
+
+		map->n++;
+	}
+
+	/* absorb the following mapping */
+	if (next && __iova_mergeable(m, next->vaddr, next->iova, next->flags)) {
+		__iova_grow(m, next->len, next->granule);
+
+		__iova_map_unlink(map, next, retired);
+	}
+
+	return m;
+}
+
+static int iova_map_add(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t iova,
+			unsigned long flags, size_t granule)
+{
+	struct iova_mapping *m, *retired = NULL;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->map.lock);
+	m = __iova_map_add(&ctx->map, vaddr, len, iova, flags, granule, &retired);
+	pthread_mutex_unlock(&ctx->map.lock);
+
+	__iova_map_free_retired(ctx, retired, false);
+
+	return m ? 0 : -1;
 }
 
-static void iova_map_remove(struct iova_map *map, void *vaddr)
+/*
+ * Remove the mapping containing vaddr from the map and, if unmap is true,
+ * unmap it from the IOMMU. The mapping may still be observed by concurrent
+ * lookups; see epoch_synchronize().
+ */
+static struct iova_mapping *iova_map_remove(struct iommu_ctx *ctx, void *vaddr, bool unmap)
 {
-	__autolock(&map->lock);
+	__autolock(&ctx->map.lock);
 
-	struct skiplist_node *n, *update[SKIPLIST_LEVELS] = {};
+	skiplist_path_t update = {};
+	struct skiplist_node *n;
+	struct iova_mapping *m;
 
-	n = skiplist_find(&map->list, vaddr, iova_cmp, update);
-	if (!n)
-		return;
+	n = skiplist_find(&ctx->map.list, vaddr, iova_cmp, update);
+	if (!n) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	m = container_of_var(n, m, list);
+
+	if (unmap && __dma_unmap(ctx, m->iova, m->len)) {
+		log_debug("failed to unmap dma\n");
+		return NULL;
+	}
+
+	skiplist_erase(&ctx->map.list, n, update);
 
-	skiplist_erase(&map->list, n, update);
+	ctx->map.n--;
+
+	iova_cache_invalidate();
+
+	return m;
 }
 
-static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
+/*
+ * Unmap [start, end) (which must be within m) from the IOMMU and the map. If
+ * only part of the mapping is covered, the mapping is split; this is only
+ * possible along the boundaries of the kernel mappings backing it.
+ */
+static int iova_map_unmap_part(struct iommu_ctx *ctx, struct iova_mapping *m, void *start,
+			       void *end, struct iova_mapping **retired)
 {
-	__autolock(&map->lock);
+	size_t head = (size_t)(start - m->vaddr), tail = (size_t)(m->vaddr + m->len - end);
+	struct iova_mapping *r;
+
+	/*
+	 * Neither backend portably supports unmapping part of a kernel
+	 * mapping (vfio type1 either refuses or removes the entire mapping),
+	 * and unmapping it entirely to map back the rest would fault DMA in
+	 * flight to the remaining parts.
+	 */
+	if ((head || tail) &&
+	    (!m->granule || head % m->granule || (tail && (size_t)(end - m->vaddr) % m->granule))) {
+		log_debug("cannot split mapping at vaddr %p\n", m->vaddr);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__dma_unmap(ctx, m->iova + head, (size_t)(end - start))) {
+		log_debug("failed to unmap dma\n");
+		return -1;
+	}
+
+	if (tail) {
+		r = skiplist_new(&ctx->map.list, struct iova_mapping, list);
+
+		r->vaddr = end;
+		r->len = tail;
+		r->iova = m->iova + (uint64_t)(end - m->vaddr);
+		r->flags = m->flags;
+		r->granule = m->granule;
 
-	return container_of_or_null(skiplist_find(&map->list, vaddr, iova_cmp, NULL),
-				    struct iova_mapping, list);
+		__iova_map_link(&ctx->map, r);
+
+		/* the tail (and its iova space) now belongs to r */
+		atomic_store_release(&m->len, (size_t)(end - m->vaddr));
+	}
+
+	if (head) {
+		atomic_store_release(&m->len, head);
+
+		iova_cache_invalidate();
+
+		__iova_release(ctx, m->iova + head, (size_t)(end - start), m->flags);
+
+		return 0;
+	}
+
+	__iova_map_unlink(&ctx->map, m, retired);
+
+	return 0;
 }
 
-static void iova_map_clear_with(struct iova_map *map, skiplist_iter_fn fn, void *opaque)
+static void __retire_mapping(void *opaque, struct skiplist_node *n)
 {
-	__autolock(&map->lock);
+	struct iova_mapping **retired = opaque;
+	struct iova_mapping *m = container_of_var(n, m, list);
 
-	skiplist_clear_with(&map->list, fn, opaque);
+	m->next_retired = *retired;
+	*retired = m;
 }
 
-static void UNUSED iova_map_clear(struct iova_map *map)
+/*
+ * Unlink all mappings and, once concurrent lookups are done with them, call fn
+ * on each of them (if not NULL) and free them.
+ */
+static void iova_map_clear_with(struct iova_map *map, void (*fn)(void *opaque,
+				struct iova_mapping *m), void *opaque)
 {
-	iova_map_clear_with(map, NULL, NULL);
+	struct iova_mapping *m, *next, *retired = NULL;
+
+	pthread_mutex_lock(&map->lock);
+	skiplist_clear_with(&map->list, __retire_mapping, &retired);
+	map->n = 0;
+	pthread_mutex_unlock(&map->lock);
+
+	iova_cache_invalidate();
+
+	epoch_synchronize();
+
+	for (m = retired; m; m = next) {
+		next = m->next_retired;
+
+		if (fn)
+			fn(opaque, m);
+
+		free(m);
+	}
 }
 
 bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, uint64_t *iova)
 {
-	struct iova_mapping *m = iova_map_find(&ctx->map, vaddr);
+	struct iova_cache_entry *e = iova_cache_slot(vaddr);
+	struct iova_mapping *m;
+	uint64_t gen;
+	bool found = false;
+
+	/*
+	 * Load the generation before walking the map; if a mapping is removed
+	 * after this, the entry filled below is invalidated.
+	 */
+	gen = atomic_load_acquire(&iova_map_gen);
+
+	if (likely(e->gen == gen && e->ctx == ctx &&
+		   vaddr >= e->vaddr && vaddr < e->vaddr + e->len)) {
+		*iova = e->iova + (vaddr - e->vaddr);
+		return true;
+	}
+
+	/* lock-free; see skiplist_find() */
+	epoch_enter();
 
+	m = container_of_or_null(skiplist_find(&ctx->map.list, vaddr, iova_cmp, NULL),
+				 struct iova_mapping, list);
 	if (m) {
+		*e = (struct iova_cache_entry) {
+			.ctx = ctx,
+			.vaddr = m->vaddr,
+			.len = m->len,
+			.iova = m->iova,
+			.gen = gen,
+		};
+
 		*iova = m->iova + (vaddr - m->vaddr);
-		return true;
+		found = true;
 	}
 
-	return false;
+	epoch_exit();
+
+	return found;
+}
+
+/* map [vaddr, vaddr + len) at the fixed iova with kernel mappings of granule bytes */
+static int __dma_map_granular(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t iova,
+			      unsigned long flags, size_t granule)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += granule) {
+		uint64_t _iova = iova + off;
+
+		if (__dma_map(ctx, vaddr + off, min_t(size_t, granule, len - off), &_iova,
+			      flags | IOMMU_MAP_FIXED_IOVA))
+			goto unmap;
+	}
+
+	return 0;
+
+unmap:
+	if (off)
+		log_fatal_if(__dma_unmap(ctx, iova, off), "failed to unmap dma\n");
+
+	return -1;
 }
 
 int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
 		    unsigned long flags)
 {
+	size_t granule = atomic_load_acquire(&ctx->map.granule);
 	uint64_t _iova;
+	int ret;
 
 	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
 		goto out;
@@ -128,14 +516,27 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
 		return -1;
 	}
 
-	if (ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
+	/* the iova range must be known up front to map it piecewise */
+	if (!granule || len <= granule || flags & IOMMU_MAP_EPHEMERAL ||
+	    !(flags & IOMMU_MAP_FIXED_IOVA || ctx->ops.iova_reserve))
+		granule = len;
+
+	if (granule < len)
+		ret = __dma_map_granular(ctx, vaddr, len, _iova, flags, granule);
+	else
+		ret = __dma_map(ctx, vaddr, len, &_iova, flags);
+
+	if (ret) {
 		log_debug("failed to map dma\n");
-		return -1;
+		goto release;
 	}
 
-	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags)) {
+	if (iova_map_add(ctx, vaddr, len, _iova, flags, granule)) {
 		log_debug("failed to add mapping\n");
-		return -1;
+
+		log_fatal_if(__dma_unmap(ctx, _iova, len), "failed to unmap dma\n");
+
+		goto release;
 	}
 
 out:
@@ -143,65 +544,622 @@ out:
 		*iova = _iova;
 
 	return 0;
+
+release:
+	__iova_release(ctx, _iova, len, flags);
+
+	return -1;
 }
 
-int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+int iommu_share_vaddr(struct iommu_ctx *src, struct iommu_ctx *dst, void *vaddr)
 {
 	struct iova_mapping *m;
+	unsigned long flags = 0;
+	uint64_t iova = 0;
+	size_t len = 0;
+	bool reserved = false;
+	int ret;
+
+	if (src == dst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&src->map.lock);
+
+	m = __mapping(skiplist_find(&src->map.list, vaddr, iova_cmp, NULL));
+	if (m) {
+		vaddr = m->vaddr;
+		len = m->len;
+		iova = m->iova;
+		flags = m->flags & ~IOMMU_MAP_FIXED_IOVA;
+	}
+
+	pthread_mutex_unlock(&src->map.lock);
 
-	m = iova_map_find(&ctx->map, vaddr);
 	if (!m) {
 		errno = ENOENT;
 		return -1;
 	}
 
+	if (flags & IOMMU_MAP_EPHEMERAL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* keep the allocator of dst from handing out the iova */
+	if (dst->ops.iova_reserve_fixed) {
+		if (dst->ops.iova_reserve_fixed(dst, iova, len)) {
+			log_debug("iova 0x%" PRIx64 " is in use\n", iova);
+			return -1;
+		}
+
+		reserved = true;
+	}
+
+	/* share the pinned pages if the backend supports it; otherwise map again */
+	if (dst->ops.dma_copy && dst->ops.dma_copy == src->ops.dma_copy)
+		ret = __dma_copy(dst, src, iova, len, flags);
+	else
+		ret = __dma_map(dst, vaddr, len, &iova, flags | IOMMU_MAP_FIXED_IOVA);
+
+	if (ret) {
+		log_debug("failed to map dma\n");
+		goto release;
+	}
+
+	/* the iova is given back to the allocator of dst only if reserved there */
+	if (iova_map_add(dst, vaddr, len, iova, reserved ? flags : flags | IOMMU_MAP_FIXED_IOVA,
+			 len)) {
+		log_debug("failed to add mapping\n");
+
+		log_fatal_if(__dma_unmap(dst, iova, len), "failed to unmap dma\n");
+
+		goto release;
+	}
+
+	return 0;
+
+release:
+	if (reserved)
+		__iova_release(dst, iova, len, flags);
+
+	return -1;
+}
+
+/* a virtually and (if reserved up front) iova contiguous run of batch entries */
+struct iova_run {
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+};
+
+static void __unmap_runs(struct iommu_ctx *ctx, struct iova_run *runs, int nruns)
+{
+	for (int i = 0; i < nruns; i++)
+		log_fatal_if(__dma_unmap(ctx, runs[i].iova, runs[i].len),
+			     "failed to unmap dma\n");
+}
+
+static int __run_cmp(const void *a, const void *b)
+{
+	const struct iova_run *ra = a, *rb = b;
+
+	if (ra->vaddr < rb->vaddr)
+		return -1;
+	else if (ra->vaddr > rb->vaddr)
+		return 1;
+
+	return 0;
+}
+
+static bool __runs_overlap(struct iova_run *runs, int nruns)
+{
+	struct iova_run *sorted = new_t(struct iova_run, nruns);
+	bool overlap = false;
+
+	memcpy(sorted, runs, (size_t)nruns * sizeof(*sorted));
+	qsort(sorted, (size_t)nruns, sizeof(*sorted), __run_cmp);
+
+	for (int i = 1; i < nruns; i++) {
+		if (sorted[i - 1].vaddr + sorted[i - 1].len > sorted[i].vaddr) {
+			overlap = true;
+			break;
+		}
+	}
+
+	free(sorted);
+
+	return overlap;
+}
+
+int iommu_map_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iovas,
+		     unsigned long flags)
+{
+	struct iova_run *runs, *run = NULL;
+	struct iova_mapping *retired = NULL;
+	skiplist_path_t update = {};
+	uint64_t base = 0, reserved = 0;
+	size_t total = 0;
+	bool *mapped, release = false;
+	int i, nruns = 0, ret = -1;
+
+	if (flags & IOMMU_MAP_EPHEMERAL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	runs = znew_t(struct iova_run, n);
+
+	/* entries within existing mappings are only translated */
+	mapped = znew_t(bool, n);
+
+	for (i = 0; i < n; i++) {
+		if (!iov[i].iov_len ||
+		    !ALIGNED((uintptr_t)iov[i].iov_base | iov[i].iov_len, __VFN_PAGESIZE)) {
+			errno = EINVAL;
+			goto out;
+		}
+
+		if (iommu_translate_vaddr(ctx, iov[i].iov_base, &iovas[i])) {
+			mapped[i] = true;
+			continue;
+		}
+
+		total += iov[i].iov_len;
+	}
+
+	if (!total) {
+		ret = 0;
+		goto out;
+	}
+
+	/* reserve the iova range of the entire batch at once */
+	if (!(flags & IOMMU_MAP_FIXED_IOVA) && ctx->ops.iova_reserve) {
+		if (ctx->ops.iova_reserve(ctx, total, &base, flags)) {
+			log_debug("failed to allocate iova\n");
+			goto out;
+		}
+
+		reserved = base;
+		release = true;
+	}
+
+	/* coalesce virtually (and iova) contiguous neighbours */
+	for (i = 0; i < n; i++) {
+		void *vaddr = iov[i].iov_base;
+		uint64_t iova = flags & IOMMU_MAP_FIXED_IOVA ? iovas[i] : base;
+
+		if (mapped[i]) {
+			run = NULL;
+			continue;
+		}
+
+		base += iov[i].iov_len;
+
+		if (run && run->vaddr + run->len == vaddr && run->iova + run->len == iova) {
+			run->len += iov[i].iov_len;
+			continue;
+		}
+
+		run = &runs[nruns++];
+
+		*run = (struct iova_run) {
+			.vaddr = vaddr,
+			.len = iov[i].iov_len,
+			.iova = iova,
+		};
+	}
+
+	if (__runs_overlap(runs, nruns)) {
+		errno = EEXIST;
+		goto out;
+	}
+
+	for (i = 0; i < nruns; i++) {
+		if (__dma_map(ctx, runs[i].vaddr, runs[i].len, &runs[i].iova, flags)) {
+			log_debug("failed to map dma\n");
+
+			__unmap_runs(ctx, runs, i);
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock(&ctx->map.lock);
+
+	/* check all runs up front; adding cannot fail after this */
+	for (i = 0; i < nruns; i++) {
+		struct iova_mapping *next = __iova_map_first(&ctx->map, runs[i].vaddr, update);
+
+		if (next && next->vaddr < runs[i].vaddr + runs[i].len) {
+			pthread_mutex_unlock(&ctx->map.lock);
+
+			log_debug("failed to add mapping\n");
+
+			__unmap_runs(ctx, runs, nruns);
+
+			errno = EEXIST;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nruns; i++)
+		__iova_map_add(&ctx->map, runs[i].vaddr, runs[i].len, runs[i].iova, flags,
+			       runs[i].len, &retired);
+
+	pthread_mutex_unlock(&ctx->map.lock);
+
+	/* translate the entries that were not already mapped */
+	for (i = 0, run = runs; i < n; i++) {
+		if (mapped[i])
+			continue;
+
+		while (iov[i].iov_base < run->vaddr || iov[i].iov_base >= run->vaddr + run->len)
+			run++;
+
+		iovas[i] = run->iova + (uint64_t)(iov[i].iov_base - run->vaddr);
+	}
+
+	ret = 0;
+	release = false;
+
+out:
+	if (release)
+		__iova_release(ctx, reserved, total, flags);
+
+	__iova_map_free_retired(ctx, retired, false);
+
+	free(mapped);
+	free(runs);
+
+	return ret;
+}
+
+static int __iova_mapping_cmp(const void *a, const void *b)
+{
+	const struct iova_mapping *x = *(struct iova_mapping * const *)a;
+	const struct iova_mapping *y = *(struct iova_mapping * const *)b;
+
+	return x->iova < y->iova ? -1 : x->iova > y->iova;
+}
+
+/* unmap deferred mappings, coalescing those contiguous in iova space */
+static int __deferred_unmap(struct iommu_ctx *ctx, struct iova_mapping **ms, int n)
+{
+	int ret = 0;
+
+	qsort(ms, (size_t)n, sizeof(*ms), __iova_mapping_cmp);
+
+	for (int i = 0, j; i < n; i = j) {
+		size_t len = ms[i]->len;
+
+		for (j = i + 1; j < n && ms[j - 1]->iova + ms[j - 1]->len == ms[j]->iova; j++)
+			len += ms[j]->len;
+
+		if (!__dma_unmap(ctx, ms[i]->iova, len))
+			continue;
+
+		/* the backend may refuse to unmap several mappings at once */
+		for (int k = i; k < j; k++) {
+			if (__dma_unmap(ctx, ms[k]->iova, ms[k]->len)) {
+				log_debug("failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n",
+					  ms[k]->iova, ms[k]->len);
+
+				ret = -1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+int iommu_flush_unmaps(struct iommu_ctx *ctx)
+{
+	struct iova_mapping *m, **ms;
+	int n, ret;
+
+	pthread_mutex_lock(&ctx->deferred.lock);
+
+	m = ctx->deferred.head;
+	n = ctx->deferred.n;
+
+	ctx->deferred.head = NULL;
+	ctx->deferred.n = 0;
+
+	pthread_mutex_unlock(&ctx->deferred.lock);
+
+	if (!n)
+		return 0;
+
+	ms = new_t(struct iova_mapping *, n);
+
+	for (int i = 0; m; m = m->next_retired)
+		ms[i++] = m;
+
+	ret = __deferred_unmap(ctx, ms, n);
+
+	/* wait for concurrent lookups before freeing */
+	epoch_synchronize();
+
+	for (int i = 0; i < n; i++) {
+		m = ms[i];
+
+		__iova_release(ctx, m->iova, m->len, m->flags);
+
+		free(m);
+	}
+
+	free(ms);
+
+	return ret;
+}
+
+/* queue an unlinked mapping for unmapping; returns true if due for flushing */
+static bool __iova_defer(struct iommu_ctx *ctx, struct iova_mapping *m)
+{
+	__autolock(&ctx->deferred.lock);
+
+	if (!ctx->deferred.n)
+		ctx->deferred.deadline = get_ticks() +
+			IOMMU_LAZY_UNMAP_TIMEOUT_US * __vfn_ticks_freq / 1000000;
+
+	m->next_retired = ctx->deferred.head;
+	ctx->deferred.head = m;
+
+	return ++ctx->deferred.n >= IOMMU_LAZY_UNMAP_BATCH ||
+		get_ticks() >= ctx->deferred.deadline;
+}
+
+int iommu_set_map_granule(struct iommu_ctx *ctx, size_t granule)
+{
+	if (!ALIGNED(granule, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_store_release(&ctx->map.granule, granule);
+
+	return 0;
+}
+
+void iommu_set_lazy_unmap(struct iommu_ctx *ctx, bool enable)
+{
+	atomic_store_release(&ctx->deferred.enabled, enable);
+
+	if (!enable)
+		log_fatal_if(iommu_flush_unmaps(ctx), "iommu_flush_unmaps\n");
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+{
+	bool lazy = atomic_load_acquire(&ctx->deferred.enabled);
+	struct iova_mapping *m;
+
+	m = iova_map_remove(ctx, vaddr, !lazy);
+	if (!m)
+		return -1;
+
 	if (len)
 		*len = m->len;
 
-	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
-		log_debug("failed to unmap dma\n");
-		return -1;
+	if (lazy) {
+		if (__iova_defer(ctx, m))
+			return iommu_flush_unmaps(ctx);
+
+		return 0;
 	}
 
-	if (m->flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
-		ctx->ops.iova_put_ephemeral(ctx);
+	/* wait for concurrent lookups before freeing */
+	epoch_synchronize();
 
-	iova_map_remove(&ctx->map, m->vaddr);
+	__iova_release(ctx, m->iova, m->len, m->flags);
 
 	free(m);
 
 	return 0;
 }
 
-static void __unmap_mapping(void *opaque, struct skiplist_node *n)
+/* unmap the pending mappings (contiguous in iova space) with a single call */
+static int __flush_pending(struct iommu_ctx *ctx, struct iova_mapping **pending, int npending,
+			   struct iova_mapping **retired)
+{
+	uint64_t iova;
+	size_t len = 0;
+
+	if (!npending)
+		return 0;
+
+	iova = pending[0]->iova;
+
+	for (int i = 0; i < npending; i++)
+		len += pending[i]->len;
+
+	if (__dma_unmap(ctx, iova, len)) {
+		log_debug("failed to unmap dma\n");
+		return -1;
+	}
+
+	for (int i = 0; i < npending; i++)
+		__iova_map_unlink(&ctx->map, pending[i], retired);
+
+	return 0;
+}
+
+static bool __iova_retired(struct iova_mapping *retired, void *vaddr)
+{
+	for (struct iova_mapping *m = retired; m; m = m->next_retired) {
+		if (vaddr >= m->vaddr && vaddr < m->vaddr + m->len)
+			return true;
+	}
+
+	return false;
+}
+
+int iommu_unmap_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n)
+{
+	struct iova_mapping *m, **pending, *retired = NULL;
+	int npending = 0, ret = 0;
+
+	pending = znew_t(struct iova_mapping *, n);
+
+	pthread_mutex_lock(&ctx->map.lock);
+
+	for (int i = 0; i < n; i++) {
+		void *vaddr = iov[i].iov_base;
+		struct iova_mapping *last = npending ? pending[npending - 1] : NULL;
+
+		m = __mapping(skiplist_find(&ctx->map.list, vaddr, iova_cmp, NULL));
+		if (!m) {
+			/* removed as part of a mapping spanning several entries */
+			if (__iova_retired(retired, vaddr))
+				continue;
+
+			errno = ENOENT;
+			ret = -1;
+			break;
+		}
+
+		/* pending mappings are contiguous and ordered in iova space */
+		if (last && m->iova >= pending[0]->iova && m->iova <= last->iova)
+			continue;
+
+		if (last && last->iova + last->len != m->iova) {
+			ret = __flush_pending(ctx, pending, npending, &retired);
+			if (ret)
+				break;
+
+			npending = 0;
+		}
+
+		pending[npending++] = m;
+	}
+
+	if (!ret)
+		ret = __flush_pending(ctx, pending, npending, &retired);
+
+	pthread_mutex_unlock(&ctx->map.lock);
+
+	__iova_map_free_retired(ctx, retired, true);
+
+	free(pending);
+
+	return ret;
+}
+
+int iommu_unmap_range(struct iommu_ctx *ctx, void *vaddr, size_t len)
+{
+	struct iova_mapping *m, *next, *retired = NULL;
+	skiplist_path_t update = {};
+	void *end = vaddr + len;
+	int ret = 0;
+
+	if (!len || !ALIGNED((uintptr_t)vaddr | len, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->map.lock);
+
+	for (m = __iova_map_first(&ctx->map, vaddr, update); m && m->vaddr < end; m = next) {
+		next = __iova_map_next(m);
+
+		ret = iova_map_unmap_part(ctx, m, max_t(void *, vaddr, m->vaddr),
+					  min_t(void *, end, m->vaddr + m->len), &retired);
+		if (ret)
+			break;
+	}
+
+	pthread_mutex_unlock(&ctx->map.lock);
+
+	__iova_map_free_retired(ctx, retired, true);
+
+	return ret;
+}
+
+int iommu_for_each_mapping(struct iommu_ctx *ctx, void *vaddr, size_t len,
+			   int (*fn)(void *opaque, void *vaddr, size_t len, uint64_t iova),
+			   void *opaque)
+{
+	__autolock(&ctx->map.lock);
+
+	skiplist_path_t update = {};
+	struct iova_mapping *m;
+	void *end = len ? vaddr + len : NULL;
+	int n = 0;
+
+	for (m = __iova_map_first(&ctx->map, vaddr, update); m; m = __iova_map_next(m)) {
+		if (end && m->vaddr >= end)
+			break;
+
+		n++;
+
+		if (fn(opaque, m->vaddr, m->len, m->iova))
+			break;
+	}
+
+	return n;
+}
+
+static void __release_mapping(void *opaque, struct iova_mapping *m)
+{
+	struct iommu_ctx *ctx = opaque;
+
+	__iova_release(ctx, m->iova, m->len, m->flags);
+}
+
+static void __unmap_mapping(void *opaque, struct iova_mapping *m)
 {
 	struct iommu_ctx *ctx = opaque;
-	struct iova_mapping *m = container_of_var(n, m, list);
 
-	log_fatal_if(ctx->ops.dma_unmap(ctx, m->len, m->iova),
+	log_fatal_if(__dma_unmap(ctx, m->iova, m->len),
 		     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
 
-	free(m);
+	__release_mapping(ctx, m);
 }
 
 int iommu_unmap_all(struct iommu_ctx *ctx)
 {
+	if (iommu_flush_unmaps(ctx))
+		log_debug("failed to flush deferred unmaps\n");
+
 	if (ctx->ops.dma_unmap_all) {
 		if (ctx->ops.dma_unmap_all(ctx)) {
 			log_debug("failed to unmap dma\n");
 			return -1;
 		}
 
-		iova_map_clear(&ctx->map);
+		atomic_store_release(&ctx->pinned, 0);
 
-		return 0;
+		iova_map_clear_with(&ctx->map, __release_mapping, ctx);
+	} else {
+		iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
 	}
 
-	iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
+	/* the arenas of the dma heap and the cached registrations are gone */
+	iommu_dma_heap_reset(ctx);
+	iommu_cache_reset(ctx);
 
 	return 0;
 }
 
+void iommu_get_dma_stats(struct iommu_ctx *ctx, struct iommu_dma_stats *stats)
+{
+	struct rlimit rlim;
+
+	*stats = (struct iommu_dma_stats) {
+		.pinned = atomic_load_acquire(&ctx->pinned),
+
+		/* deferred mappings are still mapped */
+		.nmappings = atomic_load_acquire(&ctx->map.n) +
+			(unsigned int)atomic_load_acquire(&ctx->deferred.n),
+
+		.dma_avail = ctx->dma_avail,
+	};
+
+	if (!getrlimit(RLIMIT_MEMLOCK, &rlim) && rlim.rlim_cur != RLIM_INFINITY)
+		stats->memlock = rlim.rlim_cur;
+}
+
 int iommu_get_iova_ranges(struct iommu_ctx *ctx, struct iommu_iova_range **ranges)
 {
 	*ranges = ctx->iova_ranges;
@@ -0,0 +1,385 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/dma_alloc: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "context.h"
+
+/* arenas are mapped in one go and carved into slabs */
+#define IOMMU_DMA_ARENA_SIZE (4 << 20)
+#define IOMMU_DMA_SLAB_SIZE (1 << (IOMMU_DMA_MAX_SHIFT + 1))
+
+/*
+ * Magazines loaded by the thread from a heap. Each thread has a cache per heap,
+ * kept in the thread-specific data of the heap key; the magazines are returned
+ * to the depot when the thread exits. They are dropped if the heap was reset
+ * since they were loaded.
+ */
+struct iommu_dma_cache {
+	struct iommu_dma_heap *heap;
+	unsigned int gen;
+
+	struct iommu_dma_magazine *loaded[IOMMU_DMA_NR_CLASSES];
+};
+
+static inline int __class(size_t len)
+{
+	if (len <= 1 << IOMMU_DMA_MIN_SHIFT)
+		return 0;
+
+	return 64 - __builtin_clzll(len - 1) - IOMMU_DMA_MIN_SHIFT;
+}
+
+/* return a magazine to the depot; heap must be locked */
+static void __depot_put(struct iommu_dma_heap *heap, int k, struct iommu_dma_magazine *mag)
+{
+	struct iommu_dma_magazine **list;
+
+	list = mag->n ? &heap->classes[k].full : &heap->classes[k].empty;
+
+	mag->next = *list;
+	*list = mag;
+}
+
+static void __depot_free(struct iommu_dma_magazine *mag)
+{
+	struct iommu_dma_magazine *next;
+
+	for (; mag; mag = next) {
+		next = mag->next;
+		free(mag);
+	}
+}
+
+static void __cache_flush(struct iommu_dma_cache *cache)
+{
+	struct iommu_dma_heap *heap = cache->heap;
+	bool stale;
+
+	__autolock(&heap->lock);
+
+	/* the objects of an earlier generation are no longer mapped */
+	stale = cache->gen != heap->gen;
+
+	for (int k = 0; k < IOMMU_DMA_NR_CLASSES; k++) {
+		if (!cache->loaded[k])
+			continue;
+
+		if (stale)
+			free(cache->loaded[k]);
+		else
+			__depot_put(heap, k, cache->loaded[k]);
+
+		cache->loaded[k] = NULL;
+	}
+
+	cache->gen = heap->gen;
+}
+
+static void __cache_destroy(void *opaque)
+{
+	struct iommu_dma_cache *cache = opaque;
+
+	__cache_flush(cache);
+
+	free(cache);
+}
+
+static struct iommu_dma_cache *__cache_get(struct iommu_dma_heap *heap)
+{
+	struct iommu_dma_cache *cache = pthread_getspecific(heap->key);
+
+	if (likely(cache && cache->gen == atomic_load_acquire(&heap->gen)))
+		return cache;
+
+	if (cache) {
+		__cache_flush(cache);
+		return cache;
+	}
+
+	cache = znew_t(struct iommu_dma_cache, 1);
+	cache->heap = heap;
+	cache->gen = atomic_load_acquire(&heap->gen);
+
+	/* return magazines to the depot on thread exit */
+	if (pthread_setspecific(heap->key, cache))
+		backtrace_abort();
+
+	return cache;
+}
+
+/* map a new arena; heap must be locked */
+static int __heap_grow(struct iommu_dma_heap *heap)
+{
+	struct iommu_ctx *ctx = container_of_var(heap, ctx, heap);
+	struct iommu_dma_arena *arena;
+	void *vaddr;
+	uint64_t iova;
+	ssize_t len;
+
+	len = pgmap(&vaddr, IOMMU_DMA_ARENA_SIZE);
+	if (len < 0) {
+		log_debug("failed to allocate arena\n");
+		return -1;
+	}
+
+	if (iommu_map_vaddr(ctx, vaddr, (size_t)len, &iova, 0x0)) {
+		log_debug("failed to map arena\n");
+
+		pgunmap(vaddr, (size_t)len);
+
+		return -1;
+	}
+
+	arena = znew_t(struct iommu_dma_arena, 1);
+	arena->vaddr = vaddr;
+	arena->len = (size_t)len;
+	arena->next = heap->arenas;
+	heap->arenas = arena;
+
+	/* the remainder of the previous arena is lost; it is less than a slab */
+	heap->arena.vaddr = vaddr;
+	heap->arena.iova = iova;
+	heap->arena.len = (size_t)len;
+
+	return 0;
+}
+
+/* fill mag with new objects from the slab of class k; heap must be locked */
+static int __heap_carve(struct iommu_dma_heap *heap, int k, struct iommu_dma_magazine *mag)
+{
+	size_t size = 1ULL << (k + IOMMU_DMA_MIN_SHIFT);
+
+	while (mag->n < IOMMU_DMA_MAGAZINE_SIZE) {
+		if (!heap->classes[k].len) {
+			if (heap->arena.len < IOMMU_DMA_SLAB_SIZE && __heap_grow(heap))
+				break;
+
+			heap->classes[k].vaddr = heap->arena.vaddr;
+			heap->classes[k].iova = heap->arena.iova;
+			heap->classes[k].len = IOMMU_DMA_SLAB_SIZE;
+
+			heap->arena.vaddr += IOMMU_DMA_SLAB_SIZE;
+			heap->arena.iova += IOMMU_DMA_SLAB_SIZE;
+			heap->arena.len -= IOMMU_DMA_SLAB_SIZE;
+		}
+
+		mag->objs[mag->n].vaddr = heap->classes[k].vaddr;
+		mag->objs[mag->n].iova = heap->classes[k].iova;
+		mag->n++;
+
+		heap->classes[k].vaddr += size;
+		heap->classes[k].iova += size;
+		heap->classes[k].len -= size;
+	}
+
+	return mag->n ? 0 : -1;
+}
+
+/* exchange the loaded (empty) magazine for a full one */
+static struct iommu_dma_magazine *__heap_refill(struct iommu_dma_heap *heap, int k,
+						 struct iommu_dma_magazine *mag)
+{
+	struct iommu_dma_magazine *full;
+
+	__autolock(&heap->lock);
+
+	full = heap->classes[k].full;
+	if (full) {
+		heap->classes[k].full = full->next;
+
+		if (mag)
+			__depot_put(heap, k, mag);
+
+		return full;
+	}
+
+	if (!mag)
+		mag = znew_t(struct iommu_dma_magazine, 1);
+
+	if (__heap_carve(heap, k, mag)) {
+		__depot_put(heap, k, mag);
+		return NULL;
+	}
+
+	return mag;
+}
+
+/* exchange the loaded (full) magazine for an empty one */
+static struct iommu_dma_magazine *__heap_swap_empty(struct iommu_dma_heap *heap, int k,
+						    struct iommu_dma_magazine *mag)
+{
+	struct iommu_dma_magazine *empty;
+
+	__autolock(&heap->lock);
+
+	if (mag)
+		__depot_put(heap, k, mag);
+
+	empty = heap->classes[k].empty;
+	if (empty) {
+		heap->classes[k].empty = empty->next;
+		return empty;
+	}
+
+	return znew_t(struct iommu_dma_magazine, 1);
+}
+
+static void *__dma_alloc_large(struct iommu_ctx *ctx, size_t len, uint64_t *iova)
+{
+	void *vaddr;
+	ssize_t ret;
+
+	ret = pgmap(&vaddr, len);
+	if (ret < 0)
+		return NULL;
+
+	if (iommu_map_vaddr(ctx, vaddr, (size_t)ret, iova, 0x0)) {
+		log_debug("failed to map dma buffer\n");
+
+		pgunmap(vaddr, (size_t)ret);
+
+		return NULL;
+	}
+
+	return vaddr;
+}
+
+void *iommu_dma_alloc(struct iommu_ctx *ctx, size_t len, uint64_t *iova)
+{
+	struct iommu_dma_cache *cache;
+	struct iommu_dma_magazine *mag;
+	int k;
+
+	if (!len) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (len > 1ULL << IOMMU_DMA_MAX_SHIFT)
+		return __dma_alloc_large(ctx, len, iova);
+
+	k = __class(len);
+
+	cache = __cache_get(&ctx->heap);
+
+	mag = cache->loaded[k];
+	if (unlikely(!mag || !mag->n)) {
+		mag = __heap_refill(&ctx->heap, k, mag);
+		cache->loaded[k] = mag;
+
+		if (!mag) {
+			log_debug("failed to refill magazine\n");
+
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	mag->n--;
+
+	*iova = mag->objs[mag->n].iova;
+
+	return mag->objs[mag->n].vaddr;
+}
+
+void iommu_dma_free(struct iommu_ctx *ctx, void *vaddr, size_t len)
+{
+	struct iommu_dma_cache *cache;
+	struct iommu_dma_magazine *mag;
+	uint64_t iova;
+	int k;
+
+	if (!vaddr)
+		return;
+
+	if (len > 1ULL << IOMMU_DMA_MAX_SHIFT) {
+		log_fatal_if(iommu_unmap_vaddr(ctx, vaddr, &len), "iommu_unmap_vaddr\n");
+
+		pgunmap(vaddr, len);
+
+		return;
+	}
+
+	/* the heap was reset since the buffer was allocated */
+	if (!iommu_translate_vaddr(ctx, vaddr, &iova)) {
+		log_debug("vaddr %p is not mapped; dropping it\n", vaddr);
+		return;
+	}
+
+	k = __class(len);
+
+	cache = __cache_get(&ctx->heap);
+
+	mag = cache->loaded[k];
+	if (unlikely(!mag || mag->n == IOMMU_DMA_MAGAZINE_SIZE)) {
+		mag = __heap_swap_empty(&ctx->heap, k, mag);
+		cache->loaded[k] = mag;
+	}
+
+	mag->objs[mag->n].vaddr = vaddr;
+	mag->objs[mag->n].iova = iova;
+	mag->n++;
+}
+
+void iommu_dma_heap_init(struct iommu_ctx *ctx)
+{
+	struct iommu_dma_heap *heap = &ctx->heap;
+
+	pthread_mutex_init(&heap->lock, NULL);
+
+	if (pthread_key_create(&heap->key, __cache_destroy))
+		backtrace_abort();
+}
+
+void iommu_dma_heap_reset(struct iommu_ctx *ctx)
+{
+	struct iommu_dma_heap *heap = &ctx->heap;
+	struct iommu_dma_arena *arena, *next;
+
+	__autolock(&heap->lock);
+
+	/* invalidate the magazines loaded by threads */
+	atomic_store_release(&heap->gen, heap->gen + 1);
+
+	for (int k = 0; k < IOMMU_DMA_NR_CLASSES; k++) {
+		__depot_free(heap->classes[k].full);
+		__depot_free(heap->classes[k].empty);
+	}
+
+	memset(&heap->classes, 0x0, sizeof(heap->classes));
+	memset(&heap->arena, 0x0, sizeof(heap->arena));
+
+	for (arena = heap->arenas; arena; arena = next) {
+		next = arena->next;
+
+		pgunmap(arena->vaddr, arena->len);
+		free(arena);
+	}
+
+	heap->arenas = NULL;
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "dma_alloc.c"
+
+#include "test_ctx.h"
+
+static struct iommu_ctx ctx, ctx2;
+
+int main(void)
+{
+	struct iommu_dma_magazine *mag;
+	uint64_t iova, iova2;
+	void *p, *q;
+
+	plan_tests(14);
+
+	test_ctx_init(&ctx);
+
+	ok1(!iommu_dma_alloc(&ctx, 0, &iova) && errno == EINVAL);
+
+	/* the first allocation maps an arena; the following are served from it */
+	p = iommu_dma_alloc(&ctx, 100, &iova);
+	q = iommu_dma_alloc(&ctx, 128, &iova2);
+	ok1(p && q && nmaps == 1);
+	ok1(ALIGNED((uintptr_t)p, 128) && ALIGNED((uintptr_t)q, 128));
+	ok1(iova2 - iova == (uint64_t)(q - p));
+	ok1(iommu_translate_vaddr(&ctx, q, &iova) && iova == iova2);
+
+	/* freed buffers are reused */
+	iommu_dma_free(&ctx, q, 128);
+	ok1(iommu_dma_alloc(&ctx, 128, &iova) == q && iova == iova2);
+
+	for (int i = 0; i < 2 * IOMMU_DMA_MAGAZINE_SIZE; i++)
+		iommu_dma_alloc(&ctx, 0x1000, &iova);
+
+	ok1(nmaps == 1);
+
+	/* large buffers are mapped individually */
+	p = iommu_dma_alloc(&ctx, 0x40000, &iova);
+	ok1(p && nmaps == 2);
+
+	iommu_dma_free(&ctx, p, 0x40000);
+	ok1(nunmaps == 1 && !iommu_translate_vaddr(&ctx, p, &iova));
+
+	/* unmapping everything drops the arenas and the loaded magazines */
+	ok1(!iommu_unmap_all(&ctx) && !ctx.heap.arenas);
+
+	p = iommu_dma_alloc(&ctx, 128, &iova);
+	ok1(p && nmaps == 3);
+	ok1(iommu_translate_vaddr(&ctx, p, &iova2) && iova2 == iova);
+
+	/* buffers allocated before the reset are dropped */
+	iommu_dma_free(&ctx, q, 128);
+
+	/* the thread keeps its magazines in each heap when alternating */
+	test_ctx_init(&ctx2);
+
+	iommu_dma_free(&ctx, p, 128);
+	mag = ctx.heap.classes[__class(128)].full;
+
+	q = iommu_dma_alloc(&ctx2, 128, &iova2);
+	ok1(q && ctx.heap.classes[__class(128)].full == mag);
+	ok1(iommu_dma_alloc(&ctx, 128, &iova2) == p && iova2 == iova);
+
+	return exit_status();
+}
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "dma.c"
+
+#define SZ 0x10000
+
+#include "test_ctx.h"
+
+static struct iommu_ctx ctx, ctx2;
+
+static int __collect(void *opaque, void *vaddr, size_t len UNUSED, uint64_t iova UNUSED)
+{
+	void ***p = opaque;
+
+	*(*p)++ = vaddr;
+
+	return 0;
+}
+
+static void *at(uintptr_t n)
+{
+	return (void *)(n * SZ);
+}
+
+static int map(uintptr_t n, uintptr_t npages, uint64_t iova, unsigned long flags)
+{
+	return iommu_map_vaddr(&ctx, at(n), npages * SZ, &iova, flags | IOMMU_MAP_FIXED_IOVA);
+}
+
+static bool translates(uintptr_t n, uint64_t expected)
+{
+	uint64_t iova;
+
+	return iommu_translate_vaddr(&ctx, at(n), &iova) && iova == expected;
+}
+
+static void test_batch(void)
+{
+	struct iovec iov[] = {
+		{at(64), SZ}, {at(65), SZ}, {at(70), SZ}, {at(71), 2 * SZ},
+	};
+	uint64_t iovas[4];
+	void *vaddrs[4];
+
+	/* contiguous neighbours are mapped together */
+	nmaps = 0;
+	ok1(iommu_map_vaddrs(&ctx, iov, 4, iovas, 0x0) == 0 && nmaps == 2);
+	ok1(iovas[0] == TEST_IOVA_BASE && iovas[1] == TEST_IOVA_BASE + SZ &&
+	    iovas[2] == TEST_IOVA_BASE + 2 * SZ && iovas[3] == TEST_IOVA_BASE + 3 * SZ);
+	ok1(iommu_for_each_mapping(&ctx, at(64), 16 * SZ, __collect, &(void **){vaddrs}) == 2);
+	ok1(translates(72, TEST_IOVA_BASE + 4 * SZ));
+
+	/* unaligned elements */
+	iov[3] = (struct iovec) {at(80), 0x800};
+	nmaps = 0;
+	ok1(iommu_map_vaddrs(&ctx, &iov[3], 1, iovas, 0x0) == -1 && errno == EINVAL && !nmaps);
+	iov[3] = (struct iovec) {at(80) + 0x800, SZ};
+	ok1(iommu_map_vaddrs(&ctx, &iov[3], 1, iovas, 0x0) == -1 && errno == EINVAL);
+
+	/* overlapping elements */
+	iov[3] = (struct iovec) {at(63), 2 * SZ};
+	ok1(iommu_map_vaddrs(&ctx, &iov[3], 1, iovas, 0x0) == -1 && errno == EEXIST);
+	iov[3] = (struct iovec) {at(80), 2 * SZ};
+	iov[2] = (struct iovec) {at(81), SZ};
+	nmaps = 0;
+	ok1(iommu_map_vaddrs(&ctx, &iov[2], 2, iovas, 0x0) == -1 && errno == EEXIST && !nmaps);
+
+	/* the two mappings are contiguous in iova space; unmapped in one call */
+	nunmaps = 0;
+	iov[2] = (struct iovec) {at(70), SZ};
+	ok1(iommu_unmap_vaddrs(&ctx, iov, 3) == 0 && nunmaps == 1);
+	ok1(iommu_for_each_mapping(&ctx, at(64), 16 * SZ, __collect, &(void **){vaddrs}) == 0);
+}
+
+static void test_merge_nonuniform(void)
+{
+	uint64_t iova = 0x6000000;
+	size_t len;
+
+	/* two merged mappings backed by kernel mappings of different sizes */
+	ok1(map(160, 1, iova, IOMMU_MAP_MERGE) == 0 && map(161, 2, iova + SZ, IOMMU_MAP_MERGE) == 0);
+	ok1(map(164, 1, iova + 4 * SZ, IOMMU_MAP_MERGE) == 0 &&
+	    map(165, 2, iova + 5 * SZ, IOMMU_MAP_MERGE) == 0);
+
+	/* bridging them */
+	ok1(map(163, 1, iova + 3 * SZ, IOMMU_MAP_MERGE) == 0 && translates(166, iova + 6 * SZ));
+
+	/* the kernel mappings are not uniform; the result cannot be split */
+	ok1(iommu_unmap_range(&ctx, at(163), SZ) == -1 && errno == EINVAL);
+	ok1(iommu_unmap_vaddr(&ctx, at(163), &len) == 0 && len == 7 * SZ);
+}
+
+static void test_translate_cache(void)
+{
+	/* the translation is cached by the thread */
+	ok1(map(140, 1, 0x7000000, 0) == 0 && translates(140, 0x7000000) &&
+	    translates(140, 0x7000000));
+
+	/* remapped at another iova; the cached translation is stale */
+	ok1(iommu_unmap_vaddr(&ctx, at(140), NULL) == 0 && map(140, 1, 0x7100000, 0) == 0);
+	ok1(translates(140, 0x7100000));
+
+	ok1(iommu_unmap_vaddr(&ctx, at(140), NULL) == 0 && !translates(140, 0x7100000));
+}
+
+static void test_lazy_unmap(void)
+{
+	uint64_t iova;
+
+	ok1(map(96, 1, 0x4000000, 0) == 0 && map(97, 1, 0x4000000 + SZ, 0) == 0);
+	ok1(map(99, 1, 0x4000000 + 2 * SZ, 0) == 0);
+
+	iommu_set_lazy_unmap(&ctx, true);
+
+	/* removed from the map, but not from the iommu */
+	nunmaps = 0;
+	ok1(iommu_unmap_vaddr(&ctx, at(99), NULL) == 0 && iommu_unmap_vaddr(&ctx, at(96), NULL) == 0);
+	ok1(iommu_unmap_vaddr(&ctx, at(97), NULL) == 0 && !nunmaps);
+	ok1(!iommu_translate_vaddr(&ctx, at(97), &iova) && ctx.deferred.n == 3);
+
+	/* contiguous in iova space; unmapped in one call */
+	ok1(iommu_flush_unmaps(&ctx) == 0 && nunmaps == 1 && !ctx.deferred.n);
+
+	/* disabling flushes */
+	ok1(map(96, 1, 0x4000000, 0) == 0 && iommu_unmap_vaddr(&ctx, at(96), NULL) == 0);
+	iommu_set_lazy_unmap(&ctx, false);
+	ok1(nunmaps == 2 && !ctx.deferred.n);
+}
+
+static void test_share(void)
+{
+	uint64_t iova;
+
+	ok1(map(120, 2, 0x5000000, 0) == 0);
+
+	/* the entire mapping appears at the same iova */
+	nmaps = 0;
+	ok1(iommu_share_vaddr(&ctx, &ctx2, at(121)) == 0 && ncopies == 1 && !nmaps);
+	ok1(iommu_translate_vaddr(&ctx2, at(120), &iova) && iova == 0x5000000);
+
+	ok1(iommu_share_vaddr(&ctx, &ctx2, at(120)) == -1 && errno == EEXIST);
+	ok1(iommu_share_vaddr(&ctx, &ctx2, at(122)) == -1 && errno == ENOENT);
+
+	ok1(iommu_unmap_vaddr(&ctx2, at(120), NULL) == 0 && translates(120, 0x5000000));
+}
+
+int main(void)
+{
+	void *vaddrs[8], **p;
+	uint64_t iova;
+
+	plan_tests(50);
+
+	test_ctx_init(&ctx);
+	test_ctx_init(&ctx2);
+
+	/* backed by one kernel mapping per page */
+	ok1(iommu_set_map_granule(&ctx, SZ) == 0);
+	ok1(map(16, 4, 0x1000000, 0) == 0 && nmaps == 4);
+	ok1(iommu_set_map_granule(&ctx, 0) == 0);
+
+	/* partial overlap with the start of an existing mapping */
+	nunmaps = 0;
+	ok1(map(14, 4, 0x2000000, 0) == -1 && errno == EEXIST);
+	ok1(nunmaps == 1);
+
+	/* adjacent mergeable mappings */
+	ok1(map(32, 2, 0x3000000, IOMMU_MAP_MERGE) == 0);
+	ok1(map(36, 2, 0x3000000 + 4 * SZ, IOMMU_MAP_MERGE) == 0);
+	ok1(map(34, 2, 0x3000000 + 2 * SZ, IOMMU_MAP_MERGE) == 0);
+	ok1(iommu_for_each_mapping(&ctx, NULL, 0, __collect, &(void **){vaddrs}) == 2);
+	ok1(translates(37, 0x3000000 + 5 * SZ));
+
+	/* split; the remaining parts are not remapped */
+	nmaps = nunmaps = 0;
+	ok1(iommu_unmap_range(&ctx, at(17), SZ) == 0 && nunmaps == 1 && !nmaps);
+	ok1(!iommu_translate_vaddr(&ctx, at(17), &iova) && translates(18, 0x1000000 + 2 * SZ));
+
+	p = vaddrs;
+	ok1(iommu_for_each_mapping(&ctx, NULL, 0, __collect, &p) == 3 &&
+	    vaddrs[0] == at(16) && vaddrs[1] == at(18) && vaddrs[2] == at(32));
+
+	/* within a kernel mapping */
+	ok1(iommu_unmap_range(&ctx, at(32), SZ) == -1 && errno == EINVAL &&
+	    translates(32, 0x3000000));
+
+	/* across several mappings, splitting the last between kernel mappings */
+	ok1(iommu_unmap_range(&ctx, at(16), 18 * SZ) == 0);
+	ok1(iommu_for_each_mapping(&ctx, NULL, 0, __collect, &(void **){vaddrs}) == 1 &&
+	    translates(34, 0x3000000 + 2 * SZ) && !iommu_translate_vaddr(&ctx, at(33), &iova));
+
+	test_batch();
+	test_merge_nonuniform();
+	test_translate_cache();
+	test_lazy_unmap();
+	test_share();
+
+	ok1(iommu_unmap_all(&ctx) == 0 &&
+	    iommu_for_each_mapping(&ctx, NULL, 0, __collect, &(void **){vaddrs}) == 0);
+
+	return exit_status();
+}
@@ -204,6 +204,50 @@ static int iommu_ioas_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len,
 	return 0;
 }
 
+static int iommu_ioas_do_dma_copy(struct iommu_ctx *ctx, struct iommu_ctx *src, uint64_t iova,
+				  size_t len, unsigned long flags)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+	struct iommu_ioas *src_ioas;
+
+	struct iommu_ioas_copy copy = {
+		.size = sizeof(copy),
+		.flags = IOMMU_IOAS_MAP_FIXED_IOVA | IOMMU_IOAS_MAP_READABLE |
+			IOMMU_IOAS_MAP_WRITEABLE,
+		.dst_ioas_id = ioas->id,
+		.length = len,
+		.dst_iova = iova,
+		.src_iova = iova,
+	};
+
+	/* the pages are shared with the source ioas; both must be iommufd-backed */
+	if (src->ops.dma_copy != iommu_ioas_do_dma_copy) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	src_ioas = container_of_var(src, src_ioas, ctx);
+	copy.src_ioas_id = src_ioas->id;
+
+	if (flags & IOMMU_MAP_NOWRITE)
+		copy.flags &= ~IOMMU_IOAS_MAP_WRITEABLE;
+
+	if (flags & IOMMU_MAP_NOREAD)
+		copy.flags &= ~IOMMU_IOAS_MAP_READABLE;
+
+	trace_guard(IOMMUFD_IOAS_COPY_DMA) {
+		trace_emit("src ioas %" PRIu32 " iova 0x%" PRIx64 " len %zu\n", copy.src_ioas_id,
+			   iova, len);
+	}
+
+	if (ioctl(__iommufd, IOMMU_IOAS_COPY, &copy)) {
+		log_debug("failed to copy mapping\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int iommu_ioas_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, size_t len)
 {
 	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
@@ -236,6 +280,7 @@ static const struct iommu_ctx_ops iommufd_ops = {
 	.get_device_fd = iommufd_get_device_fd,
 
 	.dma_map = iommu_ioas_do_dma_map,
+	.dma_copy = iommu_ioas_do_dma_copy,
 	.dma_unmap = iommu_ioas_do_dma_unmap,
 	.dma_unmap_all = iommu_ioas_do_dma_unmap_all,
 };
@@ -0,0 +1,469 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/iova: " fmt
+
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/list/list.h"
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "util/skiplist.h"
+
+#include "iova.h"
+
+struct iova_free_range {
+	/* inclusive */
+	uint64_t start, last;
+
+	struct list_node class;
+
+	/* variable height; must be last */
+	struct skiplist_node list;
+};
+
+static inline struct iova_free_range *__range(struct skiplist_node *n)
+{
+	return container_of_or_null(n, struct iova_free_range, list);
+}
+
+static int __range_cmp(const void *key, const struct skiplist_node *n)
+{
+	struct iova_free_range *r = container_of_var(n, r, list);
+	uint64_t iova = *(const uint64_t *)key;
+
+	if (iova < r->start)
+		return -1;
+	else if (iova > r->start)
+		return 1;
+
+	return 0;
+}
+
+/* floor(log2(number of pages)) */
+static inline int __class(struct iova_allocator *a, uint64_t start, uint64_t last)
+{
+	uint64_t npages = ((last - start) >> a->pageshift) + 1;
+
+	return 63 - __builtin_clzll(npages);
+}
+
+static void __range_insert_class(struct iova_allocator *a, struct iova_free_range *r)
+{
+	list_add(&a->classes[__class(a, r->start, r->last)], &r->class);
+}
+
+static void __range_link(struct iova_allocator *a, uint64_t start, uint64_t last)
+{
+	struct iova_free_range *r;
+	skiplist_path_t update = {};
+
+	r = skiplist_new(&a->ranges, struct iova_free_range, list);
+
+	r->start = start;
+	r->last = last;
+
+	skiplist_find(&a->ranges, &start, __range_cmp, update);
+	skiplist_link(&a->ranges, &r->list, update);
+
+	__range_insert_class(a, r);
+}
+
+static void __range_unlink(struct iova_allocator *a, struct iova_free_range *r)
+{
+	skiplist_path_t update = {};
+
+	skiplist_find(&a->ranges, &r->start, __range_cmp, update);
+	skiplist_erase(&a->ranges, &r->list, update);
+
+	list_del(&r->class);
+
+	free(r);
+}
+
+/* free the inclusive range [iova, last] */
+static int __iova_free(struct iova_allocator *a, uint64_t iova, uint64_t last)
+{
+	struct iova_free_range *prev, *next;
+	skiplist_path_t update = {};
+
+	skiplist_find(&a->ranges, &iova, __range_cmp, update);
+
+	prev = __range(skiplist_path_prev(&a->ranges, update));
+	next = __range(skiplist_path_next(update));
+
+	if ((prev && prev->last >= iova) || (next && next->start <= last)) {
+		log_debug("iova range [0x%" PRIx64 "; 0x%" PRIx64 "] is already (partly) free\n",
+			  iova, last);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* coalesce */
+	if (prev && prev->last + 1 == iova) {
+		iova = prev->start;
+		__range_unlink(a, prev);
+	}
+
+	if (next && last + 1 == next->start) {
+		last = next->last;
+		__range_unlink(a, next);
+	}
+
+	__range_link(a, iova, last);
+
+	return 0;
+}
+
+void iova_allocator_init(struct iova_allocator *a, struct iommu_iova_range *ranges, int nranges,
+			 int pageshift)
+{
+	uint64_t pagemask = (1ULL << pageshift) - 1;
+
+	skiplist_init(&a->ranges);
+
+	for (int k = 0; k < IOVA_NR_CLASSES; k++)
+		list_head_init(&a->classes[k]);
+
+	a->pageshift = pageshift;
+
+	for (int i = 0; i < nranges; i++) {
+		uint64_t start = ALIGN_UP(ranges[i].start, pagemask + 1);
+		uint64_t last = ranges[i].last;
+
+		/* only whole pages */
+		if ((last & pagemask) != pagemask) {
+			if (last < pagemask)
+				continue;
+
+			last = (last & ~pagemask) - 1;
+		}
+
+		if (start < ranges[i].start || start > last)
+			continue;
+
+		__iova_free(a, start, last);
+	}
+}
+
+static void __free_range(void *opaque UNUSED, struct skiplist_node *n)
+{
+	free(__range(n));
+}
+
+void iova_allocator_destroy(struct iova_allocator *a)
+{
+	skiplist_clear_with(&a->ranges, __free_range, NULL);
+
+	for (int k = 0; k < IOVA_NR_CLASSES; k++)
+		list_head_init(&a->classes[k]);
+}
+
+/* does [start, last] hold len bytes at the given alignment? */
+static inline bool __fits(struct iova_free_range *r, size_t len, uint64_t align, uint64_t *iova)
+{
+	uint64_t aligned = ALIGN_UP(r->start, align);
+
+	if (aligned < r->start || aligned > r->last)
+		return false;
+
+	if (r->last - aligned < len - 1)
+		return false;
+
+	*iova = aligned;
+
+	return true;
+}
+
+static void __carve(struct iova_allocator *a, struct iova_free_range *r, uint64_t iova,
+		    size_t len)
+{
+	uint64_t start = r->start, last = r->last;
+
+	__range_unlink(a, r);
+
+	if (iova > start)
+		__range_link(a, start, iova - 1);
+
+	if (iova + len - 1 < last)
+		__range_link(a, iova + len, last);
+}
+
+int iova_alloc(struct iova_allocator *a, size_t len, uint64_t align, uint64_t *iova)
+{
+	uint64_t npages, need;
+	struct iova_free_range *r;
+	int k;
+
+	if (!len || len & ((1ULL << a->pageshift) - 1) || align & (align - 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	align = max_t(uint64_t, align, 1ULL << a->pageshift);
+
+	npages = len >> a->pageshift;
+
+	/* worst-case number of pages needed to satisfy the alignment */
+	need = npages + (align >> a->pageshift) - 1;
+
+	/* ceil(log2(need)); any range in this class or above fits */
+	k = need > 1 ? 64 - __builtin_clzll(need - 1) : 0;
+
+	for (; k < IOVA_NR_CLASSES; k++) {
+		r = list_top(&a->classes[k], struct iova_free_range, class);
+		if (r && __fits(r, len, align, iova))
+			goto found;
+	}
+
+	/* best effort; ranges in the class of npages may fit */
+	k = 63 - __builtin_clzll(npages);
+
+	list_for_each(&a->classes[k], r, class) {
+		if (__fits(r, len, align, iova))
+			goto found;
+	}
+
+	errno = ENOMEM;
+	return -1;
+
+found:
+	__carve(a, r, *iova, len);
+
+	return 0;
+}
+
+int iova_alloc_fixed(struct iova_allocator *a, uint64_t iova, size_t len)
+{
+	struct iova_free_range *r;
+	skiplist_path_t update = {};
+
+	if (!len || (iova | len) & ((1ULL << a->pageshift) - 1) || iova + len - 1 < iova) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the range starting at or closest below iova */
+	r = __range(skiplist_find(&a->ranges, &iova, __range_cmp, update));
+	if (!r)
+		r = __range(skiplist_path_prev(&a->ranges, update));
+
+	if (!r || r->start > iova || r->last < iova + len - 1) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	__carve(a, r, iova, len);
+
+	return 0;
+}
+
+int iova_free(struct iova_allocator *a, uint64_t iova, size_t len)
+{
+	if (!len || iova + len - 1 < iova) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return __iova_free(a, iova, iova + len - 1);
+}
+
+static void __chunk_push(struct iova_pool *pool, uint32_t idx)
+{
+	struct iova_pool_chunk *chunk = &pool->chunks[idx];
+	uint64_t top, next;
+
+	top = atomic_load_acquire(&pool->top);
+
+	do {
+		chunk->next = (uint32_t)top;
+		next = (((top >> 32) + 1) << 32) | (idx + 1);
+	} while (!atomic_cmpxchg(&pool->top, top, next));
+}
+
+static int __chunk_pop(struct iova_pool *pool, uint32_t *idx)
+{
+	uint64_t top, next;
+
+	top = atomic_load_acquire(&pool->top);
+
+	do {
+		if (!(uint32_t)top)
+			return -1;
+
+		next = (((top >> 32) + 1) << 32) |
+			atomic_load_acquire(&pool->chunks[(uint32_t)top - 1].next);
+	} while (!atomic_cmpxchg(&pool->top, top, next));
+
+	*idx = (uint32_t)top - 1;
+
+	return 0;
+}
+
+static void __chunk_put(struct iova_pool *pool, uint32_t idx)
+{
+	if (atomic_dec_fetch(&pool->chunks[idx].refs) == 0)
+		__chunk_push(pool, idx);
+}
+
+/*
+ * The chunk currently owned by the thread in a pool. Each thread has a cursor
+ * per pool, kept in the thread-specific data of the pool key. The owner
+ * reference is dropped when the chunk is exhausted, when the thread exits or
+ * when the pool is destroyed by the thread.
+ */
+struct iova_pool_cursor {
+	struct iova_pool *pool;
+
+	/* index (plus one) of the owned chunk; zero if none */
+	uint32_t chunk;
+
+	uint64_t next, end;
+};
+
+static void __cursor_release(struct iova_pool_cursor *c)
+{
+	if (!c->chunk)
+		return;
+
+	__chunk_put(c->pool, c->chunk - 1);
+
+	c->chunk = 0;
+}
+
+static void __cursor_destroy(void *opaque)
+{
+	struct iova_pool_cursor *c = opaque;
+
+	__cursor_release(c);
+
+	free(c);
+}
+
+static struct iova_pool_cursor *__cursor_get(struct iova_pool *pool)
+{
+	struct iova_pool_cursor *c = pthread_getspecific(pool->key);
+
+	if (c)
+		return c;
+
+	c = znew_t(struct iova_pool_cursor, 1);
+	c->pool = pool;
+
+	if (pthread_setspecific(pool->key, c))
+		backtrace_abort();
+
+	return c;
+}
+
+static int __cursor_acquire(struct iova_pool_cursor *c)
+{
+	struct iova_pool *pool = c->pool;
+	uint32_t idx;
+
+	__cursor_release(c);
+
+	if (__chunk_pop(pool, &idx))
+		return -1;
+
+	/* the owner reference */
+	atomic_store_release(&pool->chunks[idx].refs, 1);
+
+	c->chunk = idx + 1;
+	c->next = pool->start + ((uint64_t)idx << pool->chunkshift);
+	c->end = c->next + (1ULL << pool->chunkshift);
+
+	return 0;
+}
+
+void iova_pool_init(struct iova_pool *pool, uint64_t start, size_t len, int chunkshift)
+{
+	*pool = (struct iova_pool) {
+		.start = start,
+		.len = len,
+		.chunkshift = chunkshift,
+		.nchunks = (int)(len >> chunkshift),
+	};
+
+	if (pthread_key_create(&pool->key, __cursor_destroy))
+		backtrace_abort();
+
+	pool->chunks = znew_t(struct iova_pool_chunk, pool->nchunks);
+
+	/* push in reverse such that the first chunk is on top */
+	for (int i = pool->nchunks - 1; i >= 0; i--)
+		__chunk_push(pool, (uint32_t)i);
+}
+
+void iova_pool_destroy(struct iova_pool *pool)
+{
+	struct iova_pool_cursor *c = pthread_getspecific(pool->key);
+
+	if (c) {
+		__cursor_destroy(c);
+
+		if (pthread_setspecific(pool->key, NULL))
+			backtrace_abort();
+	}
+
+	pthread_key_delete(pool->key);
+
+	free(pool->chunks);
+
+	memset(pool, 0x0, sizeof(*pool));
+}
+
+int iova_pool_alloc(struct iova_pool *pool, size_t len, uint64_t *iova)
+{
+	struct iova_pool_cursor *c;
+
+	if (len > 1ULL << pool->chunkshift) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	c = __cursor_get(pool);
+
+	if (!c->chunk || c->end - c->next < len) {
+		if (__cursor_acquire(c)) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	atomic_inc(&pool->chunks[c->chunk - 1].refs);
+
+	*iova = c->next;
+	c->next += len;
+
+	return 0;
+}
+
+void iova_pool_put(struct iova_pool *pool, uint64_t iova)
+{
+	__chunk_put(pool, (uint32_t)((iova - pool->start) >> pool->chunkshift));
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define IOVA_NR_CLASSES 64
+
+/*
+ * IOVA allocator
+ *
+ * Free space is kept as ranges indexed by address (for coalescing on free)
+ * and segregated by size class (for allocation). A range in class k spans at
+ * least 2^k and less than 2^(k + 1) pages. Allocations are served from the
+ * first non-empty class in which every range is guaranteed to fit, falling
+ * back to a best effort scan of the class below.
+ *
+ * The allocator is not thread-safe.
+ */
+struct iova_allocator {
+	struct skiplist ranges;
+	struct list_head classes[IOVA_NR_CLASSES];
+
+	int pageshift;
+};
+
+void iova_allocator_init(struct iova_allocator *a, struct iommu_iova_range *ranges, int nranges,
+			 int pageshift);
+void iova_allocator_destroy(struct iova_allocator *a);
+
+/*
+ * Allocate len bytes (page aligned) of iova space aligned to align (a power of
+ * two no smaller than the page size). Returns 0 on success, or -1 and sets
+ * errno to ENOMEM if no free range fits.
+ */
+int iova_alloc(struct iova_allocator *a, size_t len, uint64_t align, uint64_t *iova);
+
+/*
+ * Allocate the specific range [iova, iova + len). Returns 0 on success, or -1
+ * and sets errno to EEXIST if any part of the range is not free.
+ */
+int iova_alloc_fixed(struct iova_allocator *a, uint64_t iova, size_t len);
+
+/*
+ * Return [iova, iova + len) to the allocator. Returns 0 on success, or -1 and
+ * sets errno to EINVAL if any part of the range is already free.
+ */
+int iova_free(struct iova_allocator *a, uint64_t iova, size_t len);
+
+/*
+ * Ephemeral IOVA pool
+ *
+ * A window of iova space split into fixed size chunks. Each thread carves
+ * allocations from a chunk of its own with a bump pointer, and a chunk is
+ * recycled once all allocations from it have been put and the thread has
+ * moved on to another chunk, so a long-lived allocation holds back only its
+ * own chunk. Free chunks are kept on a lock-free stack; the top of the stack
+ * is an index (plus one) into chunks in the lower 32 bits and a generation
+ * tag in the upper 32 bits, guarding against ABA.
+ *
+ * Each thread keeps a cursor per pool, so threads may alternate between pools
+ * without giving up their chunks. The pool is thread-safe and must outlive
+ * the threads allocating from it, except for the thread destroying it.
+ */
+struct iova_pool_chunk {
+	/* outstanding allocations, plus one while owned by a thread */
+	unsigned int refs;
+
+	/* index (plus one) of the next free chunk; zero terminates */
+	uint32_t next;
+};
+
+struct iova_pool {
+	uint64_t start;
+	size_t len;
+	int chunkshift;
+
+	int nchunks;
+	struct iova_pool_chunk *chunks;
+
+	uint64_t top;
+
+	/* per-thread cursor */
+	pthread_key_t key;
+};
+
+/*
+ * Initialize a pool covering [start, start + len) with chunks of 2^chunkshift
+ * bytes. A trailing partial chunk is not used.
+ */
+void iova_pool_init(struct iova_pool *pool, uint64_t start, size_t len, int chunkshift);
+void iova_pool_destroy(struct iova_pool *pool);
+
+static inline bool iova_pool_contains(struct iova_pool *pool, uint64_t iova)
+{
+	return iova >= pool->start && iova - pool->start < pool->len;
+}
+
+/*
+ * Allocate len bytes of iova space from the chunk owned by the calling
+ * thread. Returns 0 on success, or -1 and sets errno to E2BIG if len exceeds
+ * the chunk size, or to ENOMEM if no chunk is free.
+ */
+int iova_pool_alloc(struct iova_pool *pool, size_t len, uint64_t *iova);
+
+/* Put an allocation made by iova_pool_alloc() */
+void iova_pool_put(struct iova_pool *pool, uint64_t iova);
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "iova.c"
+
+static struct iova_allocator a;
+static struct iova_pool pool, pool2;
+
+static int nranges(void)
+{
+	struct skiplist_node *n;
+	int count = 0;
+
+	skiplist_for_each(&a.ranges, n, 0)
+		count++;
+
+	return count;
+}
+
+int main(void)
+{
+	struct iommu_iova_range ranges[] = {
+		{.start = 0x10000, .last = 0xfffff},
+		{.start = 0x200000, .last = 0x3fffff},
+	};
+	uint64_t iova, iova2;
+
+	plan_tests(27);
+
+	iova_allocator_init(&a, ranges, 2, 12);
+
+	ok1(nranges() == 2);
+
+	/* served from the smallest class that fits */
+	ok1(iova_alloc(&a, 0x1000, 0x1000, &iova) == 0 && iova == 0x10000);
+
+	/* aligned placement */
+	ok1(iova_alloc(&a, 0x10000, 0x10000, &iova2) == 0 && iova2 == 0x20000);
+	ok1(nranges() == 3);
+
+	/* freed space is coalesced */
+	ok1(iova_free(&a, iova, 0x1000) == 0);
+	ok1(iova_free(&a, iova2, 0x10000) == 0 && nranges() == 2);
+
+	/* and reused */
+	ok1(iova_alloc(&a, 0x1000, 0x1000, &iova2) == 0 && iova2 == iova);
+
+	/* double free */
+	ok1(iova_free(&a, iova2, 0x1000) == 0);
+	ok1(iova_free(&a, iova2, 0x2000) == -1 && errno == EINVAL);
+
+	/* exhaustion */
+	ok1(iova_alloc(&a, 0x400000, 0x1000, &iova) == -1 && errno == ENOMEM);
+
+	/* specific ranges */
+	ok1(iova_alloc_fixed(&a, 0x30000, 0x2000) == 0);
+	ok1(iova_alloc_fixed(&a, 0x31000, 0x1000) == -1 && errno == EEXIST);
+	ok1(iova_alloc_fixed(&a, 0xff000, 0x2000) == -1 && errno == EEXIST);
+	ok1(iova_free(&a, 0x30000, 0x2000) == 0);
+
+	/* an entire range */
+	ok1(iova_alloc(&a, 0x200000, 0x200000, &iova) == 0 && iova == 0x200000 &&
+	    nranges() == 1);
+
+	iova_allocator_destroy(&a);
+
+	/* four chunks of 0x4000 */
+	iova_pool_init(&pool, 0x100000, 0x10000, 14);
+
+	ok1(iova_pool_alloc(&pool, 0x8000, &iova) == -1 && errno == E2BIG);
+
+	/* bump allocated from the chunk owned by the thread */
+	ok1(iova_pool_alloc(&pool, 0x1000, &iova) == 0 && iova == 0x100000);
+	ok1(iova_pool_alloc(&pool, 0x3000, &iova2) == 0 && iova2 == 0x101000);
+
+	/* the first chunk is exhausted; moving on pins only that chunk */
+	ok1(iova_pool_alloc(&pool, 0x1000, &iova) == 0 && iova == 0x104000);
+
+	for (int i = 0; i < 2; i++)
+		ok1(iova_pool_alloc(&pool, 0x4000, &iova) == 0);
+
+	ok1(iova_pool_alloc(&pool, 0x4000, &iova) == -1 && errno == ENOMEM);
+
+	/* the first chunk is recycled once all of its allocations are put */
+	iova_pool_put(&pool, 0x100000);
+	iova_pool_put(&pool, 0x101000);
+
+	ok1(iova_pool_alloc(&pool, 0x4000, &iova) == 0 && iova == 0x100000);
+
+	iova_pool_destroy(&pool);
+
+	/* the thread keeps its chunk in each pool when alternating */
+	iova_pool_init(&pool, 0x100000, 0x10000, 14);
+	iova_pool_init(&pool2, 0x200000, 0x10000, 14);
+
+	ok1(iova_pool_alloc(&pool, 0x1000, &iova) == 0 && iova == 0x100000);
+	ok1(iova_pool_alloc(&pool2, 0x1000, &iova) == 0 && iova == 0x200000);
+	ok1(iova_pool_alloc(&pool, 0x1000, &iova) == 0 && iova == 0x101000);
+	ok1(iova_pool_alloc(&pool2, 0x1000, &iova) == 0 && iova == 0x201000);
+
+	iova_pool_destroy(&pool2);
+	iova_pool_destroy(&pool);
+
+	return exit_status();
+}
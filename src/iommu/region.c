@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/region: " fmt
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+/* sent along with the file descriptor */
+struct iommu_dma_region_msg {
+	uint64_t len;
+	uint64_t iova;
+};
+
+int iommu_dma_region_create(struct iommu_ctx *ctx, struct iommu_dma_region *region, size_t len,
+			    unsigned long flags)
+{
+	unsigned int mfd_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	struct stat sb;
+	int fd;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & IOMMU_DMA_REGION_HUGETLB)
+		mfd_flags |= MFD_HUGETLB;
+
+	fd = memfd_create("libvfn-dma", mfd_flags);
+	if (fd < 0) {
+		log_debug("failed to create memfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the block size is the huge page size on hugetlbfs */
+	if (fstat(fd, &sb)) {
+		log_debug("failed to stat memfd\n");
+		goto close_fd;
+	}
+
+	len = ALIGN_UP(len, max_t(size_t, (size_t)sb.st_blksize, __VFN_PAGESIZE));
+
+	if (ftruncate(fd, (off_t)len)) {
+		log_debug("failed to size memfd: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	/* importers must not be able to pull the pages from under the device */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+		log_debug("failed to seal memfd: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	region->vaddr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region->vaddr == MAP_FAILED) {
+		log_debug("failed to map memfd: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	if (iommu_map_vaddr(ctx, region->vaddr, len, &region->iova, 0x0)) {
+		log_debug("failed to map region\n");
+		goto unmap;
+	}
+
+	region->len = len;
+	region->fd = fd;
+
+	return 0;
+
+unmap:
+	log_fatal_if(munmap(region->vaddr, len), "munmap\n");
+close_fd:
+	log_fatal_if(close(fd), "close\n");
+
+	return -1;
+}
+
+void iommu_dma_region_destroy(struct iommu_ctx *ctx, struct iommu_dma_region *region)
+{
+	if (ctx)
+		log_fatal_if(iommu_unmap_vaddr(ctx, region->vaddr, NULL), "iommu_unmap_vaddr\n");
+
+	log_fatal_if(munmap(region->vaddr, region->len), "munmap\n");
+	log_fatal_if(close(region->fd), "close\n");
+
+	memset(region, 0x0, sizeof(*region));
+	region->fd = -1;
+}
+
+int iommu_dma_region_send(int sock, const struct iommu_dma_region *region)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = {};
+
+	struct iommu_dma_region_msg msg = {
+		.len = region->len,
+		.iova = region->iova,
+	};
+
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg),
+	};
+
+	struct msghdr hdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	ssize_t ret;
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+	memcpy(CMSG_DATA(cmsg), &region->fd, sizeof(int));
+
+	do {
+		ret = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		log_debug("failed to send region: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (ret != sizeof(msg)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+int iommu_dma_region_recv(int sock, struct iommu_dma_region *region)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = {};
+
+	struct iommu_dma_region_msg msg;
+
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg),
+	};
+
+	struct msghdr hdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg;
+	struct stat sb;
+	ssize_t ret;
+	int fd;
+
+	do {
+		ret = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		log_debug("failed to receive region: %s\n", strerror(errno));
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		log_debug("no file descriptor received\n");
+
+		errno = EPROTO;
+		return -1;
+	}
+
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (ret != sizeof(msg) || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		log_debug("short or truncated region message\n");
+
+		errno = EPROTO;
+		goto close_fd;
+	}
+
+	if (fstat(fd, &sb)) {
+		log_debug("failed to stat region fd\n");
+		goto close_fd;
+	}
+
+	if (!msg.len || (uint64_t)sb.st_size < msg.len) {
+		log_debug("region fd is smaller than the region\n");
+
+		errno = EINVAL;
+		goto close_fd;
+	}
+
+	region->vaddr = mmap(NULL, msg.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region->vaddr == MAP_FAILED) {
+		log_debug("failed to map region: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	region->len = msg.len;
+	region->iova = msg.iova;
+	region->fd = fd;
+
+	return 0;
+
+close_fd:
+	log_fatal_if(close(fd), "close\n");
+
+	return -1;
+}
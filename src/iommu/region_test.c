@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "region.c"
+
+#include "context.h"
+
+#include "test_ctx.h"
+
+static struct iommu_ctx ctx;
+
+int main(void)
+{
+	struct iommu_dma_region region, imported;
+	uint64_t iova;
+	int sv[2];
+
+	plan_tests(11);
+
+	test_ctx_init(&ctx);
+
+	ok1(iommu_dma_region_create(&ctx, &region, 0, 0x0) && errno == EINVAL);
+
+	ok1(!iommu_dma_region_create(&ctx, &region, 100, 0x0));
+	ok1(region.len == __VFN_PAGESIZE && region.iova == TEST_IOVA_BASE && nmaps == 1);
+	ok1(iommu_translate_vaddr(&ctx, region.vaddr + 8, &iova) && iova == region.iova + 8);
+
+	memset(region.vaddr, 0xab, region.len);
+
+	ok1(!socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv));
+	ok1(!iommu_dma_region_send(sv[0], &region));
+	ok1(!iommu_dma_region_recv(sv[1], &imported));
+
+	ok1(imported.len == region.len && imported.iova == region.iova &&
+	    imported.vaddr != region.vaddr);
+	ok1(((uint8_t *)imported.vaddr)[region.len - 1] == 0xab);
+
+	/* writes through either mapping are visible through the other */
+	((uint8_t *)imported.vaddr)[0] = 0x12;
+	ok1(((uint8_t *)region.vaddr)[0] == 0x12 &&
+	    iommu_dma_region_iova(&imported, imported.vaddr + 8) == iova);
+
+	iommu_dma_region_destroy(NULL, &imported);
+	iommu_dma_region_destroy(&ctx, &region);
+
+	ok1(nunmaps == 1 && region.fd == -1);
+
+	close(sv[0]);
+	close(sv[1]);
+
+	return exit_status();
+}
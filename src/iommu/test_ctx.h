@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Fake iommu backend for the iommu unit tests
+ *
+ * Include after the code under test and link with context.c. iovas are handed
+ * out in increasing order starting at TEST_IOVA_BASE; the map, unmap and copy
+ * operations only count their invocations. Setting @nfail makes that many
+ * subsequent dma_map calls fail with ENOSPC.
+ */
+
+#define TEST_IOVA_BASE 0x10000000
+
+static int nmaps, nunmaps, ncopies, nfail;
+static uint64_t next_iova = TEST_IOVA_BASE;
+
+static int fake_iova_reserve(struct iommu_ctx *ctx UNUSED, size_t len, uint64_t *iova,
+			     unsigned long flags UNUSED)
+{
+	*iova = next_iova;
+	next_iova += len;
+
+	return 0;
+}
+
+static int fake_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+			uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	if (nfail) {
+		nfail--;
+
+		errno = ENOSPC;
+		return -1;
+	}
+
+	nmaps++;
+
+	return 0;
+}
+
+static int fake_dma_copy(struct iommu_ctx *ctx UNUSED, struct iommu_ctx *src UNUSED,
+			 uint64_t iova UNUSED, size_t len UNUSED, unsigned long flags UNUSED)
+{
+	ncopies++;
+
+	return 0;
+}
+
+static int fake_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED, size_t len UNUSED)
+{
+	nunmaps++;
+
+	return 0;
+}
+
+static void test_ctx_init(struct iommu_ctx *ctx)
+{
+	iommu_ctx_init(ctx);
+
+	ctx->ops = (struct iommu_ctx_ops) {
+		.iova_reserve = fake_iova_reserve,
+		.dma_map = fake_dma_map,
+		.dma_copy = fake_dma_copy,
+		.dma_unmap = fake_dma_unmap,
+	};
+}
+
+/* context.c refers to the backends; the tests never use them */
+struct iommu_ctx *vfio_get_default_iommu_context(void)
+{
+	return NULL;
+}
+
+struct iommu_ctx *vfio_get_iommu_context(const char *name UNUSED)
+{
+	return NULL;
+}
+
+#ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
+struct iommu_ctx *iommufd_get_default_iommu_context(void)
+{
+	return NULL;
+}
+
+struct iommu_ctx *iommufd_get_iommu_context(const char *name UNUSED)
+{
+	return NULL;
+}
+#endif
@@ -31,6 +31,7 @@
 
 #include "ccan/str/str.h"
 #include "ccan/compiler/compiler.h"
+#include "ccan/list/list.h"
 #include "ccan/minmax/minmax.h"
 
 #include <linux/types.h>
@@ -41,15 +42,24 @@
 #include "vfn/trace.h"
 #include "vfn/pci/util.h"
 
+#include "util/strmap.h"
+
 #include "context.h"
+#include "iova.h"
+
+/* ephemeral iovas are handed out to threads in chunks of 16 pages */
+#define VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNKSHIFT (__VFN_PAGESHIFT + 4)
 
-#define VFIO_IOMMU_TYPE1_IOVA_RESERVED 0x10000
+/* largest alignment used when placing mappings */
+#define VFIO_IOMMU_TYPE1_IOVA_MAX_ALIGN (1ULL << 30)
 
 struct vfio_group {
 	int fd;
 	struct vfio_container *container;
 
 	char *path;
+
+	struct strmap_node node;
 };
 
 struct vfio_container {
@@ -58,12 +68,14 @@ struct vfio_container {
 
 	int fd;
 
-#define VFN_MAX_VFIO_GROUPS 64
-	struct vfio_group groups[VFN_MAX_VFIO_GROUPS];
+	/* groups added to the container, keyed by path; see vfio_get_group_fd() */
+	pthread_mutex_t group_lock;
+	struct strmap groups;
 
 	pthread_mutex_t lock;
-	uint64_t next, next_ephemeral, nephemerals;
-	struct iommu_iova_range ephemerals;
+	struct iova_allocator iovas;
+
+	struct iova_pool ephemerals;
 
 	bool iommu_set;
 };
@@ -107,13 +119,17 @@ static void vfio_iommu_type1_get_cap_iova_ranges(struct iommu_ctx *ctx,
 # endif
 
 # ifdef VFIO_IOMMU_TYPE1_INFO_CAP_DMA_AVAIL
-static void vfio_iommu_type1_get_cap_dma_avail(struct vfio_info_cap_header *cap)
+static void vfio_iommu_type1_get_cap_dma_avail(struct iommu_ctx *ctx,
+					       struct vfio_info_cap_header *cap)
 {
 	struct vfio_iommu_type1_info_dma_avail *dma;
 
 	dma = (struct vfio_iommu_type1_info_dma_avail *)cap;
 
 	log_info("dma avail %"PRIu32"\n", dma->avail);
+
+	/* queried before any mappings are created; this is the limit */
+	ctx->dma_avail = dma->avail;
 }
 # endif
 
@@ -171,7 +187,7 @@ static int vfio_iommu_type1_get_capabilities(struct vfio_container *vfio)
 # endif
 # ifdef VFIO_IOMMU_TYPE1_INFO_CAP_DMA_AVAIL
 		case VFIO_IOMMU_TYPE1_INFO_CAP_DMA_AVAIL:
-			vfio_iommu_type1_get_cap_dma_avail(cap);
+			vfio_iommu_type1_get_cap_dma_avail(&vfio->ctx, cap);
 			break;
 # endif
 		default:
@@ -188,37 +204,23 @@ static int vfio_iommu_type1_get_capabilities(struct vfio_container *vfio)
 }
 #endif /* VFIO_IOMMU_INFO_CAPS */
 
-static bool __iova_reserve(struct iommu_iova_range *ranges, int nranges, uint64_t *next,
-			   size_t len, uint64_t *iova)
+/*
+ * Place mappings on the largest power of two boundary not exceeding their
+ * length (up to 1G), such that the IOMMU may use large pages if the virtual
+ * address is aligned as well.
+ */
+static inline uint64_t vfio_iommu_type1_iova_align(size_t len)
 {
-	uint64_t _next = *next;
-
-	for (int i = 0; i < nranges; i++) {
-		struct iommu_iova_range *r = &ranges[i];
+	uint64_t align = 1ULL << (63 - __builtin_clzll(len));
 
-		if (r->last < _next)
-			continue;
-
-		_next = max_t(uint64_t, _next, r->start);
-
-		if (_next > r->last || r->last - _next + 1 < len)
-			continue;
-
-		*iova = _next;
-		*next = _next + len;
-
-		return true;
-	}
-
-	return false;
+	return min_t(uint64_t, align, VFIO_IOMMU_TYPE1_IOVA_MAX_ALIGN);
 }
 
 static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, uint64_t *iova,
 					 unsigned long flags)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
-
-	__autolock(&vfio->lock);
+	int ret;
 
 	if (!ALIGNED(len, __VFN_PAGESIZE)) {
 		log_debug("len is not page aligned\n");
@@ -226,26 +228,49 @@ static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, uint
 		return -1;
 	}
 
-	if (flags & IOMMU_MAP_EPHEMERAL) {
-		if (!__iova_reserve(&vfio->ephemerals, 1, &vfio->next_ephemeral, len, iova))
-			goto enomem;
+	/*
+	 * Lock-free from the chunk owned by the thread; if the mapping is
+	 * larger than a chunk or all chunks are in use, fall back to the
+	 * general allocator.
+	 */
+	if (flags & IOMMU_MAP_EPHEMERAL && !iova_pool_alloc(&vfio->ephemerals, len, iova))
+		return 0;
 
-		atomic_inc(&vfio->nephemerals);
+	pthread_mutex_lock(&vfio->lock);
+	ret = iova_alloc(&vfio->iovas, len, vfio_iommu_type1_iova_align(len), iova);
+	pthread_mutex_unlock(&vfio->lock);
 
-		return 0;
+	if (ret) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	if (__iova_reserve(ctx->iova_ranges, ctx->nranges, &vfio->next, len, iova))
-		return 0;
+	return 0;
+}
 
-enomem:
-	errno = ENOMEM;
-	return -1;
+static void vfio_iommu_type1_iova_release(struct iommu_ctx *ctx, uint64_t iova, size_t len)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+
+	__autolock(&vfio->lock);
+
+	if (iova_free(&vfio->iovas, iova, len))
+		log_debug("failed to release iova 0x%" PRIx64 " len %zu\n", iova, len);
+}
+
+static int vfio_iommu_type1_iova_reserve_fixed(struct iommu_ctx *ctx, uint64_t iova, size_t len)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+
+	__autolock(&vfio->lock);
+
+	return iova_alloc_fixed(&vfio->iovas, iova, len);
 }
 
 static int vfio_iommu_type1_init(struct vfio_container *vfio)
 {
 	uint64_t iova;
+	size_t len;
 
 	if (vfio->iommu_set)
 		return 0;
@@ -264,22 +289,22 @@ static int vfio_iommu_type1_init(struct vfio_container *vfio)
 	}
 #endif
 
-	if (vfio_iommu_type1_iova_reserve(&vfio->ctx, VFIO_IOMMU_TYPE1_IOVA_RESERVED, &iova, 0x0)) {
+	iova_allocator_init(&vfio->iovas, vfio->ctx.iova_ranges, vfio->ctx.nranges,
+			    __VFN_PAGESHIFT);
+
+	len = ALIGN_DOWN(max_t(size_t, VFIO_EPHEMERAL_IOVA_SIZE,
+			       1ULL << VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNKSHIFT),
+			 1ULL << VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNKSHIFT);
+
+	if (vfio_iommu_type1_iova_reserve(&vfio->ctx, len, &iova, 0x0)) {
 		log_debug("could not reserve iova range\n");
 		return -1;
 	}
 
-	vfio->ephemerals.start = iova;
-	vfio->ephemerals.last = iova + VFIO_IOMMU_TYPE1_IOVA_RESERVED - 1;
-
-	if (logv(LOG_INFO)) {
-		__autofree char *str;
-
-		log_fatal_if(iommu_iova_range_to_string(&vfio->ephemerals, &str) < 0,
-			     "iommu_iova_range_to_string\n");
+	iova_pool_init(&vfio->ephemerals, iova, len, VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNKSHIFT);
 
-		log_info("reserved 64k for ephemerals %s\n", str);
-	}
+	log_info("reserved %zu bytes for ephemerals [0x%" PRIx64 "; 0x%" PRIx64 "]\n",
+		 len, iova, iova + len - 1);
 
 	return 0;
 }
@@ -339,31 +364,20 @@ close_fd:
 
 static int vfio_get_group_fd(struct vfio_container *vfio, const char *path)
 {
-	struct vfio_group *group;
-	int i;
+	__autolock(&vfio->group_lock);
 
-	for (i = 0; i < VFN_MAX_VFIO_GROUPS; i++) {
-		group = &vfio->groups[i];
+	struct strmap_node *n;
+	struct vfio_group *group;
 
-		if (group->path && streq(group->path, path))
-			return group->fd;
-	}
+	n = strmap_find(&vfio->groups, path);
+	if (n)
+		return strmap_entry(n, struct vfio_group, node)->fd;
 
-	for (i = 0; i < VFN_MAX_VFIO_GROUPS; i++) {
-		group = &vfio->groups[i];
-
-		if (!group->path)
-			break;
-	}
-
-	if (i == VFN_MAX_VFIO_GROUPS) {
-		errno = EMFILE;
-		return -1;
-	}
+	group = znew_t(struct vfio_group, 1);
 
 	group->path = strdup(path);
 	if (!group->path)
-		return -1;
+		goto free_group;
 
 	group->fd = vfio_group_open(group->path);
 	if (group->fd < 0) {
@@ -376,10 +390,16 @@ static int vfio_get_group_fd(struct vfio_container *vfio, const char *path)
 		goto free_group_path;
 	}
 
+	group->container = vfio;
+
+	strmap_add(&vfio->groups, &group->node, group->path);
+
 	return group->fd;
 
 free_group_path:
 	free(group->path);
+free_group:
+	free(group);
 
 	return -1;
 }
@@ -471,24 +491,21 @@ static int vfio_iommu_type1_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, s
 	return 0;
 }
 
-static void vfio_iommu_type1_recycle_ephemeral_iovas(struct vfio_container *vfio)
+static void vfio_iommu_type1_iova_put_ephemeral(struct iommu_ctx *ctx, uint64_t iova, size_t len)
 {
-	__autolock(&vfio->lock);
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
 
-	trace_guard(VFIO_IOMMU_TYPE1_RECYCLE_EPHEMERAL_IOVAS) {
-		trace_emit("recycling ephemeral range (0x%" PRIx64 " -> 0x%llx)\n",
-			   vfio->next_ephemeral, vfio->ephemerals.start);
+	/* fallback allocations are returned to the general allocator */
+	if (!iova_pool_contains(&vfio->ephemerals, iova)) {
+		vfio_iommu_type1_iova_release(ctx, iova, len);
+		return;
 	}
 
-	vfio->next_ephemeral = vfio->ephemerals.start;
-}
-
-static void vfio_iommu_type1_iova_put_ephemeral(struct iommu_ctx *ctx)
-{
-	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	trace_guard(VFIO_IOMMU_TYPE1_PUT_EPHEMERAL_IOVA) {
+		trace_emit("iova 0x%" PRIx64 " len %zu\n", iova, len);
+	}
 
-	if (atomic_dec_fetch(&vfio->nephemerals) == 0)
-		vfio_iommu_type1_recycle_ephemeral_iovas(vfio);
+	iova_pool_put(&vfio->ephemerals, iova);
 }
 
 #ifdef VFIO_UNMAP_ALL
@@ -515,6 +532,8 @@ static const struct iommu_ctx_ops vfio_ops = {
 
 	.iova_reserve = vfio_iommu_type1_iova_reserve,
 	.iova_put_ephemeral = vfio_iommu_type1_iova_put_ephemeral,
+	.iova_release = vfio_iommu_type1_iova_release,
+	.iova_reserve_fixed = vfio_iommu_type1_iova_reserve_fixed,
 
 	.dma_map = vfio_iommu_type1_do_dma_map,
 	.dma_unmap = vfio_iommu_type1_do_dma_unmap,
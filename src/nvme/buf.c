@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/buf: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "prp.h"
+
+/*
+ * The list is laid out such that the entry for data page i is found at index
+ * (i % nprps) in list page (i / nprps). If the buffer requires more than one
+ * list page, the last entry of each page points to the next list page, so a
+ * transfer can start anywhere in the list and the controller will follow the
+ * chain.
+ */
+static void __buf_build_prplist(struct nvme_buf *buf, int npages)
+{
+	int pageshift = buf->pageshift;
+	int max_prps = 1 << (pageshift - 3);
+	int nlists = (npages + buf->nprps - 1) / buf->nprps;
+
+	for (int i = 0; i < nlists; i++) {
+		leint64_t *entries = buf->prplist.vaddr + ((size_t)i << pageshift);
+		int first = i * buf->nprps;
+		int n = min_t(int, buf->nprps, npages - first);
+
+		__prp_fill(entries, n, buf->iova + ((uint64_t)first << pageshift), pageshift);
+
+		if (i < nlists - 1)
+			entries[max_prps - 1] = cpu_to_le64(buf->prplist.iova +
+							    ((uint64_t)(i + 1) << pageshift));
+	}
+}
+
+int nvme_buf_register(struct nvme_ctrl *ctrl, struct nvme_buf *buf, void *vaddr, size_t len)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	int max_prps = 1 << (pageshift - 3);
+	int npages, nlists;
+	ssize_t ret;
+
+	if (!len || !ALIGNED((uintptr_t)vaddr, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((ALIGN_UP(len, 1ULL << pageshift) >> pageshift) > INT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	npages = (int)(ALIGN_UP(len, 1ULL << pageshift) >> pageshift);
+
+	*buf = (struct nvme_buf) {
+		.vaddr = vaddr,
+		.len = len,
+		.pageshift = pageshift,
+
+		/* reserve the last entry for chaining if more than one page is needed */
+		.nprps = npages > max_prps ? max_prps - 1 : max_prps,
+	};
+
+	nlists = (npages + buf->nprps - 1) / buf->nprps;
+
+	if (!iommu_translate_vaddr(ctx, vaddr, &buf->iova)) {
+		if (iommu_map_vaddr(ctx, vaddr, len, &buf->iova, 0x0)) {
+			log_debug("failed to map vaddr\n");
+			return -1;
+		}
+
+		buf->do_unmap = true;
+	} else {
+		uint64_t last;
+
+		/* the existing mapping must cover the entire buffer */
+		if (!iommu_translate_vaddr(ctx, vaddr + len - 1, &last) ||
+		    last != buf->iova + len - 1) {
+			log_debug("buffer is only partially mapped\n");
+
+			memset(buf, 0x0, sizeof(*buf));
+
+			errno = EEXIST;
+			return -1;
+		}
+	}
+
+	ret = pgmapn(&buf->prplist.vaddr, nlists, 1 << pageshift);
+	if (ret < 0)
+		goto unmap_buf;
+
+	buf->prplist.len = (size_t)ret;
+
+	if (iommu_map_vaddr(ctx, buf->prplist.vaddr, buf->prplist.len, &buf->prplist.iova, 0x0)) {
+		log_debug("failed to map prp list\n");
+		goto unmap_prplist;
+	}
+
+	__buf_build_prplist(buf, npages);
+
+	return 0;
+
+unmap_prplist:
+	pgunmap(buf->prplist.vaddr, buf->prplist.len);
+unmap_buf:
+	if (buf->do_unmap)
+		log_fatal_if(iommu_unmap_vaddr(ctx, vaddr, NULL), "iommu_unmap_vaddr\n");
+
+	memset(buf, 0x0, sizeof(*buf));
+
+	return -1;
+}
+
+void nvme_buf_unregister(struct nvme_ctrl *ctrl, struct nvme_buf *buf)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+	if (!buf->prplist.vaddr)
+		return;
+
+	if (iommu_unmap_vaddr(ctx, buf->prplist.vaddr, NULL))
+		log_debug("failed to unmap prp list\n");
+
+	pgunmap(buf->prplist.vaddr, buf->prplist.len);
+
+	if (buf->do_unmap && iommu_unmap_vaddr(ctx, buf->vaddr, NULL))
+		log_debug("failed to unmap vaddr\n");
+
+	memset(buf, 0x0, sizeof(*buf));
+}
@@ -157,6 +157,7 @@ static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		.qsize = qsize,
 		.doorbell = sqtdbl(ctrl->doorbells, qid, dstrd),
 		.cq = cq,
+		.prp_pool = ctrl->prp_pool.pages ? &ctrl->prp_pool : NULL,
 	};
 
 	if (ctrl->dbbuf.doorbells) {
@@ -164,20 +165,6 @@ static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs, qid, dstrd);
 	}
 
-	/*
-	 * Use ctrl->config.mps instead of host page size, as we have the
-	 * opportunity to pack the allocations.
-	 */
-	len = pgmapn(&sq->pages.vaddr, qsize, __mps_to_pagesize(ctrl->config.mps));
-
-	if (len < 0)
-		return -1;
-
-	if (iommu_map_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, len, &sq->pages.iova, 0x0)) {
-		log_debug("failed to map vaddr\n");
-		goto unmap_pages;
-	}
-
 	sq->rqs = znew_t(struct nvme_rq, qsize - 1);
 	sq->rq_top = &sq->rqs[qsize - 2];
 
@@ -187,9 +174,6 @@ static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		rq->sq = sq;
 		rq->cid = (uint16_t)i;
 
-		rq->page.vaddr = sq->pages.vaddr + (i << __mps_to_pageshift(ctrl->config.mps));
-		rq->page.iova = sq->pages.iova + (i << __mps_to_pageshift(ctrl->config.mps));
-
 		if (i > 0)
 			rq->rq_next = &sq->rqs[i - 1];
 	}
@@ -209,11 +193,6 @@ unmap_sq:
 	pgunmap(sq->vaddr, len);
 free_sq_rqs:
 	free(sq->rqs);
-unmap_pages:
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, (size_t *)&len))
-		log_debug("failed to unmap vaddr\n");
-
-	pgunmap(sq->pages.vaddr, len);
 
 	return -1;
 }
@@ -232,10 +211,12 @@ static void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 
 	free(sq->rqs);
 
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, &len))
-		log_debug("failed to unmap vaddr\n");
+	if (sq->meta.vaddr) {
+		if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->meta.vaddr, NULL))
+			log_debug("failed to unmap vaddr\n");
 
-	pgunmap(sq->pages.vaddr, len);
+		pgunmap(sq->meta.vaddr, sq->meta.len);
+	}
 
 	if (ctrl->dbbuf.doorbells) {
 		__STORE_PTR(uint32_t *, sq->dbbuf.doorbell, 0);
@@ -245,6 +226,99 @@ static void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 	memset(sq, 0x0, sizeof(*sq));
 }
 
+int nvme_sq_alloc_meta(struct nvme_ctrl *ctrl, struct nvme_sq *sq, size_t size)
+{
+	ssize_t len;
+
+	if (!size || !sq->rqs || sq->meta.vaddr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the metadata pointer must be dword aligned */
+	size = ALIGN_UP(size, sizeof(uint32_t));
+
+	len = pgmap(&sq->meta.vaddr, (size_t)(sq->qsize - 1) * size);
+	if (len < 0)
+		return -1;
+
+	if (iommu_map_vaddr(__iommu_ctx(ctrl), sq->meta.vaddr, len, &sq->meta.iova, 0x0)) {
+		log_debug("failed to map vaddr\n");
+
+		pgunmap(sq->meta.vaddr, len);
+		sq->meta.vaddr = NULL;
+
+		return -1;
+	}
+
+	sq->meta.len = len;
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		rq->meta.vaddr = sq->meta.vaddr + i * size;
+		rq->meta.iova = sq->meta.iova + i * size;
+	}
+
+	return 0;
+}
+
+static int nvme_init_prp_pool(struct nvme_ctrl *ctrl, int npages)
+{
+	struct nvme_prp_pool *pool = &ctrl->prp_pool;
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	ssize_t len;
+
+	if (!npages)
+		return 0;
+
+	len = pgmapn(&pool->vaddr, npages, 1 << pageshift);
+	if (len < 0)
+		return -1;
+
+	if (iommu_map_vaddr(__iommu_ctx(ctrl), pool->vaddr, len, &pool->iova, 0x0)) {
+		log_debug("failed to map vaddr\n");
+
+		pgunmap(pool->vaddr, len);
+		return -1;
+	}
+
+	pool->len = len;
+	pool->npages = npages;
+	pool->pages = znew_t(struct nvme_prp_page, npages);
+
+	for (int i = 0; i < npages; i++) {
+		struct nvme_prp_page *page = &pool->pages[i];
+
+		page->vaddr = pool->vaddr + ((size_t)i << pageshift);
+		page->iova = pool->iova + ((uint64_t)i << pageshift);
+
+		/* link to the previous page (index plus one) */
+		page->next = (uint32_t)i;
+	}
+
+	pool->top = (uint64_t)npages;
+
+	return 0;
+}
+
+static void nvme_discard_prp_pool(struct nvme_ctrl *ctrl)
+{
+	struct nvme_prp_pool *pool = &ctrl->prp_pool;
+
+	if (!pool->vaddr)
+		return;
+
+	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), pool->vaddr, NULL))
+		log_debug("failed to unmap vaddr\n");
+
+	pgunmap(pool->vaddr, pool->len);
+
+	free(pool->pages);
+
+	memset(pool, 0x0, sizeof(*pool));
+}
+
 static int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags)
 {
 	int aqa;
@@ -284,6 +358,45 @@ static int __admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe)
 	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, NULL, 0, NULL);
 }
 
+/* take a reference on vector; allocate the least used one if NVME_CQ_VECTOR_ALLOC */
+static int nvme_get_vector(struct nvme_ctrl *ctrl, int vector)
+{
+	int nvec = (int)ctrl->pci.dev.irq_info.count;
+
+	if (!ctrl->vectors) {
+		/* vector zero is used by the admin queue */
+		ctrl->vectors = znew_t(int, nvec);
+		ctrl->vectors[0] = 1;
+	}
+
+	if (vector == NVME_CQ_VECTOR_ALLOC) {
+		for (int i = 0; i < nvec; i++) {
+			if (vector < 0 || ctrl->vectors[i] < ctrl->vectors[vector])
+				vector = i;
+		}
+
+		/* share a vector only if all are in use */
+		if (ctrl->vectors[vector])
+			log_info("sharing vector %d\n", vector);
+	} else if (vector < 0 || vector >= nvec) {
+		log_debug("vector %d invalid; device has %d vectors\n", vector, nvec);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctrl->vectors[vector]++;
+
+	return vector;
+}
+
+static void nvme_put_vector(struct nvme_ctrl *ctrl, int vector)
+{
+	if (!--ctrl->vectors[vector] &&
+	    vfio_set_irq_vector(&ctrl->pci.dev, vector, -1))
+		log_debug("could not disable vector %d\n", vector);
+}
+
 int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 {
 	struct nvme_cq *cq = &ctrl->cq[qid];
@@ -292,16 +405,20 @@ int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 	uint16_t qflags = NVME_Q_PC;
 	uint16_t iv = 0;
 
-	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
-		log_debug("could not configure io completion queue\n");
-		return -1;
-	}
-
 	if (vector != -1) {
+		vector = nvme_get_vector(ctrl, vector);
+		if (vector < 0)
+			return -1;
+
 		qflags |= NVME_CQ_IEN;
 		iv = (uint16_t)vector;
 	}
 
+	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
+		log_debug("could not configure io completion queue\n");
+		goto put_vector;
+	}
+
 	cmd.create_cq = (struct nvme_cmd_create_cq) {
 		.opcode = NVME_ADMIN_CREATE_CQ,
 		.prp1   = cpu_to_le64(cq->iova),
@@ -311,21 +428,50 @@ int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 		.iv     = cpu_to_le16(iv),
 	};
 
-	return __admin(ctrl, &cmd);
+	if (__admin(ctrl, &cmd)) {
+		nvme_discard_cq(ctrl, cq);
+		goto put_vector;
+	}
+
+	return 0;
+
+put_vector:
+	if (vector != -1)
+		nvme_put_vector(ctrl, vector);
+
+	return -1;
+}
+
+int nvme_cq_set_eventfd(struct nvme_ctrl *ctrl, struct nvme_cq *cq, int eventfd)
+{
+	if (cq->vector < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return vfio_set_irq_vector(&ctrl->pci.dev, cq->vector, eventfd);
 }
 
 int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid)
 {
+	struct nvme_cq *cq = &ctrl->cq[qid];
+	int vector = cq->vaddr ? cq->vector : -1;
 	union nvme_cmd cmd;
 
-	nvme_discard_cq(ctrl, &ctrl->cq[qid]);
+	nvme_discard_cq(ctrl, cq);
 
 	cmd.delete_q = (struct nvme_cmd_delete_q) {
 		.opcode = NVME_ADMIN_DELETE_CQ,
 		.qid = cpu_to_le16((uint16_t)qid),
 	};
 
-	return __admin(ctrl, &cmd);
+	if (__admin(ctrl, &cmd))
+		return -1;
+
+	if (vector != -1)
+		nvme_put_vector(ctrl, vector);
+
+	return 0;
 }
 
 int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
@@ -502,11 +648,491 @@ static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
 	return 0;
 }
 
+#define NVME_HMB_CHUNK_SIZE (2ULL << 20)
+
+#ifndef MAP_HUGE_2MB
+# define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+/* prefer (2M) huge pages to relieve the iotlb of the device */
+static void *nvme_hmb_alloc_chunk(size_t len)
+{
+	void *mem;
+
+	if (ALIGNED(len, NVME_HMB_CHUNK_SIZE)) {
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (mem != MAP_FAILED)
+			return mem;
+
+		log_info("could not allocate huge pages for the hmb; using regular pages\n");
+	}
+
+	if (pgmap(&mem, len) < 0)
+		return NULL;
+
+	return mem;
+}
+
+static int nvme_hmb_set(struct nvme_ctrl *ctrl, bool enable, uint64_t iova)
+{
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	union nvme_cmd cmd;
+
+	cmd = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmd.features.fid = NVME_FEAT_FID_HOST_MEM_BUF;
+
+	if (enable) {
+		cmd.features.cdw11 = cpu_to_le32(NVME_FEAT_HMB_EHM);
+		cmd.features.cdw12 = cpu_to_le32((uint32_t)(ctrl->hmb.size >> pageshift));
+		cmd.features.cdw13 = cpu_to_le32((uint32_t)iova);
+		cmd.features.cdw14 = cpu_to_le32((uint32_t)(iova >> 32));
+		cmd.features.cdw15 = cpu_to_le32((uint32_t)ctrl->hmb.nchunks);
+	}
+
+	return __admin(ctrl, &cmd);
+}
+
+static void nvme_discard_hmb(struct nvme_ctrl *ctrl)
+{
+	uint32_t csts;
+
+	if (!ctrl->hmb.chunks)
+		return;
+
+	csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
+
+	/*
+	 * The controller owns the buffer until told otherwise; unless it is
+	 * disabled or has failed, in which case the command would never
+	 * complete (and the buffer is no longer in use).
+	 */
+	if (ctrl->hmb.size && NVME_FIELD_GET(csts, CSTS_RDY) && !NVME_FIELD_GET(csts, CSTS_CFS) &&
+	    nvme_hmb_set(ctrl, false, 0x0))
+		log_error("could not disable host memory buffer\n");
+
+	for (int i = 0; i < ctrl->hmb.nchunks; i++) {
+		if (iommu_unmap_vaddr(__iommu_ctx(ctrl), ctrl->hmb.chunks[i], NULL))
+			log_debug("failed to unmap vaddr\n");
+
+		log_fatal_if(munmap(ctrl->hmb.chunks[i], ctrl->hmb.chunk_size), "munmap\n");
+	}
+
+	if (ctrl->hmb.descs) {
+		if (iommu_unmap_vaddr(__iommu_ctx(ctrl), ctrl->hmb.descs, NULL))
+			log_debug("failed to unmap vaddr\n");
+
+		pgunmap(ctrl->hmb.descs, ctrl->hmb.descs_len);
+	}
+
+	free(ctrl->hmb.chunks);
+
+	memset(&ctrl->hmb, 0x0, sizeof(ctrl->hmb));
+}
+
+static int nvme_init_hmb(struct nvme_ctrl *ctrl, void *id)
+{
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	uint64_t pref, min, minds, iova;
+	struct nvme_hmb_desc *desc;
+	size_t size, chunk_size;
+	uint16_t maxd;
+	int nchunks;
+
+	/* all reported in units of 4 KiB */
+	pref = (uint64_t)le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMPRE)) << 12;
+	min = (uint64_t)le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMIN)) << 12;
+	minds = (uint64_t)le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMINDS)) << 12;
+	maxd = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_CTRL_HMMAXD));
+
+	if (!pref)
+		return 0;
+
+	size = min_t(uint64_t, pref, (uint64_t)NVME_HMB_MAX_SIZE << 20);
+	size = ALIGN_DOWN(size, (size_t)1 << pageshift);
+
+	if (!size || size < min) {
+		log_info("not providing a host memory buffer (min %" PRIu64 " bytes)\n", min);
+		return 0;
+	}
+
+	chunk_size = max_t(size_t, NVME_HMB_CHUNK_SIZE, ALIGN_UP(minds, __VFN_PAGESIZE));
+	chunk_size = min_t(size_t, chunk_size, size);
+
+	/* fewer, larger descriptors if the controller limits the count */
+	while (maxd && size / chunk_size > maxd)
+		chunk_size <<= 1;
+
+	nchunks = (int)(size / chunk_size);
+	size = nchunks * chunk_size;
+
+	if (!nchunks || size < min || chunk_size < minds ||
+	    !ALIGNED(chunk_size, (size_t)1 << pageshift)) {
+		log_info("cannot satisfy host memory buffer constraints\n");
+		return 0;
+	}
+
+	ctrl->hmb.chunks = znew_t(void *, nchunks);
+	ctrl->hmb.chunk_size = chunk_size;
+
+	ctrl->hmb.descs_len = pgmapn(&ctrl->hmb.descs, nchunks, sizeof(struct nvme_hmb_desc));
+	if (ctrl->hmb.descs_len < 0) {
+		ctrl->hmb.descs = NULL;
+		goto discard;
+	}
+
+	desc = ctrl->hmb.descs;
+
+	for (int i = 0; i < nchunks; i++) {
+		ctrl->hmb.chunks[i] = nvme_hmb_alloc_chunk(chunk_size);
+		if (!ctrl->hmb.chunks[i]) {
+			log_debug("could not allocate hmb chunk\n");
+			goto discard;
+		}
+
+		ctrl->hmb.nchunks++;
+
+		if (iommu_map_vaddr(__iommu_ctx(ctrl), ctrl->hmb.chunks[i], chunk_size, &iova, 0x0)) {
+			log_debug("could not map hmb chunk\n");
+			goto discard;
+		}
+
+		desc[i].badd = cpu_to_le64(iova);
+		desc[i].bsize = cpu_to_le32((uint32_t)(chunk_size >> pageshift));
+	}
+
+	if (iommu_map_vaddr(__iommu_ctx(ctrl), ctrl->hmb.descs, ctrl->hmb.descs_len, &iova, 0x0)) {
+		log_debug("could not map hmb descriptor list\n");
+		goto discard;
+	}
+
+	ctrl->hmb.size = size;
+
+	if (nvme_hmb_set(ctrl, true, iova)) {
+		log_debug("could not enable host memory buffer\n");
+
+		ctrl->hmb.size = 0;
+		goto discard;
+	}
+
+	log_info("host memory buffer is %zu bytes in %d chunks\n", size, nchunks);
+
+	return 0;
+
+discard:
+	nvme_discard_hmb(ctrl);
+
+	return -1;
+}
+
+/* address of the cmb in the pci address space (as set up by the host) */
+static int nvme_cmb_bar_address(struct nvme_ctrl *ctrl, int bir, uint64_t *addr)
+{
+	uint32_t lo, hi = 0;
+
+	if (vfio_pci_read_config(&ctrl->pci, &lo, sizeof(lo), PCI_BASE_ADDRESS_0 + 4 * bir) < 0)
+		return -1;
+
+	if ((lo & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 &&
+	    vfio_pci_read_config(&ctrl->pci, &hi, sizeof(hi), PCI_BASE_ADDRESS_0 + 4 * (bir + 1)) < 0)
+		return -1;
+
+	*addr = ((uint64_t)le32_to_cpu(hi) << 32) | (le32_to_cpu(lo) & PCI_BASE_ADDRESS_MEM_MASK);
+
+	return 0;
+}
+
+int nvme_cmb_map(struct nvme_ctrl *ctrl, struct iommu_ctx *ctx, uint64_t *iova)
+{
+	struct iommu_iova_range *ranges;
+	uint64_t cap, szu, ofst, cba;
+	uint32_t cmbloc, cmbsz;
+	size_t len;
+	void *vaddr;
+	int bir, nranges;
+
+	if (ctrl->cmb.vaddr) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+
+	/* the cmb registers read as zero unless enabled */
+	if (NVME_FIELD_GET(cap, CAP_CMBS))
+		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(NVME_CMBMSC_CRE));
+
+	cmbsz = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBSZ));
+	if (!cmbsz) {
+		log_debug("controller has no cmb\n");
+
+		errno = ENODEV;
+		return -1;
+	}
+
+	cmbloc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBLOC));
+
+	szu = 1ULL << (12 + 4 * NVME_FIELD_GET(cmbsz, CMBSZ_SZU));
+	len = szu * NVME_FIELD_GET(cmbsz, CMBSZ_SZ);
+	ofst = szu * NVME_FIELD_GET(cmbloc, CMBLOC_OFST);
+	bir = NVME_FIELD_GET(cmbloc, CMBLOC_BIR);
+
+	log_info("cmb is %zu bytes at offset 0x%" PRIx64 " in bar %d\n", len, ofst, bir);
+
+	vaddr = iommu_map_bar(ctx, &ctrl->pci, bir, ofst, len, iova);
+	if (!vaddr) {
+		log_debug("could not map cmb\n");
+		return -1;
+	}
+
+	if (!NVME_FIELD_GET(cap, CAP_CMBS)) {
+		/* the controller identifies the cmb by its pci address */
+		if (nvme_cmb_bar_address(ctrl, bir, &cba)) {
+			log_debug("could not read cmb bar address\n");
+			goto unmap;
+		}
+
+		cba += ofst;
+	} else if (ctx == __iommu_ctx(ctrl)) {
+		/* the iova is reserved in the context of the controller; reuse it */
+		cba = *iova;
+	} else {
+		/* choose an address that is guaranteed not to be involved in dma */
+		nranges = iommu_get_iova_ranges(__iommu_ctx(ctrl), &ranges);
+		if (nranges < 1 || ranges[nranges - 1].last >= UINT64_MAX - len - 0xfff) {
+			log_debug("no room for the controller base address\n");
+
+			errno = ENOSPC;
+			goto unmap;
+		}
+
+		cba = ALIGN_UP(ranges[nranges - 1].last + 1, 0x1000);
+	}
+
+	if (NVME_FIELD_GET(cap, CAP_CMBS))
+		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC,
+				cpu_to_le64(cba | NVME_CMBMSC_CMSE | NVME_CMBMSC_CRE));
+
+	log_info("cmb controller base address is 0x%" PRIx64 "\n", cba);
+
+	/* a separate view for cpu copies; the dma mapping stays on the vfio fd */
+	ctrl->cmb.wc = vfio_pci_map_bar_wc(&ctrl->pci, bir, len, ofst, PROT_READ | PROT_WRITE);
+	if (!ctrl->cmb.wc)
+		log_debug("could not map cmb for cpu copies\n");
+
+	ctrl->cmb.vaddr = vaddr;
+	ctrl->cmb.len = len;
+	ctrl->cmb.cba = cba;
+	ctrl->cmb.ctx = ctx;
+	ctrl->cmb.bar = bir;
+	ctrl->cmb.offset = ofst;
+
+	return 0;
+
+unmap:
+	iommu_unmap_bar(ctx, &ctrl->pci, bir, vaddr, ofst, len);
+
+	return -1;
+}
+
+void nvme_cmb_unmap(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap;
+
+	if (!ctrl->cmb.vaddr)
+		return;
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+
+	if (NVME_FIELD_GET(cap, CAP_CMBS))
+		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(0x0));
+
+	if (ctrl->cmb.wc)
+		vfio_pci_unmap_bar(&ctrl->pci, ctrl->cmb.bar, ctrl->cmb.wc, ctrl->cmb.len,
+				   ctrl->cmb.offset);
+
+	iommu_unmap_bar(ctrl->cmb.ctx, &ctrl->pci, ctrl->cmb.bar, ctrl->cmb.vaddr,
+			ctrl->cmb.offset, ctrl->cmb.len);
+
+	memset(&ctrl->cmb, 0x0, sizeof(ctrl->cmb));
+}
+
+static int nvme_pmr_wait_rdy(struct nvme_ctrl *ctrl, uint32_t pmrcap, unsigned int nrdy)
+{
+	unsigned long timeout_ms;
+	struct timeabs deadline;
+	uint32_t pmrsts;
+
+	timeout_ms = max_t(unsigned long, NVME_FIELD_GET(pmrcap, PMRCAP_PMRTO), 1);
+
+	if (NVME_FIELD_GET(pmrcap, PMRCAP_PMRTU) == NVME_PMRCAP_PMRTU_MINUTES)
+		timeout_ms *= 60 * 1000;
+	else
+		timeout_ms *= 500;
+
+	deadline = timeabs_add(time_now(), time_from_msec(timeout_ms));
+
+	do {
+		if (time_after(time_now(), deadline)) {
+			log_debug("timed out\n");
+
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		pmrsts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRSTS));
+	} while (NVME_FIELD_GET(pmrsts, PMRSTS_NRDY) != nrdy);
+
+	return 0;
+}
+
+int nvme_pmr_map(struct nvme_ctrl *ctrl)
+{
+	uint32_t pmrcap, pmrsts, wbm;
+	uint64_t cap;
+	void *vaddr;
+	size_t len;
+	int bir;
+
+	if (ctrl->pmr.vaddr) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	if (!NVME_FIELD_GET(cap, CAP_PMRS)) {
+		log_debug("controller has no pmr\n");
+
+		errno = ENODEV;
+		return -1;
+	}
+
+	pmrcap = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRCAP));
+	bir = NVME_FIELD_GET(pmrcap, PMRCAP_BIR);
+	wbm = NVME_FIELD_GET(pmrcap, PMRCAP_PMRWBM);
+
+	if (!(pmrcap & NVME_PMRCAP_WDS)) {
+		log_debug("pmr does not support writes\n");
+
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	/* a read from the pmr itself requires read data support */
+	if (!(pmrcap & NVME_PMRCAP_RDS))
+		wbm &= ~NVME_PMRCAP_PMRWBM_PMR_READ;
+
+	if (!wbm) {
+		log_debug("pmr has no usable write barrier mechanism\n");
+
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (bir >= PCI_STD_NUM_BARS ||
+	    !(ctrl->pci.bar_region_info[bir].flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+		log_debug("pmr bar %d cannot be mapped\n", bir);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the pmr spans the entire bar */
+	len = ctrl->pci.bar_region_info[bir].size;
+
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(NVME_PMRCTL_EN));
+
+	if (nvme_pmr_wait_rdy(ctrl, pmrcap, 0)) {
+		log_debug("pmr did not become ready\n");
+		goto disable;
+	}
+
+	pmrsts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRSTS));
+	if (NVME_FIELD_GET(pmrsts, PMRSTS_HSTS)) {
+		log_debug("pmr is not healthy (pmrsts 0x%" PRIx32 ")\n", pmrsts);
+
+		errno = EIO;
+		goto disable;
+	}
+
+	vaddr = vfio_pci_map_bar_wc(&ctrl->pci, bir, len, 0, PROT_READ | PROT_WRITE);
+	if (!vaddr) {
+		log_debug("could not map pmr\n");
+		goto disable;
+	}
+
+	log_info("pmr is %zu bytes in bar %d (wbm 0x%" PRIx32 ")\n", len, bir, wbm);
+
+	ctrl->pmr.vaddr = vaddr;
+	ctrl->pmr.len = len;
+	ctrl->pmr.bar = bir;
+	ctrl->pmr.sts_barrier = !!(wbm & NVME_PMRCAP_PMRWBM_PMRSTS_READ);
+
+	return 0;
+
+disable:
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(0x0));
+
+	return -1;
+}
+
+void nvme_pmr_unmap(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->pmr.vaddr)
+		return;
+
+	/* make sure nothing is lost in flight */
+	if (nvme_pmr_persist(ctrl))
+		log_error("failed to persist pmr writes\n");
+
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(0x0));
+
+	vfio_pci_unmap_bar(&ctrl->pci, ctrl->pmr.bar, ctrl->pmr.vaddr, ctrl->pmr.len, 0);
+
+	memset(&ctrl->pmr, 0x0, sizeof(ctrl->pmr));
+}
+
+int nvme_pmr_persist(struct nvme_ctrl *ctrl)
+{
+	uint32_t pmrsts;
+
+	if (!ctrl->pmr.vaddr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * Drain the write-combining buffers and order the barrier read after
+	 * all prior stores; the read completion then guarantees (by pci
+	 * ordering rules) that the posted writes have reached the controller.
+	 */
+	mb();
+
+	if (!ctrl->pmr.sts_barrier) {
+		(void)LOAD_PTR((uint32_t *)ctrl->pmr.vaddr);
+
+		return 0;
+	}
+
+	pmrsts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRSTS));
+	if (NVME_FIELD_GET(pmrsts, PMRSTS_HSTS) || NVME_FIELD_GET(pmrsts, PMRSTS_NRDY)) {
+		log_debug("pmr is not healthy (pmrsts 0x%" PRIx32 ")\n", pmrsts);
+
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
 int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
 {
 	unsigned long long classcode;
 	uint64_t cap;
-	uint8_t mpsmin, mpsmax;
+	uint8_t mpsmin, mpsmax, mdts;
 	uint16_t oacs;
 	ssize_t len;
 	void *vaddr;
@@ -574,6 +1200,11 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		return -1;
 	}
 
+	if (nvme_init_prp_pool(ctrl, NVME_PRP_POOL_SIZE)) {
+		log_debug("could not initialize prp list page pool\n");
+		return -1;
+	}
+
 	/* +2 because nsqr/ncqr are zero-based values and do not account for the admin queue */
 	ctrl->sq = znew_t(struct nvme_sq, ctrl->opts.nsqr + 2);
 	ctrl->cq = znew_t(struct nvme_cq, ctrl->opts.ncqr + 2);
@@ -625,11 +1256,20 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		goto out;
 	}
 
+	/* mdts is reported in units of the minimum memory page size */
+	mdts = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_MDTS);
+	if (mdts && 12 + mpsmin + mdts < (int)(8 * sizeof(size_t)))
+		ctrl->config.mdts = (size_t)1 << (12 + mpsmin + mdts);
+
 	oacs = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_OACS));
 
 	if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG)
 		ret = nvme_init_dbconfig(ctrl);
 
+	/* the controller works without one, only slower */
+	if (!ret && NVME_HMB_MAX_SIZE && nvme_init_hmb(ctrl, vaddr))
+		log_info("could not provide host memory buffer\n");
+
 out:
 	pgunmap(vaddr, len);
 
@@ -638,6 +1278,8 @@ out:
 
 void nvme_close(struct nvme_ctrl *ctrl)
 {
+	nvme_discard_hmb(ctrl);
+
 	for (int i = 0; i < ctrl->opts.nsqr + 2; i++)
 		nvme_discard_sq(ctrl, &ctrl->sq[i]);
 
@@ -647,6 +1289,15 @@ void nvme_close(struct nvme_ctrl *ctrl)
 		nvme_discard_cq(ctrl, &ctrl->cq[i]);
 
 	free(ctrl->cq);
+	free(ctrl->vectors);
+
+	if (ctrl->pci.dev.irq.eventfds && vfio_disable_irq(&ctrl->pci.dev))
+		log_debug("could not disable irqs\n");
+
+	nvme_discard_prp_pool(ctrl);
+
+	nvme_cmb_unmap(ctrl);
+	nvme_pmr_unmap(ctrl);
 
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->regs, 0x1000, 0);
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->doorbells, 0x1000, 0x1000);
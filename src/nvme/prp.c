@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/prp: " fmt
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(__CHECKER__)
+# define HAVE_PRP_FILL_X86_64
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(__CHECKER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define HAVE_PRP_FILL_NEON
+# include <arm_neon.h>
+#endif
+
+#include <vfn/support.h>
+
+#include "ccan/array_size/array_size.h"
+
+#include "prp.h"
+
+/*
+ * Reference implementation. The vectorized versions below must produce the
+ * exact same list (see rq_test.c).
+ */
+void prp_fill_scalar(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+{
+	for (int i = 0; i < prpcount; i++)
+		prplist[i] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+}
+
+static bool prp_fill_scalar_supported(void)
+{
+	return true;
+}
+
+/*
+ * The vectorized versions keep a vector of consecutive entries in a register
+ * and add a splatted stride to it for each store. Little-endian only, so no
+ * byte swapping is required.
+ */
+#ifdef HAVE_PRP_FILL_X86_64
+__attribute__((target("avx2")))
+static void prp_fill_avx2(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	__m256i v, stride;
+	int i = 0;
+
+	if (prpcount < 4)
+		goto tail;
+
+	v = _mm256_set_epi64x(iova + 3 * pagesize, iova + 2 * pagesize, iova + pagesize, iova);
+	stride = _mm256_set1_epi64x(4 * pagesize);
+
+	for (; i + 4 <= prpcount; i += 4) {
+		_mm256_storeu_si256((__m256i *)(void *)&prplist[i], v);
+		v = _mm256_add_epi64(v, stride);
+	}
+
+tail:
+	prp_fill_scalar(&prplist[i], prpcount - i, iova + ((uint64_t)i << pageshift), pageshift);
+}
+
+static bool prp_fill_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f")))
+static void prp_fill_avx512(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	__m512i v, stride;
+	int i = 0;
+
+	if (prpcount < 8)
+		goto tail;
+
+	v = _mm512_set_epi64(iova + 7 * pagesize, iova + 6 * pagesize,
+			     iova + 5 * pagesize, iova + 4 * pagesize,
+			     iova + 3 * pagesize, iova + 2 * pagesize,
+			     iova + pagesize, iova);
+	stride = _mm512_set1_epi64(8 * pagesize);
+
+	for (; i + 8 <= prpcount; i += 8) {
+		_mm512_storeu_si512((void *)&prplist[i], v);
+		v = _mm512_add_epi64(v, stride);
+	}
+
+tail:
+	prp_fill_scalar(&prplist[i], prpcount - i, iova + ((uint64_t)i << pageshift), pageshift);
+}
+
+static bool prp_fill_avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif /* HAVE_PRP_FILL_X86_64 */
+
+#ifdef HAVE_PRP_FILL_NEON
+static void prp_fill_neon(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	uint64x2_t v0, v1, stride;
+	int i = 0;
+
+	if (prpcount < 4)
+		goto tail;
+
+	v0 = vcombine_u64(vcreate_u64(iova), vcreate_u64(iova + pagesize));
+	v1 = vaddq_u64(v0, vdupq_n_u64(2 * pagesize));
+	stride = vdupq_n_u64(4 * pagesize);
+
+	for (; i + 4 <= prpcount; i += 4) {
+		vst1q_u64((uint64_t *)(void *)&prplist[i], v0);
+		vst1q_u64((uint64_t *)(void *)&prplist[i + 2], v1);
+
+		v0 = vaddq_u64(v0, stride);
+		v1 = vaddq_u64(v1, stride);
+	}
+
+tail:
+	prp_fill_scalar(&prplist[i], prpcount - i, iova + ((uint64_t)i << pageshift), pageshift);
+}
+
+static bool prp_fill_neon_supported(void)
+{
+	/* advanced simd is mandatory on aarch64 */
+	return true;
+}
+#endif /* HAVE_PRP_FILL_NEON */
+
+/* in order of preference */
+const struct prp_fill_impl prp_fill_impls[] = {
+#ifdef HAVE_PRP_FILL_X86_64
+	{ "avx512", prp_fill_avx512, prp_fill_avx512_supported },
+	{ "avx2", prp_fill_avx2, prp_fill_avx2_supported },
+#endif
+#ifdef HAVE_PRP_FILL_NEON
+	{ "neon", prp_fill_neon, prp_fill_neon_supported },
+#endif
+	{ "scalar", prp_fill_scalar, prp_fill_scalar_supported },
+};
+
+const int prp_fill_nimpls = ARRAY_SIZE(prp_fill_impls);
+
+prp_fill_fn __prp_fill = prp_fill_scalar;
+
+static void __attribute__((constructor)) init_prp_fill(void)
+{
+#ifdef HAVE_PRP_FILL_X86_64
+	/* required when used from a constructor */
+	__builtin_cpu_init();
+#endif
+
+	for (int i = 0; i < prp_fill_nimpls; i++) {
+		const struct prp_fill_impl *impl = &prp_fill_impls[i];
+
+		if (!impl->supported())
+			continue;
+
+		log_debug("using %s prp list fill\n", impl->name);
+
+		__prp_fill = impl->fill;
+
+		break;
+	}
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Fill @prpcount consecutive prp list entries, starting at the page aligned
+ * @iova, into @prplist.
+ */
+typedef void (*prp_fill_fn)(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift);
+
+struct prp_fill_impl {
+	const char *name;
+	prp_fill_fn fill;
+
+	/* runtime check for the required instruction set extensions */
+	bool (*supported)(void);
+};
+
+extern const struct prp_fill_impl prp_fill_impls[];
+extern const int prp_fill_nimpls;
+
+/* the best supported implementation; selected at load time */
+extern prp_fill_fn __prp_fill;
+
+void prp_fill_scalar(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift);
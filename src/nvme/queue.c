@@ -26,6 +26,7 @@
 
 #include <linux/vfio.h>
 
+#include <vfn/support/atomic.h>
 #include <vfn/support/barrier.h>
 #include <vfn/support/compiler.h>
 #include <vfn/support/endian.h>
@@ -39,11 +39,129 @@
 
 #include "iommu/context.h"
 
-static inline int __map_first(leint64_t *prp1, leint64_t *prplist, uint64_t iova, size_t len,
-			      int pageshift)
+#include "prp.h"
+
+struct prp_list {
+	struct nvme_rq *rq;
+
+	/* current list page (NULL until a list is required) */
+	leint64_t *entries;
+	int nentries, max_prps;
+
+	/* total number of entries appended */
+	int count;
+
+	/* the first entry or, if a list is required, the list pointer */
+	leint64_t prp2;
+
+	int pageshift;
+};
+
+static inline void __prp_list_init(struct prp_list *l, struct nvme_rq *rq, int pageshift)
+{
+	/* release list pages from any previous mapping */
+	__nvme_rq_put_chain(rq);
+
+	*l = (struct prp_list) {
+		.rq = rq,
+		.max_prps = 1 << (pageshift - 3),
+		.pageshift = pageshift,
+	};
+}
+
+/*
+ * Get a new list page from the pool. If this is the first page, move the
+ * first entry into it and turn prp2 into a list pointer. Otherwise, the
+ * current list page is full; move the last entry into the new page and replace
+ * it with a pointer to the new page.
+ */
+static int __prp_list_chain(struct prp_list *l)
+{
+	struct nvme_rq *rq = l->rq;
+	struct nvme_prp_pool *pool = rq->sq->prp_pool;
+	struct nvme_prp_page *page;
+	leint64_t *entries;
+
+	if (!pool) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	page = nvme_prp_pool_get(pool);
+	if (!page)
+		return -1;
+
+	entries = page->vaddr;
+
+	if (rq->chain.tail) {
+		rq->chain.tail->next = (uint32_t)(page - pool->pages) + 1;
+
+		entries[0] = l->entries[l->max_prps - 1];
+		l->entries[l->max_prps - 1] = cpu_to_le64(page->iova);
+	} else {
+		rq->chain.head = page;
+
+		entries[0] = l->prp2;
+		l->prp2 = cpu_to_le64(page->iova);
+	}
+
+	rq->chain.tail = page;
+
+	l->entries = entries;
+	l->nentries = 1;
+
+	return 0;
+}
+
+static inline int __map_aligned(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
 {
 	size_t pagesize = 1 << pageshift;
-	int max_prps = 1 << (pageshift - 3);
+
+	/*
+	 * __map_aligned is used exclusively for mapping into the prplist
+	 * entries where addresses must be page size aligned.
+	 */
+	assert(ALIGNED(iova, pagesize));
+
+	__prp_fill(prplist, prpcount, iova, pageshift);
+
+	return prpcount;
+}
+
+static int __prp_list_append(struct prp_list *l, uint64_t iova, int prpcount)
+{
+	if (prpcount && !l->count) {
+		/* a single entry goes directly in prp2 */
+		l->prp2 = cpu_to_le64(iova);
+		l->count = 1;
+
+		iova += 1ULL << l->pageshift;
+		prpcount--;
+	}
+
+	while (prpcount) {
+		int n;
+
+		if ((!l->entries || l->nentries == l->max_prps) && __prp_list_chain(l))
+			return -1;
+
+		n = min_t(int, prpcount, l->max_prps - l->nentries);
+
+		__map_aligned(&l->entries[l->nentries], n, iova, l->pageshift);
+
+		l->nentries += n;
+		l->count += n;
+		iova += (uint64_t)n << l->pageshift;
+		prpcount -= n;
+	}
+
+	return 0;
+}
+
+static inline int __map_first(struct prp_list *l, leint64_t *prp1, uint64_t iova, size_t len)
+{
+	int pageshift = l->pageshift;
+	size_t pagesize = 1 << pageshift;
 
 	/* number of prps required to map the buffer */
 	int prpcount = 1;
@@ -55,66 +173,38 @@ static inline int __map_first(leint64_t *prp1, leint64_t *prplist, uint64_t iova
 
 	/* any residual just adds more prps */
 	if (len)
-		prpcount += (int)ALIGN_UP(len, pagesize) >> pageshift;
+		prpcount += (int)(ALIGN_UP(len, pagesize) >> pageshift);
 
 	if (prpcount > 1 && !ALIGNED(iova, pagesize))
-		/* align down to simplify loop below */
+		/* align down to simplify the below */
 		iova = ALIGN_DOWN(iova, pagesize);
 
-	if (prpcount > max_prps) {
-		errno = EINVAL;
-		return 0;
-	}
-
 	/*
 	 * Map the remaining parts of the buffer into prp2/prplist. iova will be
 	 * aligned from the above, which simplifies this.
 	 */
-	for (int i = 1; i < prpcount; i++)
-		prplist[i - 1] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+	if (__prp_list_append(l, iova + pagesize, prpcount - 1))
+		return 0;
 
-	/*
-	 * prpcount may be zero if the buffer length was less than the page
-	 * size, so clamp it to 1 in that case.
-	 */
-	return clamp_t(int, prpcount, 1, prpcount);
+	return prpcount;
 }
 
-static inline int __map_aligned(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+static inline void __set_prp2(struct prp_list *l, union nvme_cmd *cmd)
 {
-	size_t pagesize = 1 << pageshift;
-
-	/*
-	 * __map_aligned is used exclusively for mapping into the prplist
-	 * entries where addresses must be page size aligned.
-	 */
-	assert(ALIGNED(iova, pagesize));
-
-	for (int i = 0; i < prpcount; i++)
-		prplist[i] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
-
-	return prpcount;
+	cmd->dptr.prp2 = l->count ? l->prp2 : 0x0;
 }
 
 int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
 		    size_t len)
 {
-	int prpcount;
-	leint64_t *prplist = rq->page.vaddr;
+	struct prp_list l;
 
-	prpcount = __map_first(&cmd->dptr.prp1, prplist, iova, len,
-			       __mps_to_pageshift(ctrl->config.mps));
-	if (!prpcount) {
-		errno = EINVAL;
+	__prp_list_init(&l, rq, __mps_to_pageshift(ctrl->config.mps));
+
+	if (!__map_first(&l, &cmd->dptr.prp1, iova, len))
 		return -1;
-	}
 
-	if (prpcount == 2)
-		cmd->dptr.prp2 = prplist[0];
-	else if (prpcount > 2)
-		cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
-	else
-		cmd->dptr.prp2 = 0x0;
+	__set_prp2(&l, cmd);
 
 	return 0;
 }
@@ -122,16 +212,19 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov)
 {
+	struct prp_list l;
 	int prpcount, _prpcount;
-	leint64_t *prplist = rq->page.vaddr;
 	uint64_t iova = (uint64_t)iov->iov_base;
 	size_t len = iov->iov_len;
 	int pageshift = __mps_to_pageshift(ctrl->config.mps);
 	size_t pagesize = 1 << pageshift;
-	int max_prps = 1 << (pageshift - 3);
+
+	__prp_list_init(&l, rq, pageshift);
 
 	/* map the first segment */
-	prpcount = __map_first(&cmd->dptr.prp1, prplist, iova, len, pageshift);
+	prpcount = __map_first(&l, &cmd->dptr.prp1, iova, len);
+	if (!prpcount)
+		return -1;
 
 	/*
 	 * At this point, one of three conditions must hold:
@@ -154,14 +247,7 @@ int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd
 		iova = (uint64_t)iov[i].iov_base;
 		len = iov[i].iov_len;
 
-		_prpcount = max_t(int, 1, (int)len >> pageshift);
-
-		if (prpcount + _prpcount > max_prps) {
-			log_error("too many prps required\n");
-
-			goto invalid;
-		}
-
+		_prpcount = max_t(int, 1, (int)(ALIGN_UP(len, pagesize) >> pageshift));
 
 		if (!ALIGNED(iova, pagesize)) {
 			log_error("unaligned iov[%u].iov_base (0x%"PRIx64")\n", i, iova);
@@ -176,15 +262,11 @@ int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd
 			goto invalid;
 		}
 
-		prpcount += __map_aligned(&prplist[prpcount - 1], _prpcount, iova, pageshift);
+		if (__prp_list_append(&l, iova, _prpcount))
+			return -1;
 	}
 
-	if (prpcount == 2)
-		cmd->dptr.prp2 = prplist[0];
-	else if (prpcount > 2)
-		cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
-	else
-		cmd->dptr.prp2 = 0x0;
+	__set_prp2(&l, cmd);
 
 	return 0;
 
@@ -193,6 +275,193 @@ invalid:
 	return -1;
 }
 
+int nvme_rq_map_buf(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		    struct nvme_buf *buf, size_t offset, size_t len)
+{
+	int pageshift = buf->pageshift;
+	uint64_t iova = buf->iova + offset;
+	size_t first, last, idx;
+
+	if (!len || offset >= buf->len || len > buf->len - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* no list pages are used; release any from a previous mapping */
+	__nvme_rq_put_chain(rq);
+
+	first = offset >> pageshift;
+	last = (offset + len - 1) >> pageshift;
+
+	cmd->dptr.prp1 = cpu_to_le64(iova);
+
+	switch (last - first) {
+	case 0:
+		cmd->dptr.prp2 = 0x0;
+		return 0;
+
+	case 1:
+		cmd->dptr.prp2 = cpu_to_le64(buf->iova + (last << pageshift));
+		return 0;
+	}
+
+	/*
+	 * If the last entry is the first entry in a chained list page, the
+	 * controller would consume the chain pointer as a data entry. Build the
+	 * list from scratch instead.
+	 */
+	if (buf->nprps < (1 << (pageshift - 3)) && !(last % (size_t)buf->nprps))
+		return nvme_rq_map_prp(ctrl, rq, cmd, iova, len);
+
+	/* prp2 points to the entry of the second page */
+	idx = first + 1;
+
+	cmd->dptr.prp2 = cpu_to_le64(buf->prplist.iova +
+				     ((idx / (size_t)buf->nprps) << pageshift) +
+				     (idx % (size_t)buf->nprps) * sizeof(leint64_t));
+
+	return 0;
+}
+
+/*
+ * Maximum size of a child command; the maximum data transfer size of the
+ * controller or, if unlimited, what can be described by a single prp list page.
+ */
+static size_t __io_max_xfer(struct nvme_ctrl *ctrl, int lbads)
+{
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	size_t max = ctrl->config.mdts;
+
+	if (!max)
+		max = (size_t)1 << (2 * pageshift - 3);
+
+	/* the number of logical blocks is a 16 bit zeroes based value */
+	max = min_t(size_t, max, (size_t)1 << (16 + lbads));
+
+	return ALIGN_DOWN(max, (size_t)1 << lbads);
+}
+
+static void __io_release(struct nvme_rq *rq)
+{
+	struct nvme_rq *next;
+
+	for (; rq; rq = next) {
+		next = rq->rq_next;
+		nvme_rq_release_atomic(rq);
+	}
+}
+
+int nvme_io_rw(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_io *io,
+	       union nvme_cmd *cmd, uint64_t iova, size_t len, int lbads, uint64_t mptr,
+	       size_t ms)
+{
+	size_t max = __io_max_xfer(ctrl, lbads);
+	uint64_t slba = le64_to_cpu(cmd->rw.slba);
+	uint32_t reftag = le32_to_cpu(cmd->rw.reftag);
+	uint16_t tail = sq->tail;
+	struct nvme_rq *rq, *children = NULL;
+	size_t offset = 0;
+	int nchildren;
+
+	if (!len || !max || !ALIGNED(len, (size_t)1 << lbads) || cmd->rw.mptr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nchildren = (int)((len + max - 1) / max);
+
+	/* acquire all request trackers up front; chain them through rq_next */
+	for (int i = 0; i < nchildren; i++) {
+		rq = nvme_rq_acquire_atomic(sq);
+		if (!rq) {
+			__io_release(children);
+			return -1;
+		}
+
+		rq->rq_next = children;
+		children = rq;
+	}
+
+	io->sq = sq;
+	io->nchildren = nchildren;
+	io->failed = false;
+
+	for (rq = children; rq; rq = rq->rq_next) {
+		union nvme_cmd child = *cmd;
+		size_t chunk = min_t(size_t, max, len - offset);
+
+		child.rw.slba = cpu_to_le64(slba + (offset >> lbads));
+		child.rw.nlb = cpu_to_le16((uint16_t)((chunk >> lbads) - 1));
+
+		if (le16_to_cpu(cmd->rw.control) & NVME_RW_PRCHK_REF)
+			child.rw.reftag = cpu_to_le32(reftag + (uint32_t)(offset >> lbads));
+
+		if (ms && nvme_cmd_map_meta(&child, mptr + (offset >> lbads) * ms))
+			goto rewind;
+
+		if (nvme_rq_map_prp(ctrl, rq, &child, iova + offset, chunk))
+			goto rewind;
+
+		rq->io = io;
+
+		nvme_rq_post(rq, &child);
+
+		offset += chunk;
+	}
+
+	nvme_sq_update_tail(sq);
+
+	return 0;
+
+rewind:
+	/* the doorbell has not been written; drop the posted entries */
+	sq->tail = tail;
+
+	__io_release(children);
+
+	return -1;
+}
+
+int nvme_io_wait(struct nvme_io *io, struct nvme_cqe *cqe_copy, struct timespec *ts)
+{
+	struct nvme_cq *cq = io->sq->cq;
+	struct nvme_cqe cqe;
+	struct nvme_rq *rq;
+
+	while (io->nchildren) {
+		if (nvme_cq_wait_cqes(cq, &cqe, 1, ts) != 1)
+			return -1;
+
+		nvme_cq_update_head(cq);
+
+		rq = __nvme_rq_from_cqe(io->sq, &cqe);
+		if (cqe.cid > io->sq->qsize - 1 || rq->io != io) {
+			if (cqe_copy)
+				memcpy(cqe_copy, &cqe, sizeof(*cqe_copy));
+
+			errno = EAGAIN;
+			return -1;
+		}
+
+		nvme_io_complete(rq, &cqe);
+	}
+
+	if (cqe_copy)
+		memcpy(cqe_copy, &io->cqe, sizeof(*cqe_copy));
+
+	if (io->failed) {
+		if (logv(LOG_DEBUG)) {
+			uint16_t status = le16_to_cpu(io->cqe.sfp) >> 1;
+
+			log_debug("cqe status 0x%" PRIx16 "\n", status & 0x7ff);
+		}
+
+		return nvme_set_errno_from_cqe(&io->cqe);
+	}
+
+	return 0;
+}
+
 int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec *ts)
 {
 	struct nvme_cq *cq = rq->sq->cq;
@@ -16,6 +16,7 @@
  * more details.
  */
 
+#include "ccan/array_size/array_size.h"
 #include "ccan/tap/tap.h"
 
 #include "rq.c"
@@ -26,6 +27,10 @@ bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *
 {
 	*iova = (uint64_t)vaddr;
 
+	/* a separate mapping, not contiguous with the one preceding it */
+	if (*iova >= 0x30000000 && *iova < 0x40000000)
+		*iova += 0x1000000;
+
 	return true;
 }
 
@@ -40,23 +45,94 @@ int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *
 	return 0;
 }
 
+static bool prp_fill_matches_scalar(prp_fill_fn fill)
+{
+	leint64_t expected[512 + 1], actual[512 + 1];
+	const int counts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 255, 511, 512};
+
+	for (int pageshift = 12; pageshift <= 16; pageshift++) {
+		for (unsigned int i = 0; i < ARRAY_SIZE(counts); i++) {
+			uint64_t iova = 0xfedc0000000ULL + ((uint64_t)i << pageshift);
+
+			memset(expected, 0xa5, sizeof(expected));
+			memset(actual, 0xa5, sizeof(actual));
+
+			prp_fill_scalar(expected, counts[i], iova, pageshift);
+			fill(actual, counts[i], iova, pageshift);
+
+			/* also checks that nothing was written beyond the last entry */
+			if (memcmp(expected, actual, sizeof(expected)))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 int main(void)
 {
 	struct nvme_ctrl ctrl = {
 		.config.mps = 0,
 	};
 
-	struct nvme_rq rq;
+	struct nvme_prp_page pages[3];
+	struct nvme_prp_pool pool = {
+		.npages = 3,
+		.pages = pages,
+	};
+
+	struct nvme_sq sq = {
+		.prp_pool = &pool,
+	};
+
+	struct nvme_rq rq = {
+		.sq = &sq,
+	};
+
 	union nvme_cmd cmd;
-	leint64_t *prplist;
+	leint64_t *prplist, *chained[2];
 	struct iovec iov[8];
+	struct nvme_buf buf;
+	leint64_t *buflist;
+
+	union nvme_cmd sqes[8];
+	uint32_t doorbell = 0;
+	struct nvme_rq iorqs[4];
+	struct nvme_sq iosq = {
+		.vaddr = sqes,
+		.qsize = 8,
+		.doorbell = &doorbell,
+		.rqs = iorqs,
+		.rq_top = &iorqs[0],
+	};
+	struct nvme_cqe cqe;
+	struct nvme_io io;
 
-	plan_tests(89);
+	plan_tests(130 + prp_fill_nimpls);
 
 	assert(pgmap((void **)&prplist, __VFN_PAGESIZE) > 0);
 
-	rq.page.vaddr = prplist;
-	rq.page.iova = 0x8000000;
+	for (int i = 0; i < 2; i++) {
+		assert(pgmap((void **)&chained[i], __VFN_PAGESIZE) > 0);
+
+		pages[i] = (struct nvme_prp_page) {
+			.vaddr = chained[i],
+			.iova = 0x9000000 + (i << 12),
+			.next = i,
+		};
+	}
+
+	/*
+	 * The first list page is at the top of the pool stack; since pages are
+	 * returned in order, each mapping below starts out with it.
+	 */
+	pages[2] = (struct nvme_prp_page) {
+		.vaddr = prplist,
+		.iova = 0x8000000,
+		.next = 2,
+	};
+
+	pool.top = 3;
 
 	/* test 512b aligned */
 	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
@@ -315,18 +391,199 @@ int main(void)
 	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x1001000);
 
 
+	/* test 2052k aligned (fills a single list page) */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, __max_prps * 0x1000);
+
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000000);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x8000000);
+	ok1(le64_to_cpu(prplist[511]) == 0x1000000 + 512 * 0x1000);
+	ok1(rq.chain.head == &pages[2] && rq.chain.tail == &pages[2]);
+
+	/* test 2056k aligned (chained) */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, (__max_prps + 1) * 0x1000) == 0);
+
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000000);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x8000000);
+	ok1(le64_to_cpu(prplist[510]) == 0x1000000 + 511 * 0x1000);
+	ok1(le64_to_cpu(prplist[511]) == rq.chain.tail->iova);
+	ok1(le64_to_cpu(((leint64_t *)rq.chain.tail->vaddr)[0]) == 0x1000000 + 512 * 0x1000);
+	ok1(le64_to_cpu(((leint64_t *)rq.chain.tail->vaddr)[1]) == 0x1000000 + 513 * 0x1000);
+
+	/* test chaining twice (uses all pool pages) */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, (511 + 511 + 2 + 1) * 0x1000) == 0);
+
+	ok1((uint32_t)pool.top == 0 && rq.chain.tail == &pages[0]);
+	ok1(le64_to_cpu(chained[1][511]) == rq.chain.tail->iova);
+	ok1(le64_to_cpu(((leint64_t *)rq.chain.tail->vaddr)[1]) == 0x1000000 + 1024 * 0x1000);
+
+	/* test chained 2-iovec */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	iov[0] = (struct iovec) {.iov_base = (void *)0x1000000, .iov_len = 0x1000};
+	iov[1] = (struct iovec) {.iov_base = (void *)0x2000000, .iov_len = __max_prps * 0x1000};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == 0);
+
+	ok1(le64_to_cpu(prplist[511]) == rq.chain.tail->iova);
+	ok1(le64_to_cpu(((leint64_t *)rq.chain.tail->vaddr)[1]) == 0x2000000 + 512 * 0x1000);
+
+	/* releasing the request returns the chained pages to the pool */
+	nvme_rq_reset(&rq);
+
+	ok1(rq.chain.head == NULL && pool.top != 0);
+
+	/* registered buffer; 1024 pages requires a chained list */
+	ok1(nvme_buf_register(&ctrl, &buf, (void *)0x10000000, 1024 * 0x1000) == 0);
+
+	buflist = buf.prplist.vaddr;
+	ok1(le64_to_cpu(buflist[0]) == 0x10000000 &&
+	    le64_to_cpu(buflist[510]) == 0x10000000 + 510 * 0x1000 &&
+	    le64_to_cpu(buflist[511]) == buf.prplist.iova + 0x1000 &&
+	    le64_to_cpu(buflist[512]) == 0x10000000 + 511 * 0x1000);
+
+	/* single page */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 0x800, 0x800) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp1) == 0x10000800 &&
+	    le64_to_cpu(cmd.dptr.prp2) == 0x0);
+
+	/* two pages */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 0x800, 0x1000) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp1) == 0x10000800 &&
+	    le64_to_cpu(cmd.dptr.prp2) == 0x10001000);
+
+	/* prp list at an offset */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 0x1000, 0x3000) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp1) == 0x10001000 &&
+	    le64_to_cpu(cmd.dptr.prp2) == buf.prplist.iova + 2 * 8);
+
+	/* prp list crossing into the chained page */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 0x0, 600 * 0x1000) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp2) == buf.prplist.iova + 8);
+
+	/* prp list starting in the chained page */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 600 * 0x1000, 0x3000) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp2) == buf.prplist.iova + 0x1000 + 90 * 8);
+
+	/* last entry would be the chain pointer; falls back to a list page */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 0x0, 512 * 0x1000) == 0 &&
+	    le64_to_cpu(cmd.dptr.prp2) == 0x8000000 &&
+	    le64_to_cpu(prplist[510]) == 0x10000000 + 511 * 0x1000);
+
+	/* out of bounds */
+	ok1(nvme_rq_map_buf(&ctrl, &rq, &cmd, &buf, 1023 * 0x1000, 0x2000) == -1 &&
+	    errno == EINVAL);
+
+	nvme_buf_unregister(&ctrl, &buf);
+
+	ok1(buf.prplist.vaddr == NULL);
+
+	/* only the start of the buffer is covered by the existing mapping */
+	ok1(nvme_buf_register(&ctrl, &buf, (void *)0x2fffe000, 4 * 0x1000) == -1 &&
+	    errno == EEXIST && buf.prplist.vaddr == NULL);
+
+	/* split i/o; 0x5000 bytes with an 8k mdts gives three children */
+	for (int i = 0; i < 4; i++)
+		iorqs[i] = (struct nvme_rq) {
+			.sq = &iosq,
+			.cid = (uint16_t)i,
+			.rq_next = i < 3 ? &iorqs[i + 1] : NULL,
+		};
+
+	ctrl.config.mdts = 0x2000;
+
+	cmd = (union nvme_cmd) {.opcode = 0x2};
+	cmd.rw.slba = cpu_to_le64(100);
+
+	ok1(nvme_io_rw(&ctrl, &iosq, &io, &cmd, 0x1000000, 0x5000, 9, 0x0, 0) == 0 &&
+	    io.nchildren == 3 && iosq.tail == 3 && doorbell == 3);
+
+	ok1(le64_to_cpu(sqes[0].rw.slba) == 100 && le16_to_cpu(sqes[0].rw.nlb) == 15 &&
+	    le64_to_cpu(sqes[0].dptr.prp1) == 0x1000000 &&
+	    le64_to_cpu(sqes[0].dptr.prp2) == 0x1001000);
+
+	ok1(le64_to_cpu(sqes[2].rw.slba) == 132 && le16_to_cpu(sqes[2].rw.nlb) == 7 &&
+	    le64_to_cpu(sqes[2].dptr.prp1) == 0x1004000 &&
+	    le64_to_cpu(sqes[2].dptr.prp2) == 0x0);
+
+	/* not enough request trackers; nothing is submitted */
+	ok1(nvme_io_rw(&ctrl, &iosq, &io, &cmd, 0x1000000, 0x20000, 9, 0x0, 0) == -1 &&
+	    errno == EBUSY && iosq.rq_top == &iorqs[3] && iosq.tail == 3);
+
+	/* the parent completes with the first failed child */
+	for (int i = 0; i < 3; i++) {
+		cqe = (struct nvme_cqe) {
+			.cid = sqes[i].cid,
+			.sfp = cpu_to_le16(i == 1 ? 0x2 << 1 : 0x0),
+		};
+
+		if (nvme_io_complete(&iorqs[sqes[i].cid], &cqe) != (i == 2 ? &io : NULL))
+			break;
+	}
+
+	ok1(io.nchildren == 0 && io.failed && io.cqe.cid == sqes[1].cid && iosq.rq_top);
+
+	/* reference tags and metadata pointers are advanced for each child */
+	cmd.rw.control = cpu_to_le16(NVME_RW_PRCHK_REF);
+	cmd.rw.reftag = cpu_to_le32(100);
+
+	iosq.tail = 0;
+
+	ok1(nvme_io_rw(&ctrl, &iosq, &io, &cmd, 0x1000000, 0x4000, 9, 0x3000000, 8) == 0 &&
+	    le32_to_cpu(sqes[0].rw.reftag) == 100 && le32_to_cpu(sqes[1].rw.reftag) == 116);
+	ok1(le64_to_cpu(sqes[0].mptr) == 0x3000000 && le64_to_cpu(sqes[1].mptr) == 0x3000080 &&
+	    !cmd.mptr);
+
+	for (int i = 0; i < 2; i++)
+		nvme_io_complete(&iorqs[sqes[i].cid], &cqe);
+
+	ctrl.config.mdts = 0;
+
+	/* metadata */
+	ok1(nvme_cmd_map_meta(&cmd, 0x3000002) == -1 && errno == EINVAL);
+	ok1(nvme_cmd_map_meta(&cmd, 0x3000004) == 0 && le64_to_cpu(cmd.mptr) == 0x3000004);
+
+	rq.meta.vaddr = (void *)0x4000000;
+	rq.meta.iova = 0x5000000;
+
+	ok1(nvme_rq_meta(&rq, &cmd) == (void *)0x4000000 && le64_to_cpu(cmd.mptr) == 0x5000000);
+
+	/* cross-check the prp list fill implementations against the reference */
+	for (int i = 0; i < prp_fill_nimpls; i++) {
+		const struct prp_fill_impl *impl = &prp_fill_impls[i];
+
+		if (!impl->supported()) {
+			skip(1, "%s prp list fill not supported", impl->name);
+			continue;
+		}
+
+		ok(prp_fill_matches_scalar(impl->fill), "%s prp list fill", impl->name);
+	}
+
+
 	/*
 	 * Failure tests
 	 */
 
+	/* pool exhausted */
 	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
-	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, (__max_prps + 1) * 0x1000) == -1);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, (511 * 3 + 3) * 0x1000) == -1 &&
+	    errno == EBUSY);
 
 	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
 	iov[0] = (struct iovec) {.iov_base = (void *)0x1000004, .iov_len = 0x1000};
 	iov[0] = (struct iovec) {.iov_base = (void *)0x1001004, .iov_len = 0x1000};
 	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == -1);
 
+	/* no pool */
+	sq.prp_pool = NULL;
+	nvme_rq_reset(&rq);
+
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, (__max_prps + 1) * 0x1000) == -1 &&
+	    errno == EINVAL);
+
 	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
 	iov[0] = (struct iovec) {.iov_base = (void *)0x1000000, .iov_len = 0x1000};
 	iov[1] = (struct iovec) {.iov_base = (void *)0x1001000, .iov_len = __max_prps * 0x1000};
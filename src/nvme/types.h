@@ -27,6 +27,12 @@ enum nvme_reg {
 	NVME_REG_AQA			= 0x0024,
 	NVME_REG_ASQ			= 0x0028,
 	NVME_REG_ACQ			= 0x0030,
+	NVME_REG_CMBLOC			= 0x0038,
+	NVME_REG_CMBSZ			= 0x003c,
+	NVME_REG_CMBMSC			= 0x0050,
+	NVME_REG_PMRCAP			= 0x0e00,
+	NVME_REG_PMRCTL			= 0x0e04,
+	NVME_REG_PMRSTS			= 0x0e08,
 };
 
 enum nvme_cap {
@@ -42,6 +48,10 @@ enum nvme_cap {
 	NVME_CAP_MPSMIN_MASK		= 0xf,
 	NVME_CAP_MPSMAX_SHIFT		= 52,
 	NVME_CAP_MPSMAX_MASK		= 0xf,
+	NVME_CAP_PMRS_SHIFT		= 56,
+	NVME_CAP_PMRS_MASK		= 0x1,
+	NVME_CAP_CMBS_SHIFT		= 57,
+	NVME_CAP_CMBS_MASK		= 0x1,
 
 	NVME_CAP_CSS_CSI		= 1 << 6,
 	NVME_CAP_CSS_ADMIN		= 1 << 7,
@@ -72,7 +82,60 @@ enum nvme_cc {
 
 enum nvme_csts {
 	NVME_CSTS_RDY_SHIFT		= 0,
+	NVME_CSTS_CFS_SHIFT		= 1,
 	NVME_CSTS_RDY_MASK		= 0x1,
+	NVME_CSTS_CFS_MASK		= 0x1,
+};
+
+enum nvme_cmbloc {
+	NVME_CMBLOC_BIR_SHIFT		= 0,
+	NVME_CMBLOC_BIR_MASK		= 0x7,
+	NVME_CMBLOC_OFST_SHIFT		= 12,
+	NVME_CMBLOC_OFST_MASK		= 0xfffff,
+};
+
+enum nvme_cmbsz {
+	NVME_CMBSZ_SZU_SHIFT		= 8,
+	NVME_CMBSZ_SZU_MASK		= 0xf,
+	NVME_CMBSZ_SZ_SHIFT		= 12,
+	NVME_CMBSZ_SZ_MASK		= 0xfffff,
+};
+
+enum nvme_cmbmsc {
+	NVME_CMBMSC_CRE			= 1 << 0,
+	NVME_CMBMSC_CMSE		= 1 << 1,
+	NVME_CMBMSC_CBA_SHIFT		= 12,
+};
+
+enum nvme_pmrcap {
+	NVME_PMRCAP_RDS			= 1 << 3,
+	NVME_PMRCAP_WDS			= 1 << 4,
+	NVME_PMRCAP_BIR_SHIFT		= 5,
+	NVME_PMRCAP_BIR_MASK		= 0x7,
+	NVME_PMRCAP_PMRTU_SHIFT		= 8,
+	NVME_PMRCAP_PMRTU_MASK		= 0x3,
+	NVME_PMRCAP_PMRWBM_SHIFT	= 10,
+	NVME_PMRCAP_PMRWBM_MASK		= 0xf,
+	NVME_PMRCAP_PMRTO_SHIFT		= 16,
+	NVME_PMRCAP_PMRTO_MASK		= 0xff,
+
+	NVME_PMRCAP_PMRTU_500MS		= 0,
+	NVME_PMRCAP_PMRTU_MINUTES	= 1,
+	NVME_PMRCAP_PMRWBM_PMR_READ	= 1 << 0,
+	NVME_PMRCAP_PMRWBM_PMRSTS_READ	= 1 << 1,
+};
+
+enum nvme_pmrctl {
+	NVME_PMRCTL_EN			= 1 << 0,
+};
+
+enum nvme_pmrsts {
+	NVME_PMRSTS_ERR_SHIFT		= 0,
+	NVME_PMRSTS_ERR_MASK		= 0xff,
+	NVME_PMRSTS_NRDY_SHIFT		= 8,
+	NVME_PMRSTS_NRDY_MASK		= 0x1,
+	NVME_PMRSTS_HSTS_SHIFT		= 9,
+	NVME_PMRSTS_HSTS_MASK		= 0x7,
 };
 
 enum nvme_feat {
@@ -80,10 +143,13 @@ enum nvme_feat {
 	NVME_FEAT_NRQS_NSQR_MASK	= 0xffff,
 	NVME_FEAT_NRQS_NCQR_SHIFT	= 16,
 	NVME_FEAT_NRQS_NCQR_MASK	= 0xffff,
+
+	NVME_FEAT_HMB_EHM		= 1 << 0,
 };
 
 enum nvme_fid {
 	NVME_FEAT_FID_NUM_QUEUES	= 0x07,
+	NVME_FEAT_FID_HOST_MEM_BUF	= 0x0d,
 };
 
 enum nvme_admin_opcode {
@@ -102,7 +168,19 @@ enum nvme_identify_cns {
 };
 
 enum nvme_identify_ctrl_offset {
+	NVME_IDENTIFY_CTRL_MDTS		= 0x04d,
 	NVME_IDENTIFY_CTRL_OACS		= 0x100,
+	NVME_IDENTIFY_CTRL_HMPRE	= 0x110,
+	NVME_IDENTIFY_CTRL_HMMIN	= 0x114,
+	NVME_IDENTIFY_CTRL_HMMINDS	= 0x14c,
+	NVME_IDENTIFY_CTRL_HMMAXD	= 0x150,
+};
+
+/* host memory buffer descriptor entry */
+struct nvme_hmb_desc {
+	leint64_t badd;
+	leint32_t bsize;
+	uint32_t  rsvd12;
 };
 
 enum nvme_identify_ctrl_oacs {
@@ -13,8 +13,11 @@
 #include <byteswap.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,12 +30,108 @@
 #include <linux/limits.h>
 
 #include <vfn/support/atomic.h>
+#include <vfn/support/autoptr.h>
 #include <vfn/support/compiler.h>
 #include <vfn/support/log.h>
 #include <vfn/support/io.h>
 #include <vfn/support/mem.h>
+#include <vfn/support/mutex.h>
 #include <vfn/pci/util.h>
 
+#include "util/strmap.h"
+
+/*
+ * Resolving the iommu group and vfio device id of a device requires walking
+ * sysfs; cache the results, keyed by bdf. Entries are dropped when the device
+ * is bound or unbound through pci_bind() or pci_unbind().
+ */
+struct pci_dev_cache_entry {
+	char *bdf;
+
+	char *iommu_group;
+	char *vfio_id;
+
+	struct strmap_node node;
+};
+
+static pthread_mutex_t pci_dev_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct strmap pci_dev_cache;
+
+static struct pci_dev_cache_entry *pci_dev_cache_find(const char *bdf)
+{
+	struct strmap_node *n = strmap_find(&pci_dev_cache, bdf);
+
+	return n ? strmap_entry(n, struct pci_dev_cache_entry, node) : NULL;
+}
+
+static struct pci_dev_cache_entry *pci_dev_cache_get(const char *bdf)
+{
+	struct pci_dev_cache_entry *e = pci_dev_cache_find(bdf);
+
+	if (e)
+		return e;
+
+	e = znew_t(struct pci_dev_cache_entry, 1);
+	e->bdf = strdup(bdf);
+	if (!e->bdf) {
+		free(e);
+		return NULL;
+	}
+
+	strmap_add(&pci_dev_cache, &e->node, e->bdf);
+
+	return e;
+}
+
+static void pci_dev_cache_forget(const char *bdf)
+{
+	__autolock(&pci_dev_cache_lock);
+
+	struct pci_dev_cache_entry *e = pci_dev_cache_find(bdf);
+
+	if (!e)
+		return;
+
+	strmap_del(&pci_dev_cache, &e->node);
+
+	free(e->iommu_group);
+	free(e->vfio_id);
+	free(e->bdf);
+	free(e);
+}
+
+/* cache value for bdf in the member at offset, unless already cached */
+static void pci_dev_cache_store(const char *bdf, size_t offset, const char *value)
+{
+	__autolock(&pci_dev_cache_lock);
+
+	struct pci_dev_cache_entry *e = pci_dev_cache_get(bdf);
+	char **p;
+
+	if (!e)
+		return;
+
+	p = (char **)((char *)e + offset);
+	if (!*p)
+		*p = strdup(value);
+}
+
+/* return a copy of the value cached for bdf in the member at offset */
+static char *pci_dev_cache_load(const char *bdf, size_t offset)
+{
+	__autolock(&pci_dev_cache_lock);
+
+	struct pci_dev_cache_entry *e = pci_dev_cache_find(bdf);
+	char *value;
+
+	if (!e)
+		return NULL;
+
+	value = *(char **)((char *)e + offset);
+
+	return value ? strdup(value) : NULL;
+}
+
 int pci_unbind(const char *bdf)
 {
 	char *path = NULL;
@@ -50,6 +149,8 @@ int pci_unbind(const char *bdf)
 
 	ret = writeall(path, bdf, strlen(bdf));
 
+	pci_dev_cache_forget(bdf);
+
 out:
 	free(path);
 
@@ -68,6 +169,8 @@ int pci_bind(const char *bdf, const char *driver)
 
 	ret = writeall(path, bdf, strlen(bdf));
 
+	pci_dev_cache_forget(bdf);
+
 	free(path);
 
 	return ret < 0 ? -1 : 0;
@@ -198,6 +301,10 @@ char *pci_get_iommu_group(const char *bdf)
 	char *p, *link = NULL, *group = NULL, *path = NULL;
 	ssize_t ret;
 
+	path = pci_dev_cache_load(bdf, offsetof(struct pci_dev_cache_entry, iommu_group));
+	if (path)
+		return path;
+
 	if (asprintf(&link, "/sys/bus/pci/devices/%s/iommu_group", bdf) < 0) {
 		log_debug("asprintf failed\n");
 		goto out;
@@ -224,6 +331,8 @@ char *pci_get_iommu_group(const char *bdf)
 		goto out;
 	}
 
+	pci_dev_cache_store(bdf, offsetof(struct pci_dev_cache_entry, iommu_group), path);
+
 out:
 	free(link);
 	free(group);
@@ -238,6 +347,23 @@ char *pci_get_device_vfio_id(const char *bdf)
 	struct dirent *dentry;
 	DIR *dp;
 
+	vfio_id = pci_dev_cache_load(bdf, offsetof(struct pci_dev_cache_entry, vfio_id));
+	if (vfio_id) {
+		__autofree char *link = NULL;
+
+		if (asprintf(&link, "/sys/bus/pci/devices/%s/vfio-dev/%s", bdf, vfio_id) < 0)
+			link = NULL;
+
+		/* device ids are reused; make sure it still belongs to the device */
+		if (link && !access(link, F_OK))
+			return vfio_id;
+
+		free(vfio_id);
+		vfio_id = NULL;
+
+		pci_dev_cache_forget(bdf);
+	}
+
 	if (asprintf(&path, "/sys/bus/pci/devices/%s/vfio-dev", bdf) < 0) {
 		log_debug("asprintf failed\n");
 		return NULL;
@@ -275,8 +401,245 @@ char *pci_get_device_vfio_id(const char *bdf)
 	}
 
 	vfio_id = strdup(dentry->d_name);
+	if (vfio_id)
+		pci_dev_cache_store(bdf, offsetof(struct pci_dev_cache_entry, vfio_id), vfio_id);
 out:
 	log_fatal_if(closedir(dp), "closedir");
 
 	return vfio_id;
 }
+
+/* read a sysfs attribute of the device directory dfd, stripping the newline */
+static ssize_t pci_read_attr(int dfd, const char *name, char *buf, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ret = readmaxfd(fd, buf, len - 1);
+
+	log_fatal_if(close(fd), "close\n");
+
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return ret;
+}
+
+static int pci_read_attr_ull(int dfd, const char *name, unsigned long long *v)
+{
+	char buf[32], *endptr;
+
+	if (pci_read_attr(dfd, name, buf, sizeof(buf)) < 0)
+		return -1;
+
+	errno = 0;
+	*v = strtoull(buf, &endptr, 0);
+	if (endptr == buf)
+		errno = EINVAL;
+
+	return errno ? -1 : 0;
+}
+
+/* the last component of the link target, if the link exists */
+static void pci_read_link_name(int dfd, const char *name, char *buf, size_t len)
+{
+	char target[PATH_MAX], *p;
+	ssize_t ret;
+
+	buf[0] = '\0';
+
+	ret = readlinkat(dfd, name, target, sizeof(target) - 1);
+	if (ret < 0)
+		return;
+
+	target[ret] = '\0';
+
+	p = strrchr(target, '/');
+
+	if (snprintf(buf, len, "%s", p ? p + 1 : target) >= (int)len)
+		buf[0] = '\0';
+}
+
+static void pci_read_vfio_id(int dfd, char *buf, size_t len)
+{
+	struct dirent *dentry;
+	DIR *dp;
+	int fd;
+
+	buf[0] = '\0';
+
+	fd = openat(dfd, "vfio-dev", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	dp = fdopendir(fd);
+	if (!dp) {
+		log_fatal_if(close(fd), "close\n");
+		return;
+	}
+
+	while ((dentry = readdir(dp)) != NULL) {
+		if (strncmp("vfio", dentry->d_name, 4) == 0) {
+			if (snprintf(buf, len, "%s", dentry->d_name) >= (int)len)
+				buf[0] = '\0';
+
+			break;
+		}
+	}
+
+	log_fatal_if(closedir(dp), "closedir\n");
+}
+
+static int pci_scan_device(int dfd, struct pci_device_info *info)
+{
+	unsigned long long v;
+	char group[32];
+
+	if (pci_read_attr_ull(dfd, "vendor", &v))
+		return -1;
+
+	info->vendor = (uint16_t)v;
+
+	if (pci_read_attr_ull(dfd, "device", &v))
+		return -1;
+
+	info->device = (uint16_t)v;
+
+	if (!pci_read_attr_ull(dfd, "subsystem_vendor", &v))
+		info->subsystem_vendor = (uint16_t)v;
+
+	if (!pci_read_attr_ull(dfd, "subsystem_device", &v))
+		info->subsystem_device = (uint16_t)v;
+
+	info->numa_node = -1;
+	if (!pci_read_attr_ull(dfd, "numa_node", &v))
+		info->numa_node = (int)(long long)v;
+
+	if (pci_read_attr(dfd, "current_link_speed", info->link_speed,
+			  sizeof(info->link_speed)) < 0)
+		info->link_speed[0] = '\0';
+
+	if (!pci_read_attr_ull(dfd, "current_link_width", &v))
+		info->link_width = (int)v;
+
+	pci_read_link_name(dfd, "driver", info->driver, sizeof(info->driver));
+
+	pci_read_link_name(dfd, "iommu_group", group, sizeof(group));
+	if (group[0] && snprintf(info->iommu_group, sizeof(info->iommu_group), "/dev/vfio/%s",
+				 group) >= (int)sizeof(info->iommu_group))
+		info->iommu_group[0] = '\0';
+
+	pci_read_vfio_id(dfd, info->vfio_id, sizeof(info->vfio_id));
+
+	return 0;
+}
+
+static int pci_device_info_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pci_device_info *)a)->bdf,
+		      ((const struct pci_device_info *)b)->bdf);
+}
+
+/* scan the device directories in path (i.e., /sys/bus/pci/devices) */
+static int pci_topology_scan_dir(struct pci_topology *topo, const char *path, uint32_t class,
+				 uint32_t class_mask)
+{
+	struct pci_device_info *info;
+	struct dirent *dentry;
+	int cap = 0, dfd;
+	DIR *dp;
+
+	memset(topo, 0x0, sizeof(*topo));
+
+	dp = opendir(path);
+	if (!dp) {
+		log_debug("could not open %s\n", path);
+		return -1;
+	}
+
+	while ((dentry = readdir(dp)) != NULL) {
+		unsigned long long v;
+		size_t namelen = strlen(dentry->d_name);
+
+		if (dentry->d_name[0] == '.' || namelen >= sizeof(topo->devs[0].bdf))
+			continue;
+
+		dfd = openat(dirfd(dp), dentry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dfd < 0)
+			continue;
+
+		if (pci_read_attr_ull(dfd, "class", &v) || (v & class_mask) != (class & class_mask))
+			goto next;
+
+		if (topo->ndevs == cap) {
+			cap = cap ? cap << 1 : 16;
+			topo->devs = reallocn(topo->devs, cap, sizeof(*topo->devs));
+		}
+
+		info = &topo->devs[topo->ndevs];
+		memset(info, 0x0, sizeof(*info));
+
+		memcpy(info->bdf, dentry->d_name, namelen + 1);
+		info->class = (uint32_t)v;
+
+		if (pci_scan_device(dfd, info)) {
+			log_debug("could not read device %s; skipping\n", dentry->d_name);
+			goto next;
+		}
+
+		/* seed the resolution cache */
+		if (info->iommu_group[0])
+			pci_dev_cache_store(info->bdf,
+					    offsetof(struct pci_dev_cache_entry, iommu_group),
+					    info->iommu_group);
+
+		if (info->vfio_id[0])
+			pci_dev_cache_store(info->bdf,
+					    offsetof(struct pci_dev_cache_entry, vfio_id),
+					    info->vfio_id);
+
+		topo->ndevs++;
+next:
+		log_fatal_if(close(dfd), "close\n");
+	}
+
+	log_fatal_if(closedir(dp), "closedir\n");
+
+	if (topo->ndevs)
+		qsort(topo->devs, topo->ndevs, sizeof(*topo->devs), pci_device_info_cmp);
+
+	return 0;
+}
+
+int pci_topology_scan(struct pci_topology *topo, uint32_t class, uint32_t class_mask)
+{
+	return pci_topology_scan_dir(topo, "/sys/bus/pci/devices", class, class_mask);
+}
+
+const struct pci_device_info *pci_topology_find(const struct pci_topology *topo, const char *bdf)
+{
+	struct pci_device_info key;
+
+	/* devs is NULL */
+	if (!topo->ndevs)
+		return NULL;
+
+	if (snprintf(key.bdf, sizeof(key.bdf), "%s", bdf) >= (int)sizeof(key.bdf))
+		return NULL;
+
+	return bsearch(&key, topo->devs, topo->ndevs, sizeof(*topo->devs), pci_device_info_cmp);
+}
+
+void pci_topology_free(struct pci_topology *topo)
+{
+	free(topo->devs);
+
+	memset(topo, 0x0, sizeof(*topo));
+}
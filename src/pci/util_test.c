@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/str/str.h"
+#include "ccan/tap/tap.h"
+
+#include "util.c"
+
+/* deliberately not sorted by bdf */
+static const struct {
+	const char *bdf;
+	uint32_t class;
+	uint16_t vendor, device;
+} fixture[] = {
+	{"0000:03:00.0", 0x020000, 0x8086, 0x10d3},
+	{"0000:01:00.0", 0x010802, 0x1b36, 0x0010},
+	{"10000:01:00.0", 0x010802, 0x144d, 0xa80a},
+	{"0000:00:1f.2", 0x010601, 0x8086, 0x2922},
+	{"0000:0a:00.0", 0x010802, 0x1b36, 0x0010},
+	{"0000:00:00.0", 0x060000, 0x8086, 0x29c0},
+	{"0000:02:00.0", 0x010802, 0x144d, 0xa808},
+};
+
+static const char *attrs[] = {"class", "vendor", "device"};
+
+static char root[] = "/tmp/vfn-pci-XXXXXX";
+
+static void write_attr(int dfd, const char *name, unsigned int v)
+{
+	char buf[16];
+	int fd, len;
+
+	fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	assert(fd >= 0);
+
+	len = snprintf(buf, sizeof(buf), "0x%06x\n", v);
+	assert(write(fd, buf, (size_t)len) == len);
+
+	assert(close(fd) == 0);
+}
+
+static void fixture_create(void)
+{
+	assert(mkdtemp(root));
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(fixture); i++) {
+		__autofree char *path = NULL;
+		int dfd;
+
+		assert(asprintf(&path, "%s/%s", root, fixture[i].bdf) > 0);
+		assert(mkdir(path, 0755) == 0);
+
+		dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(dfd >= 0);
+
+		write_attr(dfd, "class", fixture[i].class);
+		write_attr(dfd, "vendor", fixture[i].vendor);
+		write_attr(dfd, "device", fixture[i].device);
+
+		assert(close(dfd) == 0);
+	}
+}
+
+static void fixture_destroy(void)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(fixture); i++) {
+		__autofree char *path = NULL;
+		int dfd;
+
+		assert(asprintf(&path, "%s/%s", root, fixture[i].bdf) > 0);
+
+		dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(dfd >= 0);
+
+		for (unsigned int j = 0; j < ARRAY_SIZE(attrs); j++)
+			assert(unlinkat(dfd, attrs[j], 0) == 0);
+
+		assert(close(dfd) == 0);
+		assert(rmdir(path) == 0);
+	}
+
+	assert(rmdir(root) == 0);
+}
+
+static bool all_found(struct pci_topology *topo)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(fixture); i++) {
+		const struct pci_device_info *info = pci_topology_find(topo, fixture[i].bdf);
+
+		if (!info || !streq(info->bdf, fixture[i].bdf) ||
+		    info->class != fixture[i].class || info->vendor != fixture[i].vendor ||
+		    info->device != fixture[i].device)
+			return false;
+	}
+
+	return true;
+}
+
+static bool sorted(struct pci_topology *topo)
+{
+	for (int i = 1; i < topo->ndevs; i++) {
+		if (strcmp(topo->devs[i - 1].bdf, topo->devs[i].bdf) >= 0)
+			return false;
+	}
+
+	return true;
+}
+
+int main(void)
+{
+	struct pci_topology topo;
+	bool match = true;
+
+	plan_tests(11);
+
+	fixture_create();
+
+	/* a zero mask matches all devices */
+	ok1(pci_topology_scan_dir(&topo, root, 0x0, 0x0) == 0 &&
+	    topo.ndevs == (int)ARRAY_SIZE(fixture));
+	ok1(sorted(&topo));
+
+	/* every device is found by bisection, including the first and last */
+	ok1(all_found(&topo));
+	ok1(!pci_topology_find(&topo, "0000:04:00.0") &&
+	    !pci_topology_find(&topo, "0000:00:00.00"));
+	ok1(!pci_topology_find(&topo, "0000:00:00.0-too-long-for-a-bdf"));
+
+	pci_topology_free(&topo);
+
+	ok1(topo.ndevs == 0 && !pci_topology_find(&topo, "0000:01:00.0"));
+
+	/* all nvme controllers */
+	ok1(pci_topology_scan_dir(&topo, root, 0x010800, 0xffff00) == 0 && topo.ndevs == 4 &&
+	    sorted(&topo));
+
+	for (int i = 0; i < topo.ndevs; i++)
+		match &= (topo.devs[i].class & 0xffff00) == 0x010800;
+
+	ok1(match && !pci_topology_find(&topo, "0000:00:1f.2"));
+
+	pci_topology_free(&topo);
+
+	/* an exact class code */
+	ok1(pci_topology_scan_dir(&topo, root, 0x010601, 0xffffff) == 0 && topo.ndevs == 1 &&
+	    pci_topology_find(&topo, "0000:00:1f.2"));
+
+	pci_topology_free(&topo);
+
+	/* no matches */
+	ok1(pci_topology_scan_dir(&topo, root, 0xffffff, 0xffffff) == 0 && topo.ndevs == 0 &&
+	    !pci_topology_find(&topo, "0000:00:1f.2"));
+
+	pci_topology_free(&topo);
+
+	fixture_destroy();
+
+	ok1(pci_topology_scan_dir(&topo, root, 0x0, 0x0) == -1 && topo.ndevs == 0);
+
+	return exit_status();
+}
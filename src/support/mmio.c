@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <byteswap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support/align.h"
+#include "vfn/support/barrier.h"
+#include "vfn/support/compiler.h"
+#include "vfn/support/endian.h"
+#include "vfn/support/mmio.h"
+
+#define WC_LINE_SIZE 64
+
+/*
+ * Copy the unaligned head and tail with naturally aligned stores; device
+ * memory mapped uncached (the fallback when write-combining is not available)
+ * does not tolerate unaligned accesses on all architectures.
+ */
+static void mmio_memcpy_small(void *dst, const void *src, size_t len)
+{
+	uint64_t v;
+
+	for (; len && !ALIGNED((uintptr_t)dst, sizeof(uint64_t)); len--)
+		*(volatile uint8_t *)dst++ = *(const uint8_t *)src++;
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		memcpy(&v, src, sizeof(v));
+
+#if defined(__x86_64__)
+		_mm_stream_si64(dst, (long long)v);
+#else
+		*(volatile uint64_t *)dst = v;
+#endif
+
+		dst += sizeof(uint64_t);
+		src += sizeof(uint64_t);
+	}
+
+	for (; len; len--)
+		*(volatile uint8_t *)dst++ = *(const uint8_t *)src++;
+}
+
+#if defined(__x86_64__)
+/* @dst is line aligned and @len is a multiple of the line size */
+__attribute__((target("avx")))
+static void mmio_memcpy_lines_avx(void *dst, const void *src, size_t len)
+{
+	for (; len; len -= WC_LINE_SIZE, dst += WC_LINE_SIZE, src += WC_LINE_SIZE) {
+		__m256i lo = _mm256_loadu_si256(src);
+		__m256i hi = _mm256_loadu_si256(src + 32);
+
+		_mm256_stream_si256(dst, lo);
+		_mm256_stream_si256(dst + 32, hi);
+	}
+}
+
+static void mmio_memcpy_lines_sse2(void *dst, const void *src, size_t len)
+{
+	for (; len; len -= WC_LINE_SIZE, dst += WC_LINE_SIZE, src += WC_LINE_SIZE) {
+		__m128i v0 = _mm_loadu_si128(src);
+		__m128i v1 = _mm_loadu_si128(src + 16);
+		__m128i v2 = _mm_loadu_si128(src + 32);
+		__m128i v3 = _mm_loadu_si128(src + 48);
+
+		_mm_stream_si128(dst, v0);
+		_mm_stream_si128(dst + 16, v1);
+		_mm_stream_si128(dst + 32, v2);
+		_mm_stream_si128(dst + 48, v3);
+	}
+}
+
+static void mmio_memcpy_lines(void *dst, const void *src, size_t len)
+{
+	if (cpu_supports("avx"))
+		mmio_memcpy_lines_avx(dst, src, len);
+	else
+		mmio_memcpy_lines_sse2(dst, src, len);
+}
+#else
+static void mmio_memcpy_lines(void *dst, const void *src, size_t len)
+{
+	for (; len; len -= sizeof(uint64_t), dst += sizeof(uint64_t), src += sizeof(uint64_t)) {
+		uint64_t v;
+
+		memcpy(&v, src, sizeof(v));
+
+		*(volatile uint64_t *)dst = v;
+	}
+}
+#endif
+
+void mmio_memcpy_wc(void *dst, const void *src, size_t len)
+{
+	size_t head, body;
+
+	head = min_t(size_t, len, ALIGN_UP((uintptr_t)dst, WC_LINE_SIZE) - (uintptr_t)dst);
+	body = ALIGN_DOWN(len - head, WC_LINE_SIZE);
+
+	mmio_memcpy_small(dst, src, head);
+	mmio_memcpy_lines(dst + head, src + head, body);
+	mmio_memcpy_small(dst + head + body, src + head + body, len - head - body);
+
+	/* non-temporal and write-combined stores are weakly ordered */
+	wmb();
+}
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <byteswap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/endian.h"
+#include "vfn/support/mmio.h"
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/tap/tap.h"
+
+#define BUF_SIZE 512
+
+static uint8_t src[BUF_SIZE], dst[BUF_SIZE + 64] __attribute__((aligned(64)));
+
+/* copy @len bytes to @dst + @off and check that nothing else was touched */
+static bool check_copy(size_t off, size_t len)
+{
+	memset(dst, 0x0, sizeof(dst));
+
+	mmio_memcpy_wc(dst + off, src, len);
+
+	for (size_t i = 0; i < sizeof(dst); i++) {
+		uint8_t expect = (i >= off && i < off + len) ? src[i - off] : 0x0;
+
+		if (dst[i] != expect)
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	const size_t offs[] = {0, 1, 7, 8, 31, 63};
+	const size_t lens[] = {0, 1, 7, 8, 63, 64, 65, 128, 200, BUF_SIZE};
+
+	plan_tests(ARRAY_SIZE(offs));
+
+	for (size_t i = 0; i < BUF_SIZE; i++)
+		src[i] = (uint8_t)(i * 7 + 1);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(offs); i++) {
+		bool good = true;
+
+		for (unsigned int j = 0; j < ARRAY_SIZE(lens); j++)
+			good &= check_copy(offs[i], lens[j]);
+
+		ok(good, "copy to offset %zu", offs[i]);
+	}
+
+	return exit_status();
+}
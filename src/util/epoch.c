@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "vfn/support.h"
+
+#include "epoch.h"
+
+/*
+ * Each thread that has entered a read-side section owns a reader record on
+ * its own cache line, so readers never write to shared memory. The record
+ * holds the global epoch observed when the outermost section was entered, or
+ * zero if the thread is not in a read-side section.
+ */
+struct epoch_reader {
+	uint64_t epoch;
+	unsigned int nesting;
+
+	struct epoch_reader *next;
+} __attribute__((aligned(64)));
+
+static uint64_t epoch_global = 1;
+
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_reader *epoch_readers;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static __thread struct epoch_reader *epoch_self;
+
+static void epoch_unregister(void *opaque)
+{
+	__autolock(&epoch_lock);
+
+	struct epoch_reader **pp, *r = opaque;
+
+	for (pp = &epoch_readers; *pp; pp = &(*pp)->next) {
+		if (*pp == r) {
+			*pp = r->next;
+			break;
+		}
+	}
+
+	free(r);
+}
+
+static void epoch_init_key(void)
+{
+	if (pthread_key_create(&epoch_key, epoch_unregister))
+		backtrace_abort();
+}
+
+static struct epoch_reader *epoch_register(void)
+{
+	struct epoch_reader *r = NULL;
+
+	pthread_once(&epoch_once, epoch_init_key);
+
+	if (posix_memalign((void **)&r, sizeof(*r), sizeof(*r)))
+		backtrace_abort();
+
+	memset(r, 0x0, sizeof(*r));
+
+	/* unregister on thread exit */
+	if (pthread_setspecific(epoch_key, r))
+		backtrace_abort();
+
+	pthread_mutex_lock(&epoch_lock);
+
+	r->next = epoch_readers;
+	epoch_readers = r;
+
+	pthread_mutex_unlock(&epoch_lock);
+
+	epoch_self = r;
+
+	return r;
+}
+
+void epoch_enter(void)
+{
+	struct epoch_reader *r = epoch_self;
+
+	if (unlikely(!r))
+		r = epoch_register();
+
+	if (r->nesting++)
+		return;
+
+	__atomic_store_n(&r->epoch, atomic_load_acquire(&epoch_global), __ATOMIC_RELAXED);
+
+	/* order the announcement before any loads from the protected structure */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+	struct epoch_reader *r = epoch_self;
+
+	if (--r->nesting)
+		return;
+
+	atomic_store_release(&r->epoch, 0);
+}
+
+void epoch_synchronize(void)
+{
+	__autolock(&epoch_lock);
+
+	struct epoch_reader *r;
+	uint64_t epoch;
+
+	/* order the unlinking stores before loading the reader epochs */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	epoch = atomic_inc_fetch(&epoch_global);
+
+	/*
+	 * Readers that enter after the increment cannot observe unlinked
+	 * elements; wait for those that entered before it.
+	 */
+	for (r = epoch_readers; r; r = r->next) {
+		uint64_t e;
+
+		while ((e = atomic_load_acquire(&r->epoch)) && e < epoch)
+			sched_yield();
+	}
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Epoch based reclamation
+ *
+ * Readers bracket lock-free accesses to a shared structure with epoch_enter()
+ * and epoch_exit(); read-side sections may nest. Writers (serialized by other
+ * means) unlink elements and call epoch_synchronize() before freeing them.
+ * epoch_synchronize() returns once every reader that might still hold a
+ * reference to an unlinked element has left its read-side section, and must
+ * not be called from within a read-side section.
+ */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_synchronize(void);
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ccan/tap/tap.h"
+
+#include "epoch.c"
+
+static bool entered, left;
+
+static void *reader(void *opaque UNUSED)
+{
+	epoch_enter();
+
+	atomic_store_release(&entered, true);
+
+	/* give the writer a chance to (incorrectly) return early */
+	usleep(100000);
+
+	atomic_store_release(&left, true);
+
+	epoch_exit();
+
+	return NULL;
+}
+
+static int nreaders(void)
+{
+	__autolock(&epoch_lock);
+
+	int n = 0;
+
+	for (struct epoch_reader *r = epoch_readers; r; r = r->next)
+		n++;
+
+	return n;
+}
+
+int main(void)
+{
+	pthread_t thread;
+
+	plan_tests(4);
+
+	/* nested read-side sections */
+	epoch_enter();
+	epoch_enter();
+	epoch_exit();
+
+	ok1(epoch_self->epoch != 0);
+
+	epoch_exit();
+
+	ok1(epoch_self->epoch == 0);
+
+	/* synchronize waits for readers that entered before it */
+	pthread_create(&thread, NULL, reader, NULL);
+
+	while (!atomic_load_acquire(&entered))
+		;
+
+	epoch_synchronize();
+
+	ok1(atomic_load_acquire(&left));
+
+	pthread_join(thread, NULL);
+
+	/* reader records are released on thread exit */
+	ok1(nreaders() == 1);
+
+	return exit_status();
+}
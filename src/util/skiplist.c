@@ -10,54 +10,127 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support.h"
 
 #include "skiplist.h"
 
+#define SKIPLIST_ALIGN 64
+
+/*
+ * Lookups may run concurrently with a (single) writer; see skiplist_find().
+ * Writers publish new forward pointers with release semantics and lookups
+ * load them with acquire semantics.
+ */
+static inline struct skiplist_node *__skiplist_next(struct skiplist_node **tower, int k)
+{
+	return atomic_load_acquire(&tower[k]);
+}
+
+/* xorshift64 */
+static inline uint64_t __skiplist_rand(struct skiplist *list)
+{
+	uint64_t x = list->rng;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return list->rng = x;
+}
+
+/*
+ * Promote with probability 1/4; this keeps the expected tower at 4/3 pointers
+ * per node at the cost of a few more comparisons per level.
+ */
+static inline int __skiplist_random_height(struct skiplist *list)
+{
+	int height = 1 + __builtin_ctzll(__skiplist_rand(list) | (1ULL << 63)) / 2;
+
+	return min_t(int, height, SKIPLIST_LEVELS);
+}
+
+void *__skiplist_new(struct skiplist *list, size_t offset)
+{
+	int height = __skiplist_random_height(list);
+	size_t size = offset + sizeof(struct skiplist_node) +
+		(size_t)height * sizeof(struct skiplist_node *);
+	struct skiplist_node *n;
+	void *mem = NULL;
+
+	if (posix_memalign(&mem, SKIPLIST_ALIGN, ALIGN_UP(size, SKIPLIST_ALIGN)))
+		backtrace_abort();
+
+	memset(mem, 0x0, size);
+
+	n = mem + offset;
+	n->height = height;
+
+	return mem;
+}
+
 void skiplist_init(struct skiplist *list)
 {
-	list->height = 0;
+	memset(list, 0x0, sizeof(*list));
 
-	for (int k = 0; k < SKIPLIST_LEVELS; k++) {
-		list_head_init(&list->heads[k]);
-		skiplist_add(list, &list->sentinel, k);
-	}
+	/* any nonzero seed will do */
+	list->rng = (uintptr_t)list | 0x1;
 }
 
 void skiplist_clear_with(struct skiplist *list, skiplist_iter_fn fn, void *opaque)
 {
 	struct skiplist_node *n, *next;
-	int k = list->height;
 
-	do {
-		skiplist_for_each_safe(list, n, next, k) {
-			if (n == NULL || n == &list->sentinel)
-				continue;
+	n = list->heads[0];
 
-			skiplist_del_from(list, n, k);
+	/*
+	 * Unlink everything from the heads; the forward pointers of the nodes
+	 * are left intact for concurrent lookups that may still be traversing
+	 * them.
+	 */
+	for (int k = list->height - 1; k >= 0; k--)
+		atomic_store_release(&list->heads[k], NULL);
 
-			if (k == 0 && fn)
-				fn(opaque, n);
-		}
-	} while (--k >= 0);
+	atomic_store_release(&list->height, 0);
+
+	for (; n; n = next) {
+		next = n->next[0];
 
-	list->height = 0;
+		if (fn)
+			fn(opaque, n);
+	}
 }
 
 struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 				    int (*cmp)(const void *key, const struct skiplist_node *n),
-				    struct skiplist_node **path)
+				    skiplist_path_t path)
 {
-	struct skiplist_node *next, *p = &list->sentinel;
-	int k = list->height;
+	struct skiplist_node **tower = list->heads, *next = NULL;
+	int k = atomic_load_acquire(&list->height);
+
+	/* levels above the current height start at the heads */
+	if (path) {
+		for (int l = k; l < SKIPLIST_LEVELS; l++)
+			path[l] = list->heads;
+	}
 
-	do {
-		next = skiplist_next(list, p, k);
+	while (--k >= 0) {
+		next = __skiplist_next(tower, k);
 
 		/* advance at this level as long as key is larger than next */
 		while (next && cmp(key, next) > 0) {
-			p = next;
-			next = skiplist_next(list, p, k);
+			tower = next->next;
+			next = __skiplist_next(tower, k);
 		}
 
 		/*
@@ -67,8 +140,8 @@ struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 		 * Drop down a level, and record the node where we did so.
 		 */
 		if (path)
-			path[k] = p;
-	} while (--k >= 0);
+			path[k] = tower;
+	}
 
 	/* at this point we are at level zero; check if we have a winner */
 	if (next && cmp(key, next) == 0)
@@ -77,49 +150,33 @@ struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 	return NULL;
 }
 
-static inline int __skiplist_random_level(void)
+void skiplist_link(struct skiplist *list, struct skiplist_node *n, skiplist_path_t update)
 {
-	int k = 0;
-
-	while (k < SKIPLIST_LEVELS - 1 && (rand() > (RAND_MAX / 2)))
-		k++;
-
-	return k;
-}
-
-#define SKIPLIST_RANDOM_LEVEL __skiplist_random_level()
-
-void skiplist_link(struct skiplist *list, struct skiplist_node *n,
-		   struct skiplist_node *update[SKIPLIST_LEVELS])
-{
-	int k = SKIPLIST_RANDOM_LEVEL;
-
-	if (k > list->height) {
-		/* increase the height of the skiplist */
-		k = ++(list->height);
-
-		/* new level k; insert new node after the sentinel */
-		update[k] = &list->sentinel;
+	/*
+	 * Link bottom-up, such that a concurrent lookup that finds the node at
+	 * some level also finds it at all the levels below.
+	 */
+	for (int k = 0; k < n->height; k++) {
+		n->next[k] = update[k][k];
+		atomic_store_release(&update[k][k], n);
 	}
 
-	do {
-		skiplist_add_after(list, update[k], n, k);
-	} while (--k >= 0);
+	if (n->height > list->height)
+		atomic_store_release(&list->height, n->height);
 }
 
-void skiplist_erase(struct skiplist *list, struct skiplist_node *n,
-		    struct skiplist_node *update[SKIPLIST_LEVELS])
+void skiplist_erase(struct skiplist *list, struct skiplist_node *n, skiplist_path_t update)
 {
-	for (int k = 0; k <= list->height; k++) {
-		struct skiplist_node *next = skiplist_next(list, update[k], k);
-
-		if (next != n)
-			break;
-
-		skiplist_del_from(list, n, k);
+	/*
+	 * Unlink top-down, leaving the forward pointers of n intact; concurrent
+	 * lookups may still be standing on it.
+	 */
+	for (int k = n->height - 1; k >= 0; k--) {
+		if (update[k][k] == n)
+			atomic_store_release(&update[k][k], n->next[k]);
 	}
 
 	/* reduce height if possible */
-	while (list->height && skiplist_next(list, &list->sentinel, list->height) == NULL)
-		list->height--;
+	while (list->height && !list->heads[list->height - 1])
+		atomic_store_release(&list->height, list->height - 1);
 }
@@ -10,51 +10,79 @@
  * COPYING and LICENSE files for more information.
  */
 
-#include "ccan/list/list.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ccan/container_of/container_of.h"
 
 #ifndef SKIPLIST_LEVELS
-#define SKIPLIST_LEVELS 8
+#define SKIPLIST_LEVELS 12
 #endif
 
-#define skiplist_top(h, t, k) \
-	list_top(&(h)->heads[k], t, list[k])
-
-#define skiplist_next(h, n, k) \
-	list_next(&(h)->heads[k], (n), list[k])
-
-#define skiplist_add_after(h, p, n, k) \
-	list_add_after(&(h)->heads[k], &(p)->list[k], &(n)->list[k])
-
-#define skiplist_add(h, n, k) \
-	list_add(&(h)->heads[k], &(n)->list[k])
-
-#define skiplist_del_from(h, n, k) \
-	list_del_from(&(h)->heads[k], &(n)->list[k])
-
-#define skiplist_for_each_safe(h, n, next, k) \
-	list_for_each_safe(&(h)->heads[k], n, next, list[k])
-
+/*
+ * Nodes have variable height and only forward pointers; the tower must be the
+ * last member of the containing structure, which must be allocated with
+ * skiplist_new() such that the tower is sized to the height of the node.
+ */
 struct skiplist_node {
-	struct list_node list[SKIPLIST_LEVELS];
+	int height;
+	struct skiplist_node *next[];
 };
 
 #define skiplist_entry(ptr, type, member) container_of(ptr, type, member)
 
+#define skiplist_for_each(list, n, k) \
+	for (n = (list)->heads[k]; n; n = n->next[k])
+
 struct skiplist {
 	int height;
-	struct skiplist_node sentinel;
-	struct list_head heads[SKIPLIST_LEVELS];
+	uint64_t rng;
+	struct skiplist_node *heads[SKIPLIST_LEVELS];
 };
 
 typedef void (*skiplist_iter_fn)(void *opaque, struct skiplist_node *n);
 
+/*
+ * A path records, for each level, the tower (that is, &node->next[0] or
+ * list->heads) of the node preceding the position of a key.
+ */
+typedef struct skiplist_node **skiplist_path_t[SKIPLIST_LEVELS];
+
+/* the node preceding the position recorded in path (or NULL) */
+static inline struct skiplist_node *skiplist_path_prev(struct skiplist *list,
+						       skiplist_path_t path)
+{
+	if (path[0] == list->heads)
+		return NULL;
+
+	return container_of(path[0], struct skiplist_node, next[0]);
+}
+
+/* the node following the position recorded in path (or NULL) */
+static inline struct skiplist_node *skiplist_path_next(skiplist_path_t path)
+{
+	return path[0][0];
+}
+
+void *__skiplist_new(struct skiplist *list, size_t offset);
 
+/*
+ * Allocate a zeroed, cache line aligned instance of type with a tower of
+ * random height at member. Release with free().
+ */
+#define skiplist_new(list, type, member) \
+	((type *)__skiplist_new(list, offsetof(type, member)))
+
+/*
+ * Writers (skiplist_link(), skiplist_erase() and skiplist_clear_with()) must be
+ * serialized, but skiplist_find() without a path may run concurrently with
+ * them. Unlinked nodes may be observed by such lookups until they complete, so
+ * must not be freed before that (see util/epoch.h).
+ */
 void skiplist_init(struct skiplist *list);
 void skiplist_clear_with(struct skiplist *list, skiplist_iter_fn fn, void *opaque);
 struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 				    int (*cmp)(const void *key, const struct skiplist_node *n),
-				    struct skiplist_node **path);
-void skiplist_link(struct skiplist *list, struct skiplist_node *n,
-		   struct skiplist_node *update[SKIPLIST_LEVELS]);
-void skiplist_erase(struct skiplist *list, struct skiplist_node *n,
-		    struct skiplist_node *update[SKIPLIST_LEVELS]);
+				    skiplist_path_t path);
+void skiplist_link(struct skiplist *list, struct skiplist_node *n, skiplist_path_t update);
+void skiplist_erase(struct skiplist *list, struct skiplist_node *n, skiplist_path_t update);
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/mem.h"
+
+#include "skiplist.c"
+
+#define BENCH_ENTRIES (1 << 20)
+
+static struct skiplist list;
+
+struct entry {
+	unsigned int v;
+
+	struct skiplist_node list;
+};
+
+static int __cmp(const void *key, const struct skiplist_node *n)
+{
+	struct entry *e = container_of_var(n, e, list);
+	const unsigned int *v = key;
+
+	if (*v < e->v)
+		return -1;
+	else if (*v > e->v)
+		return 1;
+
+	return 0;
+}
+
+static bool add(unsigned int v)
+{
+	skiplist_path_t update = {};
+	struct entry *e;
+
+	if (skiplist_find(&list, &v, __cmp, update))
+		return false;
+
+	e = skiplist_new(&list, struct entry, list);
+	e->v = v;
+
+	skiplist_link(&list, &e->list, update);
+
+	return true;
+}
+
+static void __clear(void *opaque UNUSED, struct skiplist_node *n)
+{
+	free(skiplist_entry(n, struct entry, list));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* multiplication by an odd constant permutes the keys */
+static unsigned int bench_key(unsigned int i, unsigned int mul)
+{
+	return i * mul;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	unsigned int i, nadded = 0, nfound = 0;
+	uint64_t t;
+
+	skiplist_init(&list);
+
+	t = now_ns();
+
+	for (i = 0; i < BENCH_ENTRIES; i++)
+		nadded += add(bench_key(i, 0x9e3779b1));
+
+	t = now_ns() - t;
+
+	printf("insert: %u entries, %.1f ns/op\n", BENCH_ENTRIES, (double)t / BENCH_ENTRIES);
+
+	t = now_ns();
+
+	for (i = 0; i < BENCH_ENTRIES; i++) {
+		unsigned int v = bench_key(bench_key(i, 0x85ebca6b) & (BENCH_ENTRIES - 1), 0x9e3779b1);
+
+		nfound += skiplist_find(&list, &v, __cmp, NULL) != NULL;
+	}
+
+	t = now_ns() - t;
+
+	printf("lookup: %u entries, %.1f ns/op\n", BENCH_ENTRIES, (double)t / BENCH_ENTRIES);
+
+	skiplist_clear_with(&list, __clear, NULL);
+
+	if (nadded != BENCH_ENTRIES || nfound != BENCH_ENTRIES) {
+		fprintf(stderr, "inserted %u and found %u of %u entries\n", nadded, nfound,
+			BENCH_ENTRIES);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -54,14 +54,15 @@ static int __cmp(const void *key, const struct skiplist_node *n)
 
 static bool add(unsigned int v)
 {
-	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
-	struct entry *e = znew_t(struct entry, 1);
-
-	e->v = v;
+	skiplist_path_t update = {};
+	struct entry *e;
 
 	if (skiplist_find(&list, &v, __cmp, update))
 		return false;
 
+	e = skiplist_new(&list, struct entry, list);
+	e->v = v;
+
 	skiplist_link(&list, &e->list, update);
 
 	return true;
@@ -69,20 +70,13 @@ static bool add(unsigned int v)
 
 static UNNEEDED void skiplist_print(struct skiplist *list)
 {
-	struct skiplist_node *n, *next;
+	struct skiplist_node *n;
 
-	for (int k = list->height; k >= 0; k--) {
+	for (int k = list->height - 1; k >= 0; k--) {
 		printf("LEVEL %d: ", k);
 
-		skiplist_for_each_safe(list, n, next, k) {
-
-			if (n == &list->sentinel) {
-				printf("SENTINEL ");
-				continue;
-			}
-
+		skiplist_for_each(list, n, k)
 			printf("NODE(%d) ", skiplist_entry(n, struct entry, list)->v);
-		}
 
 		printf("\n");
 	}
@@ -95,7 +89,8 @@ static void __clear(void *opaque UNUSED, struct skiplist_node *n)
 
 int main(int argc UNUSED, char *argv[] UNUSED)
 {
-	struct skiplist_node *n, *update[SKIPLIST_LEVELS];
+	struct skiplist_node *n;
+	skiplist_path_t update;
 	unsigned int v;
 
 	plan_tests(21);
@@ -152,5 +147,7 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 
 	ok(skiplist_find(&list, &v, __cmp, NULL) == NULL, "find 0 not ok");
 
+	skiplist_clear_with(&list, __clear, NULL);
+
 	return exit_status();
 }
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "ccan/str/str.h"
+
+#include "vfn/support.h"
+
+#include "strmap.h"
+
+#define STRMAP_MIN_BUCKETS 16
+
+/* 64-bit fnv-1a */
+static uint64_t strmap_hash(const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static inline struct strmap_node **strmap_bucket(struct strmap *map, uint64_t hash)
+{
+	return &map->buckets[hash & (map->nbuckets - 1)];
+}
+
+static void strmap_resize(struct strmap *map, unsigned int nbuckets)
+{
+	struct strmap_node **old = map->buckets, *n, *next;
+	unsigned int nold = map->nbuckets;
+
+	map->buckets = znew_t(struct strmap_node *, nbuckets);
+	map->nbuckets = nbuckets;
+
+	for (unsigned int i = 0; i < nold; i++) {
+		for (n = old[i]; n; n = next) {
+			struct strmap_node **b = strmap_bucket(map, n->hash);
+
+			next = n->next;
+
+			n->next = *b;
+			*b = n;
+		}
+	}
+
+	free(old);
+}
+
+struct strmap_node *strmap_find(struct strmap *map, const char *key)
+{
+	struct strmap_node *n;
+	uint64_t hash;
+
+	if (!map->n)
+		return NULL;
+
+	hash = strmap_hash(key);
+
+	for (n = *strmap_bucket(map, hash); n; n = n->next) {
+		if (n->hash == hash && streq(n->key, key))
+			return n;
+	}
+
+	return NULL;
+}
+
+void strmap_add(struct strmap *map, struct strmap_node *n, const char *key)
+{
+	struct strmap_node **b;
+
+	if (map->n >= map->nbuckets)
+		strmap_resize(map, map->nbuckets ? map->nbuckets << 1 : STRMAP_MIN_BUCKETS);
+
+	n->key = key;
+	n->hash = strmap_hash(key);
+
+	b = strmap_bucket(map, n->hash);
+
+	n->next = *b;
+	*b = n;
+
+	map->n++;
+}
+
+void strmap_del(struct strmap *map, struct strmap_node *n)
+{
+	struct strmap_node **pp;
+
+	for (pp = strmap_bucket(map, n->hash); *pp; pp = &(*pp)->next) {
+		if (*pp == n) {
+			*pp = n->next;
+			map->n--;
+
+			return;
+		}
+	}
+}
+
+void strmap_destroy(struct strmap *map)
+{
+	free(map->buckets);
+
+	map->buckets = NULL;
+	map->nbuckets = map->n = 0;
+}
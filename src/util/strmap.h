@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ccan/container_of/container_of.h"
+
+/*
+ * Hash map keyed by strings
+ *
+ * Nodes are embedded in the containing structure and chained in a power of two
+ * number of buckets; the table doubles when the load factor exceeds one. The
+ * key is owned by the containing structure and must not change while the node
+ * is in the map. A zeroed map is an empty map. The map is not thread-safe.
+ */
+struct strmap_node {
+	const char *key;
+	uint64_t hash;
+
+	struct strmap_node *next;
+};
+
+#define strmap_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define strmap_for_each(map, n, i) \
+	for (i = 0; i < (map)->nbuckets; i++) \
+		for (n = (map)->buckets[i]; n; n = n->next)
+
+struct strmap {
+	struct strmap_node **buckets;
+	unsigned int nbuckets, n;
+};
+
+/* find the node with the given key (or NULL) */
+struct strmap_node *strmap_find(struct strmap *map, const char *key);
+
+/* add a node; the key must not be in the map already */
+void strmap_add(struct strmap *map, struct strmap_node *n, const char *key);
+
+void strmap_del(struct strmap *map, struct strmap_node *n);
+
+/* release the buckets; the nodes are not touched */
+void strmap_destroy(struct strmap *map);
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/tap/tap.h"
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/mem.h"
+
+#include "strmap.c"
+
+#define NR_ENTRIES 1000
+
+struct entry {
+	char key[32];
+	unsigned int v;
+
+	struct strmap_node node;
+};
+
+static struct strmap map;
+static struct entry entries[NR_ENTRIES];
+
+static struct entry *find(const char *key)
+{
+	struct strmap_node *n = strmap_find(&map, key);
+
+	return n ? strmap_entry(n, struct entry, node) : NULL;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	struct strmap_node *n;
+	struct entry *e;
+	unsigned int i, cnt;
+	bool found;
+
+	plan_tests(10);
+
+	ok(find("/dev/vfio/0") == NULL, "find in empty map");
+
+	for (i = 0; i < NR_ENTRIES; i++) {
+		snprintf(entries[i].key, sizeof(entries[i].key), "/dev/vfio/%u", i);
+		entries[i].v = i;
+
+		strmap_add(&map, &entries[i].node, entries[i].key);
+	}
+
+	ok(map.n == NR_ENTRIES, "map has %d entries", NR_ENTRIES);
+	ok(map.nbuckets >= NR_ENTRIES, "map has grown");
+
+	found = true;
+	for (i = 0; i < NR_ENTRIES; i++) {
+		e = find(entries[i].key);
+		if (!e || e->v != i)
+			found = false;
+	}
+
+	ok(found, "find all");
+
+	cnt = 0;
+	strmap_for_each(&map, n, i)
+		cnt++;
+
+	ok(cnt == NR_ENTRIES, "iterate all");
+
+	ok(find("/dev/vfio/1000") == NULL, "find missing key");
+
+	e = find("/dev/vfio/42");
+	ok(e && e->v == 42, "find /dev/vfio/42");
+
+	strmap_del(&map, &e->node);
+
+	ok(find("/dev/vfio/42") == NULL, "find deleted key");
+	ok(map.n == NR_ENTRIES - 1, "map has one less entry");
+
+	strmap_destroy(&map);
+
+	ok(find("/dev/vfio/0") == NULL, "find in destroyed map");
+
+	return exit_status();
+}
@@ -40,7 +40,7 @@
 #include "ccan/minmax/minmax.h"
 #include "ccan/str/str.h"
 
-int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
+static int __vfio_set_irq(struct vfio_device *dev, int *eventfds, int start, int count)
 {
 	struct vfio_irq_set *irq_set;
 	size_t irq_set_size;
@@ -59,7 +59,7 @@ int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
 		.argsz = (uint32_t)irq_set_size,
 		.flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
 		.index = dev->irq_info.index,
-		.start = 0,
+		.start = start,
 		.count = count,
 	};
 
@@ -76,7 +76,7 @@ int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
 	return 0;
 }
 
-int vfio_disable_irq(struct vfio_device *dev)
+static int __vfio_disable_irq(struct vfio_device *dev)
 {
 	struct vfio_irq_set irq_set;
 	int ret;
@@ -97,6 +97,103 @@ int vfio_disable_irq(struct vfio_device *dev)
 	return 0;
 }
 
+/* irq lock must be held */
+static void __vfio_irq_init_eventfds(struct vfio_device *dev)
+{
+	if (dev->irq.eventfds)
+		return;
+
+	dev->irq.eventfds = new_t(int, dev->irq_info.count);
+
+	for (unsigned int i = 0; i < dev->irq_info.count; i++)
+		dev->irq.eventfds[i] = -1;
+}
+
+int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
+{
+	__autolock(&dev->irq.lock);
+
+	if (count < 0 || (unsigned int)count > dev->irq_info.count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__vfio_set_irq(dev, eventfds, 0, count))
+		return -1;
+
+	__vfio_irq_init_eventfds(dev);
+
+	memcpy(dev->irq.eventfds, eventfds, sizeof(int) * count);
+	dev->irq.nvec = max_t(int, dev->irq.nvec, count);
+
+	return 0;
+}
+
+int vfio_set_irq_vector(struct vfio_device *dev, int vector, int eventfd)
+{
+	__autolock(&dev->irq.lock);
+
+	int old;
+
+	if (vector < 0 || (unsigned int)vector >= dev->irq_info.count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__vfio_irq_init_eventfds(dev);
+
+	old = dev->irq.eventfds[vector];
+	dev->irq.eventfds[vector] = eventfd;
+
+	/* vectors beyond those enabled are disabled already */
+	if (eventfd < 0 && vector >= dev->irq.nvec)
+		return 0;
+
+	if (vector < dev->irq.nvec || !dev->irq.nvec ||
+	    !(dev->irq_info.flags & VFIO_IRQ_INFO_NORESIZE)) {
+		if (__vfio_set_irq(dev, &eventfd, vector, 1))
+			goto restore;
+	} else {
+		/* the set of enabled vectors cannot grow in place; enable them again */
+		if (__vfio_disable_irq(dev))
+			goto restore;
+
+		if (__vfio_set_irq(dev, dev->irq.eventfds, 0, vector + 1)) {
+			dev->irq.eventfds[vector] = old;
+
+			log_fatal_if(__vfio_set_irq(dev, dev->irq.eventfds, 0, dev->irq.nvec),
+				     "could not restore irqs\n");
+
+			return -1;
+		}
+	}
+
+	dev->irq.nvec = max_t(int, dev->irq.nvec, vector + 1);
+
+	return 0;
+
+restore:
+	dev->irq.eventfds[vector] = old;
+
+	return -1;
+}
+
+int vfio_disable_irq(struct vfio_device *dev)
+{
+	__autolock(&dev->irq.lock);
+
+	if (__vfio_disable_irq(dev))
+		return -1;
+
+	/* reallocated when a vector is enabled again */
+	free(dev->irq.eventfds);
+	dev->irq.eventfds = NULL;
+
+	dev->irq.nvec = 0;
+
+	return 0;
+}
+
 int vfio_reset(struct vfio_device *dev)
 {
 	if (!(dev->device_info.flags & VFIO_DEVICE_FLAGS_RESET)) {
@@ -106,6 +106,8 @@ static int vfio_pci_init_irq(struct vfio_pci_device *pci)
 
 	log_info("irq_info.count %d\n", pci->dev.irq_info.count);
 
+	pthread_mutex_init(&pci->dev.irq.lock, NULL);
+
 	return 0;
 }
 
@@ -128,6 +130,49 @@ void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_
 	return mem;
 }
 
+void *vfio_pci_map_bar_wc(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
+			  int prot)
+{
+	__autofree char *path = NULL;
+	void *mem;
+	int fd;
+
+	assert(idx < PCI_STD_NUM_BARS);
+
+	/*
+	 * vfio-pci always maps BARs uncached; the write-combining resource
+	 * file is only created by the pci core for prefetchable memory BARs.
+	 */
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/resource%d_wc", pci->bdf, idx) < 0) {
+		path = NULL;
+		return NULL;
+	}
+
+	fd = open(path, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		log_info("no write-combining mapping of bar %d (%s); mapping uncached\n", idx,
+			 strerror(errno));
+
+		return vfio_pci_map_bar(pci, idx, len, offset, prot);
+	}
+
+	len = min_t(size_t, len, pci->bar_region_info[idx].size - offset);
+
+	mem = mmap(NULL, len, prot, MAP_SHARED, fd, (off_t)offset);
+
+	log_fatal_if(close(fd), "close\n");
+
+	/* e.g., with CONFIG_IO_STRICT_DEVMEM while the device is bound to vfio-pci */
+	if (mem == MAP_FAILED) {
+		log_info("could not map bar %d write-combining (%s); mapping uncached\n", idx,
+			 strerror(errno));
+
+		return vfio_pci_map_bar(pci, idx, len, offset, prot);
+	}
+
+	return mem;
+}
+
 void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t len,
 			uint64_t offset)
 {
@@ -139,6 +184,150 @@ void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t
 		log_debug("failed to unmap bar region\n");
 }
 
+void *iommu_map_bar(struct iommu_ctx *ctx, struct vfio_pci_device *pci, int bar, uint64_t offset,
+		    size_t len, uint64_t *iova)
+{
+	void *mem;
+
+	assert(bar < PCI_STD_NUM_BARS);
+
+	if (!len || !ALIGNED(offset, __VFN_PAGESIZE) || !ALIGNED(len, __VFN_PAGESIZE) ||
+	    offset + len > pci->bar_region_info[bar].size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(pci->bar_region_info[bar].flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+		log_debug("bar %d does not support mmap\n", bar);
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * Map through the vfio device fd, which the backend can resolve to the
+	 * device memory; a write-combining view for cpu copies must be mapped
+	 * separately (see vfio_pci_map_bar_wc()).
+	 */
+	mem = vfio_pci_map_bar(pci, bar, len, offset, PROT_READ | PROT_WRITE);
+	if (!mem)
+		return NULL;
+
+	/*
+	 * The vfio type1 backend resolves the pfns of the (device) memory
+	 * backing the mapping; this is how peer devices reach each other.
+	 */
+	if (iommu_map_vaddr(ctx, mem, len, iova, 0x0)) {
+		log_debug("failed to map bar %d of %s: %s\n", bar, pci->bdf, strerror(errno));
+
+		/* pinning device memory through a user address is not supported */
+		if (errno == EFAULT)
+			errno = EOPNOTSUPP;
+
+		vfio_pci_unmap_bar(pci, bar, mem, len, offset);
+
+		return NULL;
+	}
+
+	return mem;
+}
+
+void iommu_unmap_bar(struct iommu_ctx *ctx, struct vfio_pci_device *pci, int bar, void *mem,
+		     uint64_t offset, size_t len)
+{
+	log_fatal_if(iommu_unmap_vaddr(ctx, mem, NULL), "iommu_unmap_vaddr\n");
+
+	vfio_pci_unmap_bar(pci, bar, mem, len, offset);
+}
+
+int vfio_pci_get_host_irq(struct vfio_pci_device *pci, int vector)
+{
+	__autofree char *name = NULL, *line = NULL;
+	size_t n = 0;
+	int irq = -1;
+	FILE *fp;
+	int ret;
+
+	/* the names vfio-pci gives the interrupts it requests */
+	switch (pci->dev.irq_info.index) {
+	case VFIO_PCI_MSIX_IRQ_INDEX:
+		ret = asprintf(&name, " vfio-msix[%d](%s)", vector, pci->bdf);
+		break;
+	case VFIO_PCI_MSI_IRQ_INDEX:
+		ret = asprintf(&name, " vfio-msi[%d](%s)", vector, pci->bdf);
+		break;
+	default:
+		ret = asprintf(&name, " vfio-intx(%s)", pci->bdf);
+		break;
+	}
+
+	if (ret < 0) {
+		name = NULL;
+		log_debug("asprintf failed\n");
+		return -1;
+	}
+
+	fp = fopen("/proc/interrupts", "r");
+	if (!fp) {
+		log_debug("could not open /proc/interrupts\n");
+		return -1;
+	}
+
+	while (getline(&line, &n, fp) >= 0) {
+		char *p, *end;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		p = strstr(line, name);
+		if (!p || p[strlen(name)] != '\0')
+			continue;
+
+		errno = 0;
+		irq = (int)strtol(line, &end, 10);
+		if (errno || end == line || *end != ':')
+			irq = -1;
+
+		break;
+	}
+
+	log_fatal_if(fclose(fp), "fclose\n");
+
+	if (irq < 0) {
+		log_debug("no host irq for vector %d (is it enabled?)\n", vector);
+
+		errno = ENOENT;
+		return -1;
+	}
+
+	return irq;
+}
+
+int vfio_pci_set_irq_affinity(struct vfio_pci_device *pci, int vector, int cpu)
+{
+	__autofree char *path = NULL;
+	char buf[16];
+	int irq, len;
+
+	irq = vfio_pci_get_host_irq(pci, vector);
+	if (irq < 0)
+		return -1;
+
+	if (asprintf(&path, "/proc/irq/%d/smp_affinity_list", irq) < 0) {
+		path = NULL;
+		log_debug("asprintf failed\n");
+		return -1;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%d\n", cpu);
+
+	if (writeall(path, buf, (size_t)len) < 0) {
+		log_debug("could not set affinity of irq %d: %s\n", irq, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 {
 	pci->bdf = bdf;
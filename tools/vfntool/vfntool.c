@@ -24,7 +24,7 @@
 #include "ccan/str/str.h"
 
 static char *bdf = "";
-static bool show_usage, verbose, reset;
+static bool show_usage, verbose, reset, list;
 
 static struct opt_table opts[] = {
 	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
@@ -32,10 +32,37 @@ static struct opt_table opts[] = {
 
 	OPT_WITH_ARG("-d|--device BDF", opt_set_charp, opt_show_charp, &bdf, "pci device"),
 	OPT_WITHOUT_ARG("-x|--reset", opt_set_bool, &reset, "reset"),
+	OPT_WITHOUT_ARG("-l|--list", opt_set_bool, &list, "list nvme devices"),
 
 	OPT_ENDTABLE,
 };
 
+static int do_list(void)
+{
+	struct pci_topology topo;
+
+	if (pci_topology_scan(&topo, 0x010800, 0xffff00))
+		err(1, "could not scan pci devices");
+
+	for (int i = 0; i < topo.ndevs; i++) {
+		struct pci_device_info *info = &topo.devs[i];
+
+		printf("%s %04x:%04x driver %s numa %d", info->bdf, info->vendor, info->device,
+		       info->driver[0] ? info->driver : "(none)", info->numa_node);
+
+		if (verbose)
+			printf(" link %s x%d iommu group %s",
+			       info->link_speed[0] ? info->link_speed : "?", info->link_width,
+			       info->iommu_group[0] ? info->iommu_group : "(none)");
+
+		printf("\n");
+	}
+
+	pci_topology_free(&topo);
+
+	return 0;
+}
+
 static int do_bind(const char *target)
 {
 	unsigned long long vid, did, classcode;
@@ -99,6 +126,9 @@ int main(int argc, char **argv)
 	if (show_usage)
 		opt_usage_and_exit(NULL);
 
+	if (list)
+		return do_list();
+
 	if (streq(bdf, ""))
 		opt_usage_exit_fail("missing --device parameter");
 